@@ -0,0 +1,101 @@
+#!/bin/sh
+# SquashFS delta tools
+# (c) 2014 Michał Górny
+# Released under the terms of the 2-clause BSD license
+#
+# Generates a pair of synthetic images and runs the per-stage and
+# end-to-end benchmarks on them. Image parameters can be overriden
+# through the environment, e.g.:
+#
+#   make bench BENCH_FILES=20000 BENCH_MUTATE=10 BENCH_COMPRESSION=lzo
+#
+# BENCH_DUPLICATE=<percent> makes some files copies of others.
+
+set -e
+
+: ${BENCH_DIR:=bench-data}
+: ${BENCH_FILES:=2000}
+: ${BENCH_BLOCK_SIZE:=131072}
+: ${BENCH_MIN_SIZE:=1024}
+: ${BENCH_MAX_SIZE:=1048576}
+: ${BENCH_FRAGMENT_RATIO:=0.5}
+: ${BENCH_MUTATE:=5}
+: ${BENCH_SEED:=1}
+: ${BENCH_RUNS:=3}
+
+params="-n ${BENCH_FILES} -b ${BENCH_BLOCK_SIZE} -m ${BENCH_MIN_SIZE}"
+params="${params} -M ${BENCH_MAX_SIZE} -f ${BENCH_FRAGMENT_RATIO}"
+params="${params} -p ${BENCH_MUTATE} -s ${BENCH_SEED}"
+[ -n "${BENCH_COMPRESSION}" ] && params="${params} -c ${BENCH_COMPRESSION}"
+[ -n "${BENCH_DUPLICATE}" ] && params="${params} -d ${BENCH_DUPLICATE}"
+
+mkdir -p "${BENCH_DIR}"
+source="${BENCH_DIR}/source.sqfs"
+target="${BENCH_DIR}/target.sqfs"
+
+# images are deterministic, regenerate only if parameters changed
+if [ ! -f "${source}" ] || [ "$(cat "${BENCH_DIR}/params" 2>/dev/null)" != "${params}" ]
+then
+	echo "Generating images: ${params}"
+	./sqfsgen ${params} "${source}" "${target}"
+	echo "${params}" > "${BENCH_DIR}/params"
+fi
+
+echo "Source: $(wc -c < "${source}") bytes, target: $(wc -c < "${target}") bytes"
+echo
+./sqdbench -r "${BENCH_RUNS}" "${source}" "${target}"
+
+echo
+if command -v xdelta3 >/dev/null 2>&1
+then
+	bytes=$(( $(wc -c < "${source}") + $(wc -c < "${target}") ))
+	start=$(date +%s.%N)
+	./squashdelta "${source}" "${target}" "${BENCH_DIR}/patch" 2>/dev/null
+	end=$(date +%s.%N)
+
+	echo "${start} ${end} ${bytes} $(wc -c < "${BENCH_DIR}/patch")" | awk '{
+		t = $2 - $1;
+		printf "%-38s%12.1f MB/s%23s%10.3f s\n", "end-to-end", $3 / t / 1e6, "", t;
+		printf "%-38s%12d bytes\n", "patch size", $4;
+	}'
+
+	# the encoder levels, to recalibrate the throughputs in profile.cxx;
+	# the rate is of the expanded target fed to xdelta3
+	echo
+	for spec in auto level=1,secondary=none level=3,secondary=fgk \
+		level=6,secondary=djw level=9,secondary=djw level=9,secondary=lzma
+	do
+		if [ "${spec}" = auto ]
+		then
+			set --
+		else
+			set -- -X "${spec}"
+		fi
+
+		start=$(date +%s.%N)
+		./squashdelta "$@" "${source}" "${target}" "${BENCH_DIR}/patch" 2>/dev/null
+		end=$(date +%s.%N)
+
+		echo "${spec} ${start} ${end} $(wc -c < "${BENCH_DIR}/patch")" | awk '{
+			printf "%-38s%12d bytes%18s%10.3f s\n", "encoder " $1, $4, "", $3 - $2;
+		}'
+	done
+
+	# the server keeps the analysed images, so only the first request
+	# pays for the analysis
+	echo
+	sock="${BENCH_DIR}/sock"
+	./squashdelta --serve "${sock}" 2>/dev/null &
+	server=$!
+	while [ ! -S "${sock}" ]; do sleep 0.1; done
+
+	for c in 1 8
+	do
+		./sqdclient -c ${c} -n $(( c * 10 )) "${sock}" "${source}" "${target}"
+	done
+
+	kill ${server}
+	wait ${server} || true
+else
+	echo "xdelta3 not found, skipping the end-to-end benchmark"
+fi
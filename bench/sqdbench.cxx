@@ -0,0 +1,641 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/**
+ * Per-stage microbenchmarks on a pair of SquashFS images.
+ *
+ * Each stage is repeated a few times and the best run is reported,
+ * in MB/s of processed data and blocks/s. A few self-checks of the
+ * results run first.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+extern "C"
+{
+#	include <getopt.h>
+#	include <unistd.h>
+}
+
+#include "blake3.hxx"
+#include "blocklist.hxx"
+#include "compressor.hxx"
+#include "delta.hxx"
+#include "extsort.hxx"
+#include "hash.hxx"
+#include "libsquashdelta.hxx"
+#include "normalise.hxx"
+#include "pool.hxx"
+#include "similarity.hxx"
+#include "squashfs.hxx"
+#include "uring.hxx"
+#include "util.hxx"
+
+struct stage_result
+{
+	double seconds;
+	uint64_t bytes;
+	uint64_t blocks;
+};
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* stage, const char* image,
+		const struct stage_result& r)
+{
+	std::cout << std::left << std::setw(28) << stage
+		<< std::setw(10) << image << std::right << std::fixed
+		<< std::setprecision(1)
+		<< std::setw(12) << r.bytes / r.seconds / 1e6 << " MB/s"
+		<< std::setw(14) << r.blocks / r.seconds << " blocks/s"
+		<< std::setprecision(3)
+		<< std::setw(10) << r.seconds << " s\n";
+}
+
+// keep the best of n runs, the first one usually warms the page cache
+template <class F>
+static struct stage_result best_of(int runs, F func)
+{
+	struct stage_result best;
+
+	best.seconds = 0;
+	for (int i = 0; i < runs; ++i)
+	{
+		double start = now();
+		struct stage_result r = func();
+		r.seconds = now() - start;
+
+		if (i == 0 || r.seconds < best.seconds)
+			best = r;
+	}
+
+	return best;
+}
+
+static struct stage_result bench_hash()
+{
+	const size_t length = 64 * 1024 * 1024;
+	const size_t block = 128 * 1024;
+	std::vector<char> buf(length);
+	struct stage_result r;
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < length; ++i)
+		buf[i] = i * 2654435761U >> 24;
+
+	for (size_t i = 0; i < length; i += block)
+		sum += murmurhash3(&buf[i], block, 0);
+
+	// keep the compiler from dropping the loop
+	if (sum == 0x12345678)
+		std::cerr << "";
+
+	r.bytes = length;
+	r.blocks = length / block;
+	return r;
+}
+
+static struct stage_result bench_sketch()
+{
+	const size_t length = 16 * 1024 * 1024;
+	const size_t block = 128 * 1024;
+	std::vector<char> buf(length);
+	struct block_sketch sketch;
+	struct stage_result r;
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < length; ++i)
+		buf[i] = i * 2654435761U >> 24;
+
+	for (size_t i = 0; i < length; i += block)
+	{
+		sketch_block(&buf[i], block, sketch);
+		sum += sketch.min[0];
+	}
+
+	if (sum == 0x12345678)
+		std::cerr << "";
+
+	r.bytes = length;
+	r.blocks = length / block;
+	return r;
+}
+
+// per thread, the digest pieces are hashed in parallel
+static struct stage_result bench_digest()
+{
+	const size_t length = 64 * 1024 * 1024;
+	const size_t piece = 1024 * 1024;
+	std::vector<char> buf(length);
+	struct stage_result r;
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < length; ++i)
+		buf[i] = i * 2654435761U >> 24;
+
+	for (size_t i = 0; i < length; i += piece)
+		sum += blake3_piece_cv(&buf[i], piece, i / blake3_chunk_size)
+			.words[0];
+
+	if (sum == 0x12345678)
+		std::cerr << "";
+
+	r.bytes = length;
+	r.blocks = length / piece;
+	return r;
+}
+
+// block lists of large files, with a few stored and sparse blocks
+static struct stage_result bench_block_list()
+{
+	const size_t count = 16 * 1024 * 1024;
+	std::vector<uint32_t> list(count);
+	struct stage_result r;
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		uint32_t len = 60000 + (i * 2654435761U >> 16) % 60000;
+
+		if (i % 61 == 0)
+			len = 0;
+		else if (i % 37 == 0)
+			len = 131072 | squashfs::block_size::uncompressed;
+		list[i] = htole32(len);
+	}
+
+	// files of a thousand blocks
+	for (size_t i = 0; i < count; i += 1000)
+	{
+		for_each_compressed_block(
+				reinterpret_cast<const le32*>(&list[i]),
+				std::min<size_t>(count - i, 1000), 0,
+				[&](uint64_t offset, uint32_t length) {
+					sum += offset ^ length;
+				});
+	}
+
+	if (sum == 0x12345678)
+		std::cerr << "";
+
+	r.bytes = count * sizeof(uint32_t);
+	r.blocks = count;
+	return r;
+}
+
+static const squashfs::super_block& read_super_block(MMAPFile& f)
+{
+	f.seek(0, std::ios::beg);
+	return f.read<squashfs::super_block>();
+}
+
+// count inode table blocks and their total uncompressed size
+static void inode_table_size(MMAPFile& f, Compressor& c,
+		size_t& blocks, size_t& bytes)
+{
+	const squashfs::super_block& sb = read_super_block(f);
+	MetadataBlockReader mbr(f, sb.inode_table_start, c);
+	MMAPFile pf(f);
+	char buf[squashfs::metadata_size];
+
+	blocks = 0;
+	bytes = 0;
+
+	pf.seek(sb.inode_table_start, std::ios::beg);
+	while (pf.getpos() < sb.directory_table_start)
+	{
+		uint16_t length = pf.read<le16>()
+			& ~squashfs::inode_size::uncompressed;
+		pf.seek(length);
+
+		bytes += mbr.read(buf, sizeof(buf));
+		++blocks;
+	}
+}
+
+static struct stage_result bench_metadata_reader(MMAPFile& f,
+		Compressor& c, size_t blocks, size_t bytes)
+{
+	const squashfs::super_block& sb = read_super_block(f);
+	MetadataReader mr(f, sb.inode_table_start, c);
+	struct stage_result r;
+
+	for (size_t left = bytes; left > 0;)
+	{
+		size_t step = left < 4096 ? left : 4096;
+
+		mr.peek(step);
+		mr.seek(step);
+		left -= step;
+	}
+
+	r.bytes = bytes;
+	r.blocks = blocks;
+	return r;
+}
+
+static struct stage_result bench_inode_reader(MMAPFile& f,
+		Compressor& c, size_t bytes)
+{
+	const squashfs::super_block& sb = read_super_block(f);
+	InodeReader ir(f, sb, c);
+	struct stage_result r;
+
+	for (uint32_t i = 0; i < sb.inodes; ++i)
+		ir.read();
+
+	r.bytes = bytes;
+	r.blocks = ir.block_num();
+	return r;
+}
+
+// with a session, the inode table is parsed on its thread pool
+static struct stage_result bench_get_blocks(MMAPFile& f, Compressor*& c,
+		std::list<struct compressed_block>& blocks,
+		const DeltaSession* session = 0)
+{
+	size_t block_size = 0;
+	struct stage_result r;
+
+	f.seek(0, std::ios::beg);
+	blocks = get_blocks(f, c, block_size, session);
+
+	r.bytes = f.getlen();
+	r.blocks = blocks.size();
+	return r;
+}
+
+// a small sort memory, so that the runs get merged
+static struct stage_result bench_get_blocks_external(MMAPFile& f,
+		Compressor*& c)
+{
+	size_t block_size = 0;
+	struct stage_result r;
+
+	f.seek(0, std::ios::beg);
+	BlockRunFile* table = get_blocks_external(f, c, block_size,
+			4 * 1024 * 1024, ".");
+
+	r.bytes = f.getlen();
+	r.blocks = table->size();
+	delete table;
+	return r;
+}
+
+static struct stage_result bench_write_unpacked(MMAPFile& f, Compressor& c,
+		std::list<struct compressed_block> blocks)
+{
+	const squashfs::super_block& sb = read_super_block(f);
+	TemporarySparseFileWriter out(f.settings());
+	struct stage_result r;
+
+	blocks.sort(sort_by_offset);
+
+	c.reset();
+	out.open(".");
+	write_unpacked_file(out, f, blocks, c, sb.block_size);
+
+	r.bytes = out.tell();
+	r.blocks = blocks.size();
+	out.close();
+	return r;
+}
+
+static void bench_image(const char* path, const char* label, int runs,
+		bool have_uring)
+{
+	MMAPFile f;
+	Compressor* c = 0;
+	std::list<struct compressed_block> blocks;
+	struct stage_result r;
+	struct io_settings io;
+
+	// the readers and writers pick the engine from the image
+	f.open(path, 0, MMAPFile::default_readahead, 0, &io);
+
+	// the first call also sets up the compressor
+	io.engine = io_engine::mmap;
+	r = best_of(runs, [&]() { return bench_get_blocks(f, c, blocks); });
+	report("get_blocks/mmap", label, r);
+
+	if (have_uring)
+	{
+		io.engine = io_engine::uring;
+		r = best_of(runs, [&]() { return bench_get_blocks(f, c, blocks); });
+		report("get_blocks/uring", label, r);
+	}
+
+	io.engine = io_engine::mmap;
+	{
+		ThreadPool workers;
+		struct sqdelta_thread_pool c_pool = workers.c_pool();
+		DeltaSession session;
+
+		session.set_thread_pool(&c_pool);
+		r = best_of(runs, [&]() {
+			return bench_get_blocks(f, c, blocks, &session); });
+		report("get_blocks/parallel", label, r);
+	}
+
+	r = best_of(runs, [&]() { return bench_get_blocks_external(f, c); });
+	report("get_blocks_external/mmap", label, r);
+
+	size_t md_blocks, md_bytes;
+	inode_table_size(f, *c, md_blocks, md_bytes);
+
+	r = best_of(runs, [&]() {
+		return bench_metadata_reader(f, *c, md_blocks, md_bytes); });
+	report("MetadataReader", label, r);
+
+	r = best_of(runs, [&]() {
+		return bench_inode_reader(f, *c, md_bytes); });
+	report("InodeReader", label, r);
+
+	io.engine = io_engine::mmap;
+	r = best_of(runs, [&]() {
+		return bench_write_unpacked(f, *c, blocks); });
+	report("write_unpacked_file/mmap", label, r);
+
+	if (have_uring)
+	{
+		io.engine = io_engine::uring;
+		r = best_of(runs, [&]() {
+			return bench_write_unpacked(f, *c, blocks); });
+		report("write_unpacked_file/uring", label, r);
+	}
+
+	delete c;
+}
+
+// the reference BLAKE3 test vectors, hashing the bytes i % 251
+static const struct
+{
+	size_t length;
+	const char* hash;
+} blake3_vectors[] = {
+	{ 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+	{ 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+	{ 1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+	{ 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+	{ 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+	{ 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+	{ 2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+	{ 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+	{ 3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+	{ 4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+	{ 4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+	{ 5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833" },
+	{ 5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff" },
+	{ 6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205" },
+	{ 6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f" },
+	{ 7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a" },
+	{ 7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817" },
+	{ 8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+	{ 8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+	{ 16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+	{ 31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+	{ 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+};
+
+static std::string hex_digest(const unsigned char digest[blake3_out_len])
+{
+	std::ostringstream out;
+
+	out << std::hex << std::setfill('0');
+	for (size_t i = 0; i < blake3_out_len; ++i)
+		out << std::setw(2) << static_cast<unsigned>(digest[i]);
+	return out.str();
+}
+
+// both the whole input hash and the root over the pieces of each
+// power-of-two size that splits the input
+static void check_blake3()
+{
+	const size_t count = sizeof(blake3_vectors) / sizeof(*blake3_vectors);
+	std::vector<unsigned char> buf(blake3_vectors[count - 1].length);
+	unsigned char digest[blake3_out_len];
+
+	for (size_t i = 0; i < buf.size(); ++i)
+		buf[i] = i % 251;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t length = blake3_vectors[i].length;
+
+		blake3_hash(&buf[0], length, digest);
+		if (hex_digest(digest) != blake3_vectors[i].hash)
+		{
+			std::ostringstream msg;
+			msg << "BLAKE3 of " << length << " bytes does not match";
+			throw std::runtime_error(msg.str());
+		}
+
+		for (size_t piece = blake3_chunk_size; piece < length; piece *= 2)
+		{
+			std::vector<struct blake3_cv> pieces;
+
+			for (size_t off = 0; off < length; off += piece)
+				pieces.push_back(blake3_piece_cv(&buf[off],
+						std::min(piece, length - off),
+						off / blake3_chunk_size));
+
+			blake3_root(pieces, digest);
+			if (hex_digest(digest) != blake3_vectors[i].hash)
+			{
+				std::ostringstream msg;
+				msg << "BLAKE3 of " << length << " bytes in pieces of "
+					<< piece << " does not match";
+				throw std::runtime_error(msg.str());
+			}
+		}
+	}
+
+	std::cout << std::left << std::setw(38) << "check blake3" << "ok\n";
+}
+
+// normalise the inode and fragment tables and restore them, with all
+// the blocks unique and with every third one common, so that some
+// fields straddle a common block
+static void check_normalise(const char* path, const char* label)
+{
+	MMAPFile f;
+	Compressor* c = 0;
+	size_t block_size = 0;
+
+	f.open(path);
+	std::list<struct compressed_block> blocks
+		= get_blocks(f, c, block_size);
+
+	for (int common = 0; common < 2; ++common)
+	{
+		std::unordered_set<size_t> unique_offsets;
+		block_replacements normalised, restored;
+		size_t index = 0;
+
+		for (std::list<struct compressed_block>::iterator i = blocks.begin();
+				i != blocks.end(); ++i)
+		{
+			if (!common || index++ % 3 != 0)
+				unique_offsets.insert(i->offset);
+		}
+
+		size_t fields = normalise_metadata(f, *c, unique_offsets,
+				normalised);
+		restored = normalised;
+		if (denormalise_metadata(f, *c, unique_offsets, restored) != fields
+				|| restored.size() != normalised.size())
+			throw std::runtime_error("Metadata not restored");
+
+		std::vector<char> buf(squashfs::metadata_size);
+		for (block_replacements::iterator i = restored.begin();
+				i != restored.end(); ++i)
+		{
+			// the offsets are of the data, past the length
+			MetadataBlockReader mbr(f, i->first - sizeof(le16), *c);
+			size_t length = mbr.read(&buf[0], buf.size());
+
+			if (length != i->second.size()
+					|| memcmp(&buf[0], &i->second[0], length))
+				throw std::runtime_error("Metadata restored incorrectly");
+		}
+	}
+
+	delete c;
+	std::cout << std::left << std::setw(28) << "check normalise"
+		<< std::setw(10) << label << "ok\n";
+}
+
+static const struct option long_opts[] = {
+	{ "runs", required_argument, 0, 'r' },
+	{ "check", no_argument, 0, 'c' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void print_usage(const char* prog)
+{
+	std::cerr << "Usage: " << prog << " [options] <source> <target>\n"
+		"\n"
+		"Options:\n"
+		"  -r, --runs <n>  repeat each stage n times, report the best (default: 3)\n"
+		"  -c, --check     run the self-checks only, skip the benchmarks\n";
+}
+
+int main(int argc, char* argv[])
+{
+	int runs = 3;
+	bool check_only = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "r:ch", long_opts, 0)) != -1)
+	{
+		switch (opt)
+		{
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'c':
+				check_only = true;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind < 2 || runs < 1)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// silence the progress output of get_blocks()
+	std::ostringstream devnull;
+	std::streambuf* cerr_buf = std::cerr.rdbuf(devnull.rdbuf());
+
+	try
+	{
+		// the timings are of no use if the results are wrong
+		check_blake3();
+		check_normalise(argv[optind], "source");
+		check_normalise(argv[optind + 1], "target");
+		if (check_only)
+		{
+			std::cerr.rdbuf(cerr_buf);
+			return 0;
+		}
+
+		struct stage_result r = best_of(runs, bench_hash);
+		report("murmurhash3", "-", r);
+		r = best_of(runs, bench_sketch);
+		report("sketch_block", "-", r);
+		r = best_of(runs, bench_digest);
+		report("blake3_piece_cv", "-", r);
+
+		static const char* const simd_names[] = {
+			"block_list/scalar", "block_list/sse2", "block_list/avx2" };
+		simd_level::simd_level best_simd = best_simd_level();
+		for (int i = simd_level::scalar; i <= best_simd; ++i)
+		{
+			selected_simd_level = static_cast<simd_level::simd_level>(i);
+			r = best_of(runs, bench_block_list);
+			report(simd_names[i], "-", r);
+		}
+		selected_simd_level = best_simd;
+
+		// compare the I/O engines where they are used
+		struct io_settings uring_io;
+		uring_io.engine = io_engine::uring;
+		bool have_uring = use_io_uring(&uring_io);
+
+		bench_image(argv[optind], "source", runs, have_uring);
+		bench_image(argv[optind + 1], "target", runs, have_uring);
+	}
+	catch (IOError& e)
+	{
+		std::cerr.rdbuf(cerr_buf);
+		std::cerr << "Program terminated abnormally:\n\t"
+			<< e.what() << "\n\terrno: " << strerror(e.errno_val) << "\n";
+		return 1;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr.rdbuf(cerr_buf);
+		std::cerr << "Program terminated abnormally:\n\t"
+			<< e.what() << "\n";
+		return 1;
+	}
+
+	std::cerr.rdbuf(cerr_buf);
+	return 0;
+}
@@ -0,0 +1,247 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/**
+ * Load test for squashdelta --serve.
+ *
+ * Each of the concurrent clients keeps its own connection and requests
+ * the same patch repeatedly. The latency percentiles and the total
+ * throughput are reported.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+extern "C"
+{
+#	include <sys/types.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#	include <getopt.h>
+#	include <unistd.h>
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char* path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&addr),
+				sizeof(addr)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+// read a line byte-wise, not to eat the patch following it
+static bool read_line(int fd, std::string& line)
+{
+	line.clear();
+	while (true)
+	{
+		char c;
+		ssize_t ret = read(fd, &c, 1);
+
+		if (ret != 1)
+			return false;
+		if (c == '\n')
+			return true;
+		line += c;
+	}
+}
+
+// send one request and read the whole reply, return false on errors
+static bool request(int fd, const std::string& req, std::string& status,
+		uint64_t& patch_size)
+{
+	const char* data = req.data();
+	size_t length = req.size();
+	char buf[65536];
+
+	while (length > 0)
+	{
+		ssize_t ret = send(fd, data, length, MSG_NOSIGNAL);
+		if (ret == -1)
+			return false;
+		data += ret;
+		length -= ret;
+	}
+
+	if (!read_line(fd, status))
+		return false;
+	if (status != "STREAM")
+		return status == "OK";
+
+	// the chunks of the patch, then the status
+	patch_size = 0;
+	while (true)
+	{
+		std::string chunk;
+
+		if (!read_line(fd, chunk))
+			return false;
+
+		uint64_t left = strtoull(chunk.c_str(), 0, 10);
+		if (left == 0)
+			break;
+
+		patch_size += left;
+		while (left > 0)
+		{
+			ssize_t ret = read(fd, buf,
+					std::min<uint64_t>(left, sizeof(buf)));
+
+			if (ret <= 0)
+				return false;
+			left -= ret;
+		}
+	}
+
+	return read_line(fd, status) && status == "OK";
+}
+
+static void print_usage(const char* prog)
+{
+	std::cerr << "Usage: " << prog
+		<< " [-c <clients>] [-n <requests>] <socket> <source> <target>\n";
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned clients = 1;
+	unsigned requests = 20;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:n:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'c':
+				clients = atoi(optarg);
+				break;
+			case 'n':
+				requests = atoi(optarg);
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind < 3 || clients == 0 || requests == 0)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	const char* socket_path = argv[optind];
+	std::string req = std::string("DELTA\t") + argv[optind + 1]
+		+ '\t' + argv[optind + 2] + "\t-\n";
+
+	std::mutex lock;
+	std::vector<double> latencies;
+	std::string error;
+	uint64_t patch_size = 0;
+
+	// requests are split evenly between the clients
+	std::vector<std::thread> threads;
+	double start = now();
+
+	for (unsigned i = 0; i < clients; ++i)
+	{
+		unsigned count = requests / clients + (i < requests % clients);
+
+		threads.push_back(std::thread([&, count]() {
+			std::vector<double> mine;
+			std::string status;
+			uint64_t size = 0;
+			int fd = connect_to(socket_path);
+
+			for (unsigned j = 0; fd != -1 && j < count; ++j)
+			{
+				double t = now();
+
+				if (!request(fd, req, status, size))
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					error = status.empty() ? strerror(errno) : status;
+					break;
+				}
+				mine.push_back(now() - t);
+			}
+
+			std::lock_guard<std::mutex> guard(lock);
+			if (fd == -1)
+				error = std::string("Unable to connect: ") + strerror(errno);
+			else
+				close(fd);
+			latencies.insert(latencies.end(), mine.begin(), mine.end());
+			patch_size = size;
+		}));
+	}
+
+	for (std::vector<std::thread>::iterator it = threads.begin();
+			it != threads.end(); ++it)
+		it->join();
+
+	double total = now() - start;
+
+	if (!error.empty())
+	{
+		std::cerr << "Request failed: " << error << "\n";
+		return 1;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+
+	size_t n = latencies.size();
+	std::cout << "clients: " << clients << ", requests: " << n
+		<< ", patch size: " << patch_size << " bytes\n"
+		<< std::fixed << std::setprecision(3)
+		<< "latency p50 " << latencies[n / 2]
+		<< " s, p90 " << latencies[n * 9 / 10]
+		<< " s, p99 " << latencies[n * 99 / 100]
+		<< " s, max " << latencies[n - 1] << " s\n"
+		<< std::setprecision(1)
+		<< "throughput " << n / total << " requests/s\n";
+
+	return 0;
+}
@@ -0,0 +1,826 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+/**
+ * Deterministic SquashFS 4.0 image generator for benchmarks.
+ *
+ * Writes a pair of images (source and target) holding a single
+ * directory of regular files. The target is a copy of the source with
+ * a given percentage of files mutated. Some files can be copies of earlier
+ * ones, stored again as with mksquashfs -no-duplicates. The same options
+ * and seed always produce byte-identical images.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#	include <getopt.h>
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#ifdef ENABLE_LZO
+#	include <lzo/lzo1x.h>
+#endif
+#ifdef ENABLE_LZ4
+#	include <lz4.h>
+#endif
+
+#include "squashfs.hxx"
+#include "util.hxx"
+
+typedef std::vector<unsigned char> bytes;
+
+// xorshift64*, good enough and stable across platforms
+class Random
+{
+	uint64_t state;
+
+public:
+	Random(uint64_t seed)
+		: state(seed ? seed : 0x9e3779b97f4a7c15ULL)
+	{
+		// scramble weak seeds
+		for (int i = 0; i < 4; ++i)
+			next();
+	}
+
+	uint64_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545f4914f6cdd1dULL;
+	}
+
+	uint32_t below(uint32_t n)
+	{
+		return next() % n;
+	}
+
+	double unit()
+	{
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+};
+
+static void put_le16(bytes& b, uint16_t v)
+{
+	b.push_back(v & 0xff);
+	b.push_back(v >> 8);
+}
+
+static void put_le32(bytes& b, uint32_t v)
+{
+	put_le16(b, v & 0xffff);
+	put_le16(b, v >> 16);
+}
+
+static void put_le64(bytes& b, uint64_t v)
+{
+	put_le32(b, v & 0xffffffff);
+	put_le32(b, v >> 32);
+}
+
+class BlockCompressor
+{
+public:
+	virtual ~BlockCompressor() { }
+
+	virtual uint16_t id() const = 0;
+	// returns 0 if the data does not compress
+	virtual size_t compress(const unsigned char* in, size_t length,
+			unsigned char* out, size_t out_size) = 0;
+	virtual void write_options(bytes& out) = 0;
+};
+
+#ifdef ENABLE_LZ4
+class LZ4BlockCompressor : public BlockCompressor
+{
+public:
+	virtual uint16_t id() const
+	{
+		return squashfs::compression::lz4;
+	}
+
+	virtual size_t compress(const unsigned char* in, size_t length,
+			unsigned char* out, size_t out_size)
+	{
+		int ret = LZ4_compress_default(
+				static_cast<const char*>(static_cast<const void*>(in)),
+				static_cast<char*>(static_cast<void*>(out)),
+				length, out_size);
+
+		return ret > 0 ? ret : 0;
+	}
+
+	virtual void write_options(bytes& out)
+	{
+		// legacy stream version, no HC
+		put_le32(out, 1);
+		put_le32(out, 0);
+	}
+};
+#endif /*ENABLE_LZ4*/
+
+#ifdef ENABLE_LZO
+class LZOBlockCompressor : public BlockCompressor
+{
+	std::vector<unsigned char> workspace;
+	std::vector<unsigned char> tmp;
+
+public:
+	LZOBlockCompressor()
+		: workspace(LZO1X_999_MEM_COMPRESS)
+	{
+		if (lzo_init() != LZO_E_OK)
+			throw std::runtime_error("lzo_init() failed");
+	}
+
+	virtual uint16_t id() const
+	{
+		return squashfs::compression::lzo;
+	}
+
+	virtual size_t compress(const unsigned char* in, size_t length,
+			unsigned char* out, size_t out_size)
+	{
+		// lzo1x_999 level 8, optimized -- matches mksquashfs defaults
+		lzo_uint out_bytes = out_size;
+		if (lzo1x_999_compress_level(in, length, out, &out_bytes,
+					&workspace[0], 0, 0, 0, 8) != LZO_E_OK)
+			return 0;
+		if (out_bytes >= length)
+			return 0;
+
+		tmp.resize(length);
+		lzo_uint tmp_bytes = length;
+		if (lzo1x_optimize(out, out_bytes, &tmp[0], &tmp_bytes, 0)
+				!= LZO_E_OK)
+			return 0;
+
+		return out_bytes;
+	}
+
+	virtual void write_options(bytes& out)
+	{
+	}
+};
+#endif /*ENABLE_LZO*/
+
+// packs data into 8 KiB metadata blocks
+class MetadataWriter
+{
+	BlockCompressor& c;
+	bytes pending;
+
+public:
+	bytes out;
+	// start offsets of the blocks within out
+	std::vector<size_t> block_starts;
+
+	MetadataWriter(BlockCompressor& new_c)
+		: c(new_c)
+	{
+	}
+
+	// offset of the next byte, split into block start and offset
+	size_t uncompressed_pos() const
+	{
+		return block_starts.size() * squashfs::metadata_size
+			+ pending.size();
+	}
+
+	void append(const bytes& data)
+	{
+		for (size_t i = 0; i < data.size(); ++i)
+		{
+			pending.push_back(data[i]);
+			if (pending.size() == squashfs::metadata_size)
+				flush();
+		}
+	}
+
+	void flush()
+	{
+		if (pending.empty())
+			return;
+
+		unsigned char buf[squashfs::metadata_size];
+		size_t length = c.compress(&pending[0], pending.size(),
+				buf, sizeof(buf));
+
+		block_starts.push_back(out.size());
+		if (length > 0 && length < pending.size())
+		{
+			put_le16(out, length);
+			out.insert(out.end(), buf, buf + length);
+		}
+		else
+		{
+			put_le16(out, pending.size()
+					| squashfs::inode_size::uncompressed);
+			out.insert(out.end(), pending.begin(), pending.end());
+		}
+
+		pending.clear();
+	}
+
+	// metadata reference for the byte at given uncompressed position
+	uint64_t reference(size_t pos) const
+	{
+		size_t block = pos / squashfs::metadata_size;
+		return (static_cast<uint64_t>(block_starts.at(block)) << 16)
+			| (pos % squashfs::metadata_size);
+	}
+};
+
+struct generator_options
+{
+	uint32_t files;
+	uint32_t block_size;
+	uint32_t min_size;
+	uint32_t max_size;
+	double fragment_ratio;
+	double mutate_ratio;
+	double duplicate_ratio;
+	uint64_t seed;
+};
+
+struct file_spec
+{
+	bytes content;
+	bool fragmented;
+};
+
+static const char* const words[] = {
+	"squash", "delta", "block", "inode", "fragment", "table", "lz4", "lzo",
+	"kernel", "module", "library", "config", "binary", "patch", "update",
+	"image", "offset", "length", "hash", "release", "build", "target",
+	"source", "metadata", "directory", "compress", "expand", "stream",
+	"\n", "\t", "0x", "=", ";", "{", "}", "(", ")", "/usr/lib", "/etc"
+};
+
+static void generate_content(bytes& out, size_t length, Random& r)
+{
+	const size_t nwords = sizeof(words) / sizeof(*words);
+
+	out.clear();
+	out.reserve(length);
+	while (out.size() < length)
+	{
+		// mostly text, with some binary noise to keep the ratio realistic
+		if (r.below(8) == 0)
+		{
+			uint64_t noise = r.next();
+			for (int i = 0; i < 8 && out.size() < length; ++i)
+				out.push_back((noise >> (i * 8)) & 0xff);
+		}
+		else
+		{
+			const char* w = words[r.below(nwords)];
+			for (; *w && out.size() < length; ++w)
+				out.push_back(*w);
+			if (out.size() < length)
+				out.push_back(' ');
+		}
+	}
+}
+
+static std::vector<struct file_spec> generate_files(
+		const struct generator_options& opts)
+{
+	std::vector<struct file_spec> files(opts.files);
+	double log_min = log(opts.min_size);
+	double log_max = log(opts.max_size);
+
+	for (uint32_t i = 0; i < opts.files; ++i)
+	{
+		Random r(opts.seed * 0x100000001b3ULL + i);
+
+		// log-uniform size distribution
+		size_t length = exp(log_min + (log_max - log_min) * r.unit());
+		generate_content(files[i].content, length, r);
+		files[i].fragmented = r.unit() < opts.fragment_ratio;
+	}
+
+	// a separate generator, so that the other files do not change
+	Random d(opts.seed * 0x9e3779b97f4a7c15ULL);
+	for (uint32_t i = 1; i < opts.files; ++i)
+	{
+		if (d.unit() < opts.duplicate_ratio)
+			files[i].content = files[d.below(i)].content;
+	}
+
+	return files;
+}
+
+static void mutate_files(std::vector<struct file_spec>& files,
+		const struct generator_options& opts)
+{
+	Random r(~opts.seed);
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (r.unit() >= opts.mutate_ratio)
+			continue;
+
+		bytes& c = files[i].content;
+		if (r.below(4) == 0)
+		{
+			// grow the file, shifting the following data
+			bytes extra;
+			generate_content(extra, 1 + r.below(opts.block_size), r);
+			c.insert(c.begin() + r.below(c.size() + 1),
+					extra.begin(), extra.end());
+		}
+		else
+		{
+			// small in-place edit
+			size_t pos = r.below(c.size());
+			for (size_t j = 0; j < 16 && pos + j < c.size(); ++j)
+				c[pos + j] = r.next() & 0xff;
+		}
+	}
+}
+
+static void write_data_block(bytes& image, const unsigned char* data,
+		size_t length, BlockCompressor& c, bytes& scratch,
+		uint32_t& size_field)
+{
+	size_t comp = c.compress(data, length, &scratch[0], scratch.size());
+
+	if (comp > 0 && comp < length)
+	{
+		image.insert(image.end(), scratch.begin(), scratch.begin() + comp);
+		size_field = comp;
+	}
+	else
+	{
+		image.insert(image.end(), data, data + length);
+		size_field = length | squashfs::block_size::uncompressed;
+	}
+}
+
+static bytes build_image(const std::vector<struct file_spec>& files,
+		const struct generator_options& opts, BlockCompressor& c)
+{
+	const uint32_t inode_count = files.size() + 1;
+	const uint64_t no_table = 0xffffffffffffffffULL;
+	uint16_t block_log = 0;
+
+	while ((1U << block_log) < opts.block_size)
+		++block_log;
+
+	bytes image(sizeof(squashfs::super_block));
+	bytes scratch(opts.block_size * 2 + 64);
+
+	// compression options
+	bytes copts;
+	c.write_options(copts);
+	if (!copts.empty())
+	{
+		put_le16(image, copts.size() | squashfs::inode_size::uncompressed);
+		image.insert(image.end(), copts.begin(), copts.end());
+	}
+
+	// data blocks and fragments
+	std::vector<uint64_t> start_blocks(files.size());
+	std::vector<std::vector<uint32_t> > block_lists(files.size());
+	std::vector<uint32_t> frag_index(files.size(), squashfs::invalid_frag);
+	std::vector<uint32_t> frag_offset(files.size(), 0);
+
+	bytes frag_buf;
+	bytes frag_table;
+	uint32_t fragments = 0;
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		const bytes& data = files[i].content;
+		size_t full = data.size() / opts.block_size;
+		size_t tail = data.size() % opts.block_size;
+
+		start_blocks[i] = image.size();
+
+		for (size_t j = 0; j <= full; ++j)
+		{
+			size_t length = j < full ? opts.block_size : tail;
+
+			if (length == 0)
+				break;
+			if (j == full && files[i].fragmented)
+			{
+				if (frag_buf.size() + length > opts.block_size)
+				{
+					uint32_t size_field;
+					put_le64(frag_table, image.size());
+					write_data_block(image, &frag_buf[0], frag_buf.size(),
+							c, scratch, size_field);
+					put_le32(frag_table, size_field);
+					put_le32(frag_table, 0);
+
+					++fragments;
+					frag_buf.clear();
+				}
+
+				frag_index[i] = fragments;
+				frag_offset[i] = frag_buf.size();
+				frag_buf.insert(frag_buf.end(), data.begin() + j * opts.block_size,
+						data.end());
+				break;
+			}
+
+			uint32_t size_field;
+			write_data_block(image, &data[j * opts.block_size], length,
+					c, scratch, size_field);
+			block_lists[i].push_back(size_field);
+		}
+	}
+
+	if (!frag_buf.empty())
+	{
+		uint32_t size_field;
+		put_le64(frag_table, image.size());
+		write_data_block(image, &frag_buf[0], frag_buf.size(),
+				c, scratch, size_field);
+		put_le32(frag_table, size_field);
+		put_le32(frag_table, 0);
+
+		++fragments;
+	}
+
+	// inode table: files first, root directory last (like mksquashfs)
+	MetadataWriter inodes(c);
+	std::vector<size_t> inode_pos(inode_count);
+	const uint32_t mtime = 1400000000;
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		bytes in;
+		bool large = start_blocks[i] > 0xffffffffULL;
+
+		put_le16(in, large ? squashfs::inode::type::lreg
+				: squashfs::inode::type::reg);
+		put_le16(in, 0644);
+		put_le16(in, 0);
+		put_le16(in, 0);
+		put_le32(in, mtime);
+		put_le32(in, i + 1);
+
+		if (large)
+		{
+			put_le64(in, start_blocks[i]);
+			put_le64(in, files[i].content.size());
+			put_le64(in, 0);
+			put_le32(in, 1);
+			put_le32(in, frag_index[i]);
+			put_le32(in, frag_offset[i]);
+			put_le32(in, squashfs::invalid_frag);
+		}
+		else
+		{
+			put_le32(in, start_blocks[i]);
+			put_le32(in, frag_index[i]);
+			put_le32(in, frag_offset[i]);
+			put_le32(in, files[i].content.size());
+		}
+
+		for (size_t j = 0; j < block_lists[i].size(); ++j)
+			put_le32(in, block_lists[i][j]);
+
+		inode_pos[i] = inodes.uncompressed_pos();
+		inodes.append(in);
+	}
+
+	// the directory listing depends only on file inode positions,
+	// and the root listing always starts at the beginning of the table
+	bytes listing;
+	for (size_t i = 0; i < files.size();)
+	{
+		size_t block = inode_pos[i] / squashfs::metadata_size;
+		size_t j = i;
+
+		// one header per 256 entries sharing an inode block
+		while (j < files.size() && j - i < 256
+				&& inode_pos[j] / squashfs::metadata_size == block)
+			++j;
+
+		put_le32(listing, j - i - 1);
+		put_le32(listing, block);
+		put_le32(listing, i + 1);
+
+		for (size_t k = i; k < j; ++k)
+		{
+			char name[16];
+			int len = snprintf(name, sizeof(name), "f%08zu", k);
+
+			put_le16(listing, inode_pos[k] % squashfs::metadata_size);
+			put_le16(listing, k - i);
+			put_le16(listing, squashfs::inode::type::reg);
+			put_le16(listing, len - 1);
+			listing.insert(listing.end(), name, name + len);
+		}
+
+		i = j;
+	}
+
+	{
+		bytes in;
+
+		put_le16(in, squashfs::inode::type::ldir);
+		put_le16(in, 0755);
+		put_le16(in, 0);
+		put_le16(in, 0);
+		put_le32(in, mtime);
+		put_le32(in, inode_count);
+		put_le32(in, 2);
+		put_le32(in, listing.size() + 3);
+		put_le32(in, 0);
+		put_le32(in, inode_count + 1);
+		put_le16(in, 0);
+		put_le16(in, 0);
+		put_le32(in, squashfs::invalid_frag);
+
+		inode_pos[files.size()] = inodes.uncompressed_pos();
+		inodes.append(in);
+	}
+	inodes.flush();
+
+	// the header block numbers are relative to the inode table,
+	// and are only known after compression
+	for (size_t pos = 0; pos < listing.size();)
+	{
+		uint32_t count = listing[pos] | (listing[pos + 1] << 8);
+		uint32_t block = listing[pos + 4] | (listing[pos + 5] << 8)
+			| (listing[pos + 6] << 16) | (listing[pos + 7] << 24);
+		uint32_t start = inodes.block_starts[block];
+
+		for (int k = 0; k < 4; ++k)
+			listing[pos + 4 + k] = (start >> (k * 8)) & 0xff;
+
+		pos += 12;
+		for (uint32_t k = 0; k <= count; ++k)
+		{
+			uint32_t name_len = (listing[pos + 6] | (listing[pos + 7] << 8)) + 1;
+			pos += 8 + name_len;
+		}
+	}
+
+	MetadataWriter dirs(c);
+	dirs.append(listing);
+	dirs.flush();
+
+	uint64_t inode_table_start = image.size();
+	image.insert(image.end(), inodes.out.begin(), inodes.out.end());
+	uint64_t directory_table_start = image.size();
+	image.insert(image.end(), dirs.out.begin(), dirs.out.end());
+
+	// fragment table: entries in metadata blocks, then the index
+	uint64_t fragment_table_start = no_table;
+	if (fragments > 0)
+	{
+		MetadataWriter frags(c);
+		frags.append(frag_table);
+		frags.flush();
+
+		uint64_t frags_start = image.size();
+		image.insert(image.end(), frags.out.begin(), frags.out.end());
+
+		fragment_table_start = image.size();
+		for (size_t i = 0; i < frags.block_starts.size(); ++i)
+			put_le64(image, frags_start + frags.block_starts[i]);
+	}
+
+	// id table with a single root id
+	MetadataWriter ids(c);
+	bytes id_list;
+	put_le32(id_list, 0);
+	ids.append(id_list);
+	ids.flush();
+
+	uint64_t ids_start = image.size();
+	image.insert(image.end(), ids.out.begin(), ids.out.end());
+	uint64_t id_table_start = image.size();
+	put_le64(image, ids_start);
+
+	uint64_t bytes_used = image.size();
+
+	bytes sb;
+	put_le32(sb, squashfs::magic);
+	put_le32(sb, inode_count);
+	put_le32(sb, mtime);
+	put_le32(sb, opts.block_size);
+	put_le32(sb, fragments);
+	put_le16(sb, c.id());
+	put_le16(sb, block_log);
+	// no xattrs, no NFS export table
+	put_le16(sb, 0x0200 | (copts.empty() ? 0
+				: squashfs::flags::compression_options));
+	put_le16(sb, 1);
+	put_le16(sb, 4);
+	put_le16(sb, 0);
+	put_le64(sb, inodes.reference(inode_pos[files.size()]));
+	put_le64(sb, bytes_used);
+	put_le64(sb, id_table_start);
+	put_le64(sb, no_table);
+	put_le64(sb, inode_table_start);
+	put_le64(sb, directory_table_start);
+	put_le64(sb, fragment_table_start);
+	put_le64(sb, no_table);
+	std::copy(sb.begin(), sb.end(), image.begin());
+
+	// mksquashfs pads to 4 KiB
+	image.resize((image.size() + 4095) / 4096 * 4096);
+
+	return image;
+}
+
+static void write_file(const char* path, const bytes& data)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f)
+		throw IOError("Unable to create output file", errno);
+
+	if (fwrite(&data[0], 1, data.size(), f) != data.size())
+	{
+		fclose(f);
+		throw IOError("Unable to write output file", errno);
+	}
+	if (fclose(f) == EOF)
+		throw IOError("Unable to write output file", errno);
+}
+
+static const struct option long_opts[] = {
+	{ "files", required_argument, 0, 'n' },
+	{ "block-size", required_argument, 0, 'b' },
+	{ "compression", required_argument, 0, 'c' },
+	{ "min-size", required_argument, 0, 'm' },
+	{ "max-size", required_argument, 0, 'M' },
+	{ "fragment-ratio", required_argument, 0, 'f' },
+	{ "mutate", required_argument, 0, 'p' },
+	{ "seed", required_argument, 0, 's' },
+	{ "duplicate", required_argument, 0, 'd' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void print_usage(const char* prog)
+{
+	std::cerr << "Usage: " << prog << " [options] <source-out> <target-out>\n"
+		"\n"
+		"Options:\n"
+		"  -n, --files <n>             number of regular files (default: 1000)\n"
+		"  -b, --block-size <bytes>    data block size (default: 131072)\n"
+		"  -c, --compression <algo>    lz4 or lzo (default: lz4 if available)\n"
+		"  -m, --min-size <bytes>      minimal file size (default: 1024)\n"
+		"  -M, --max-size <bytes>      maximal file size (default: 1048576)\n"
+		"  -f, --fragment-ratio <r>    fraction of files with tail fragments\n"
+		"                              (default: 0.5)\n"
+		"  -p, --mutate <percent>      percentage of files changed in target\n"
+		"                              (default: 5)\n"
+		"  -s, --seed <n>              random seed (default: 1)\n"
+		"  -d, --duplicate <percent>   percentage of files copying an earlier\n"
+		"                              one (default: 0)\n";
+}
+
+int main(int argc, char* argv[])
+{
+	struct generator_options opts;
+	std::string compression;
+	int opt;
+
+	opts.files = 1000;
+	opts.block_size = 131072;
+	opts.min_size = 1024;
+	opts.max_size = 1048576;
+	opts.fragment_ratio = 0.5;
+	opts.mutate_ratio = 0.05;
+	opts.seed = 1;
+	opts.duplicate_ratio = 0;
+
+#if defined(ENABLE_LZ4)
+	compression = "lz4";
+#elif defined(ENABLE_LZO)
+	compression = "lzo";
+#endif
+
+	while ((opt = getopt_long(argc, argv, "n:b:c:m:M:f:p:s:d:h",
+					long_opts, 0)) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				opts.files = strtoul(optarg, 0, 0);
+				break;
+			case 'b':
+				opts.block_size = strtoul(optarg, 0, 0);
+				break;
+			case 'c':
+				compression = optarg;
+				break;
+			case 'm':
+				opts.min_size = strtoul(optarg, 0, 0);
+				break;
+			case 'M':
+				opts.max_size = strtoul(optarg, 0, 0);
+				break;
+			case 'f':
+				opts.fragment_ratio = strtod(optarg, 0);
+				break;
+			case 'p':
+				opts.mutate_ratio = strtod(optarg, 0) / 100;
+				break;
+			case 's':
+				opts.seed = strtoull(optarg, 0, 0);
+				break;
+			case 'd':
+				opts.duplicate_ratio = strtod(optarg, 0) / 100;
+				break;
+			case 'h':
+				print_usage(argv[0]);
+				return 0;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (argc - optind < 2)
+	{
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if (opts.block_size < 4096 || opts.block_size > 1048576
+			|| (opts.block_size & (opts.block_size - 1)))
+	{
+		std::cerr << "Block size must be a power of two in 4 KiB..1 MiB\n";
+		return 1;
+	}
+	if (opts.files == 0 || opts.min_size == 0
+			|| opts.min_size > opts.max_size)
+	{
+		std::cerr << "Invalid file count or size range\n";
+		return 1;
+	}
+
+	BlockCompressor* c = 0;
+#ifdef ENABLE_LZ4
+	if (compression == "lz4")
+		c = new LZ4BlockCompressor();
+#endif
+#ifdef ENABLE_LZO
+	if (compression == "lzo")
+		c = new LZOBlockCompressor();
+#endif
+	if (!c)
+	{
+		std::cerr << "Compression '" << compression
+			<< "' unsupported or disabled at build time\n";
+		return 1;
+	}
+
+	try
+	{
+		std::vector<struct file_spec> files = generate_files(opts);
+		write_file(argv[optind], build_image(files, opts, *c));
+
+		mutate_files(files, opts);
+		write_file(argv[optind + 1], build_image(files, opts, *c));
+	}
+	catch (IOError& e)
+	{
+		std::cerr << "Program terminated abnormally:\n\t"
+			<< e.what() << "\n\terrno: " << strerror(e.errno_val) << "\n";
+		delete c;
+		return 1;
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << "Program terminated abnormally:\n\t"
+			<< e.what() << "\n";
+		delete c;
+		return 1;
+	}
+
+	delete c;
+	return 0;
+}
@@ -0,0 +1,250 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <cstring>
+
+#include "blake3.hxx"
+
+static const size_t block_len = 64;
+
+static const uint32_t iv[8] = {
+	0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL,
+	0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+};
+
+static const unsigned msg_permutation[16] = {
+	2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8
+};
+
+namespace node_flags
+{
+	enum node_flags
+	{
+		chunk_start = 1 << 0,
+		chunk_end = 1 << 1,
+		parent = 1 << 2,
+		root = 1 << 3
+	};
+}
+
+static uint32_t rotr(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static void g(uint32_t* s, int a, int b, int c, int d,
+		uint32_t mx, uint32_t my)
+{
+	s[a] += s[b] + mx;
+	s[d] = rotr(s[d] ^ s[a], 16);
+	s[c] += s[d];
+	s[b] = rotr(s[b] ^ s[c], 12);
+	s[a] += s[b] + my;
+	s[d] = rotr(s[d] ^ s[a], 8);
+	s[c] += s[d];
+	s[b] = rotr(s[b] ^ s[c], 7);
+}
+
+static void compress(const uint32_t cv[8], const uint32_t block[16],
+		uint64_t counter, uint32_t length, uint32_t flags,
+		uint32_t out[16])
+{
+	uint32_t m[16];
+	uint32_t s[16];
+
+	memcpy(m, block, sizeof(m));
+	memcpy(s, cv, 8 * sizeof(*s));
+	memcpy(s + 8, iv, 4 * sizeof(*s));
+	s[12] = counter;
+	s[13] = counter >> 32;
+	s[14] = length;
+	s[15] = flags;
+
+	for (int round = 0; round < 7; ++round)
+	{
+		g(s, 0, 4, 8, 12, m[0], m[1]);
+		g(s, 1, 5, 9, 13, m[2], m[3]);
+		g(s, 2, 6, 10, 14, m[4], m[5]);
+		g(s, 3, 7, 11, 15, m[6], m[7]);
+		g(s, 0, 5, 10, 15, m[8], m[9]);
+		g(s, 1, 6, 11, 12, m[10], m[11]);
+		g(s, 2, 7, 8, 13, m[12], m[13]);
+		g(s, 3, 4, 9, 14, m[14], m[15]);
+
+		uint32_t permuted[16];
+		for (int i = 0; i < 16; ++i)
+			permuted[i] = m[msg_permutation[i]];
+		memcpy(m, permuted, sizeof(m));
+	}
+
+	for (int i = 0; i < 8; ++i)
+	{
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+static void load_block(const unsigned char* p, size_t length,
+		uint32_t block[16])
+{
+	unsigned char buf[block_len];
+
+	// the last block is zero-padded
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, p, length);
+
+	for (int i = 0; i < 16; ++i)
+		block[i] = buf[i * 4] | (buf[i * 4 + 1] << 8)
+			| (buf[i * 4 + 2] << 16) | (uint32_t(buf[i * 4 + 3]) << 24);
+}
+
+void blake3_cv::to_bytes(unsigned char out[blake3_out_len]) const
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		out[i * 4] = words[i];
+		out[i * 4 + 1] = words[i] >> 8;
+		out[i * 4 + 2] = words[i] >> 16;
+		out[i * 4 + 3] = words[i] >> 24;
+	}
+}
+
+// the last compression of a node, deferred since the root one
+// gets the root flag
+struct node_output
+{
+	uint32_t cv[8];
+	uint32_t block[16];
+	uint64_t counter;
+	uint32_t length;
+	uint32_t flags;
+
+	struct blake3_cv chaining_value() const
+	{
+		uint32_t out[16];
+		struct blake3_cv ret;
+
+		compress(cv, block, counter, length, flags, out);
+		memcpy(ret.words, out, sizeof(ret.words));
+		return ret;
+	}
+
+	void root_hash(unsigned char hash[blake3_out_len]) const
+	{
+		struct blake3_cv ret;
+		uint32_t out[16];
+
+		compress(cv, block, 0, length, flags | node_flags::root, out);
+		memcpy(ret.words, out, sizeof(ret.words));
+		ret.to_bytes(hash);
+	}
+};
+
+static struct node_output chunk_output(const unsigned char* data,
+		size_t length, uint64_t chunk)
+{
+	struct node_output ret;
+	uint32_t flags = node_flags::chunk_start;
+
+	memcpy(ret.cv, iv, sizeof(ret.cv));
+	for (; length > block_len; data += block_len, length -= block_len)
+	{
+		uint32_t block[16];
+		uint32_t out[16];
+
+		load_block(data, block_len, block);
+		compress(ret.cv, block, chunk, block_len, flags, out);
+		memcpy(ret.cv, out, sizeof(ret.cv));
+		flags = 0;
+	}
+
+	load_block(data, length, ret.block);
+	ret.counter = chunk;
+	ret.length = length;
+	ret.flags = flags | node_flags::chunk_end;
+	return ret;
+}
+
+static struct node_output parent_output(const struct blake3_cv& left,
+		const struct blake3_cv& right)
+{
+	struct node_output ret;
+
+	memcpy(ret.cv, iv, sizeof(ret.cv));
+	memcpy(ret.block, left.words, sizeof(left.words));
+	memcpy(ret.block + 8, right.words, sizeof(right.words));
+	ret.counter = 0;
+	ret.length = block_len;
+	ret.flags = node_flags::parent;
+	return ret;
+}
+
+// the left subtree gets the largest power of two of the chunks (or pieces)
+// that leaves some for the right one
+static uint64_t left_size(uint64_t n)
+{
+	uint64_t ret = 1;
+
+	while (ret * 2 < n)
+		ret *= 2;
+	return ret;
+}
+
+static struct node_output subtree_output(const unsigned char* data,
+		size_t length, uint64_t first_chunk)
+{
+	if (length <= blake3_chunk_size)
+		return chunk_output(data, length, first_chunk);
+
+	uint64_t chunks = (length + blake3_chunk_size - 1) / blake3_chunk_size;
+	uint64_t left_chunks = left_size(chunks);
+	size_t left_length = left_chunks * blake3_chunk_size;
+
+	return parent_output(
+			subtree_output(data, left_length, first_chunk)
+				.chaining_value(),
+			subtree_output(data + left_length, length - left_length,
+				first_chunk + left_chunks).chaining_value());
+}
+
+void blake3_hash(const void* data, size_t length,
+		unsigned char out[blake3_out_len])
+{
+	subtree_output(static_cast<const unsigned char*>(data), length, 0)
+		.root_hash(out);
+}
+
+struct blake3_cv blake3_piece_cv(const void* data, size_t length,
+		uint64_t first_chunk)
+{
+	return subtree_output(static_cast<const unsigned char*>(data), length,
+			first_chunk).chaining_value();
+}
+
+static struct node_output pieces_output(
+		const std::vector<struct blake3_cv>& pieces, size_t first,
+		size_t count)
+{
+	size_t left = left_size(count);
+
+	return parent_output(
+			left > 1 ? pieces_output(pieces, first, left).chaining_value()
+				: pieces[first],
+			count - left > 1
+				? pieces_output(pieces, first + left, count - left)
+					.chaining_value()
+				: pieces[first + left]);
+}
+
+void blake3_root(const std::vector<struct blake3_cv>& pieces,
+		unsigned char out[blake3_out_len])
+{
+	pieces_output(pieces, 0, pieces.size()).root_hash(out);
+}
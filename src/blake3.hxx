@@ -0,0 +1,57 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_BLAKE3_HXX
+#define SDT_BLAKE3_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <vector>
+
+#include <cstdlib> // size_t
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+/**
+ * BLAKE3 hashing, in pieces: the input is split into pieces of
+ * a power-of-two number of chunks, each hashed on its own into
+ * the chaining value of its subtree, and the root is computed from
+ * these. So the pieces can be hashed in parallel, and verified
+ * one at a time.
+ */
+
+const size_t blake3_chunk_size = 1024;
+const size_t blake3_out_len = 32;
+
+struct blake3_cv
+{
+	uint32_t words[8];
+
+	// little-endian, as in the hash
+	void to_bytes(unsigned char out[blake3_out_len]) const;
+};
+
+// the hash of the whole input
+void blake3_hash(const void* data, size_t length,
+		unsigned char out[blake3_out_len]);
+
+// the chaining value of a piece starting at given chunk, a power-of-two
+// number of chunks long (the last piece may be shorter)
+struct blake3_cv blake3_piece_cv(const void* data, size_t length,
+		uint64_t first_chunk);
+// the hash of the input from the chaining values of its pieces, all but
+// the last one of the same size; needs at least two pieces
+void blake3_root(const std::vector<struct blake3_cv>& pieces,
+		unsigned char out[blake3_out_len]);
+
+#endif /*!SDT_BLAKE3_HXX*/
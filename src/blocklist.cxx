@@ -0,0 +1,185 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <stdexcept>
+
+#include <cstring>
+
+#ifdef ENABLE_SIMD
+#	include <immintrin.h>
+#endif
+
+#include "blocklist.hxx"
+#include "squashfs.hxx"
+
+simd_level::simd_level best_simd_level()
+{
+#ifdef ENABLE_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return simd_level::avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return simd_level::sse2;
+#endif
+	return simd_level::scalar;
+}
+
+simd_level::simd_level selected_simd_level = best_simd_level();
+
+// the flag bit, and the bits no valid length can have
+static const uint32_t uncompressed_bit = squashfs::block_size::uncompressed;
+static const uint32_t invalid_bits = ~((uncompressed_bit << 1) - 1);
+
+// decode entries [i, count), continuing the offsets from pos;
+// return the bits of invalid entries
+static uint32_t decode_scalar(const le32* list, size_t i, size_t count,
+		uint32_t& pos, struct decoded_block_list& out)
+{
+	uint32_t invalid = 0;
+
+	for (; i < count; ++i)
+	{
+		uint32_t v = list[i];
+		uint32_t len = v & ~uncompressed_bit;
+
+		invalid |= v & invalid_bits;
+		out.offset[i] = pos;
+		out.length[i] = len;
+		// if length == 0, it indicates a sparse block
+		if (v != 0 && !(v & uncompressed_bit))
+			out.compressed[i / 64] |= uint64_t(1) << (i % 64);
+		pos += len;
+	}
+
+	return invalid;
+}
+
+#ifdef ENABLE_SIMD
+
+// 4 entries per step, the prefix sum done by shifting within the register
+__attribute__((target("sse2")))
+static size_t decode_sse2(const le32* list, size_t count, uint32_t& pos,
+		uint32_t& invalid, struct decoded_block_list& out)
+{
+	const __m128i flag = _mm_set1_epi32(uncompressed_bit);
+	const __m128i inv = _mm_set1_epi32(invalid_bits);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i carry = _mm_set1_epi32(pos);
+	__m128i bad = zero;
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(list + i));
+		__m128i len = _mm_andnot_si128(flag, v);
+
+		bad = _mm_or_si128(bad, _mm_and_si128(v, inv));
+
+		// compressed: neither the flag, nor sparse
+		__m128i stored = _mm_cmpeq_epi32(_mm_and_si128(v, flag), flag);
+		__m128i sparse = _mm_cmpeq_epi32(v, zero);
+		int mask = ~_mm_movemask_ps(_mm_castsi128_ps(
+					_mm_or_si128(stored, sparse))) & 0xf;
+		out.compressed[i / 64] |= uint64_t(mask) << (i % 64);
+
+		// inclusive prefix sum
+		__m128i sum = _mm_add_epi32(len, _mm_slli_si128(len, 4));
+		sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out.offset + i),
+				_mm_add_epi32(carry, _mm_sub_epi32(sum, len)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out.length + i), len);
+
+		carry = _mm_add_epi32(carry, _mm_shuffle_epi32(sum, 0xff));
+	}
+
+	pos = _mm_cvtsi128_si32(carry);
+	invalid |= _mm_movemask_epi8(_mm_cmpeq_epi32(bad, zero)) != 0xffff;
+	return i;
+}
+
+// 8 entries per step, the prefix sum is carried across the lanes
+__attribute__((target("avx2")))
+static size_t decode_avx2(const le32* list, size_t count, uint32_t& pos,
+		uint32_t& invalid, struct decoded_block_list& out)
+{
+	const __m256i flag = _mm256_set1_epi32(uncompressed_bit);
+	const __m256i inv = _mm256_set1_epi32(invalid_bits);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i last = _mm256_set1_epi32(7);
+	__m256i carry = _mm256_set1_epi32(pos);
+	__m256i bad = zero;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		__m256i v = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(list + i));
+		__m256i len = _mm256_andnot_si256(flag, v);
+
+		bad = _mm256_or_si256(bad, _mm256_and_si256(v, inv));
+
+		__m256i stored = _mm256_cmpeq_epi32(_mm256_and_si256(v, flag), flag);
+		__m256i sparse = _mm256_cmpeq_epi32(v, zero);
+		int mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(
+					_mm256_or_si256(stored, sparse))) & 0xff;
+		out.compressed[i / 64] |= uint64_t(mask) << (i % 64);
+
+		// inclusive prefix sum within the 128-bit lanes,
+		// then the low lane total added to the high lane
+		__m256i sum = _mm256_add_epi32(len, _mm256_slli_si256(len, 4));
+		sum = _mm256_add_epi32(sum, _mm256_slli_si256(sum, 8));
+		__m256i low = _mm256_shuffle_epi32(sum, 0xff);
+		sum = _mm256_add_epi32(sum, _mm256_permute2x128_si256(low, low, 0x08));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out.offset + i),
+				_mm256_add_epi32(carry, _mm256_sub_epi32(sum, len)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out.length + i), len);
+
+		carry = _mm256_add_epi32(carry,
+				_mm256_permutevar8x32_epi32(sum, last));
+	}
+
+	pos = _mm_cvtsi128_si32(_mm256_castsi256_si128(carry));
+	invalid |= !_mm256_testz_si256(bad, bad);
+	return i;
+}
+
+#endif /*ENABLE_SIMD*/
+
+void decode_block_list(const le32* list, size_t count,
+		struct decoded_block_list& out)
+{
+	uint32_t pos = 0;
+	uint32_t invalid = 0;
+	size_t i = 0;
+
+	memset(out.compressed, 0, sizeof(out.compressed));
+
+	// the vector kernels do the whole steps, the rest is left over
+	switch (selected_simd_level)
+	{
+#ifdef ENABLE_SIMD
+		case simd_level::avx2:
+			i = decode_avx2(list, count, pos, invalid, out);
+			break;
+		case simd_level::sse2:
+			i = decode_sse2(list, count, pos, invalid, out);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	invalid |= decode_scalar(list, i, count, pos, out);
+	if (invalid)
+		throw std::runtime_error("Invalid block size in the block list");
+
+	out.total = pos;
+}
@@ -0,0 +1,93 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_BLOCKLIST_HXX
+#define SDT_BLOCKLIST_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+
+#include <cstdlib> // size_t
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "util.hxx"
+
+/**
+ * Bulk decoding of the file block lists, turning the block sizes
+ * into offsets, lengths and compressed flags.
+ */
+
+namespace simd_level
+{
+	enum simd_level
+	{
+		scalar,
+		sse2,
+		avx2
+	};
+}
+
+// kernel used by decode_block_list(), defaults to the best one
+// the CPU supports
+extern simd_level::simd_level selected_simd_level;
+
+simd_level::simd_level best_simd_level();
+
+const size_t block_list_chunk = 256;
+
+struct decoded_block_list
+{
+	// relative to the first block of the chunk; the lengths are
+	// below 2^24, so the offsets of a chunk fit in 32 bits
+	uint32_t offset[block_list_chunk];
+	uint32_t length[block_list_chunk];
+	// bit i set if block i is compressed (not stored, nor sparse)
+	uint64_t compressed[block_list_chunk / 64];
+	// length of all the blocks of the chunk
+	uint64_t total;
+};
+
+// decode up to block_list_chunk entries
+void decode_block_list(const le32* list, size_t count,
+		struct decoded_block_list& out);
+
+// call func(offset, length) for each compressed block of a file
+template <class F>
+void for_each_compressed_block(const le32* list, uint32_t count,
+		uint64_t start, F func)
+{
+	struct decoded_block_list d;
+
+	for (uint32_t i = 0; i < count; i += block_list_chunk)
+	{
+		size_t n = std::min<size_t>(count - i, block_list_chunk);
+
+		decode_block_list(list + i, n, d);
+
+		for (size_t w = 0; w < (n + 63) / 64; ++w)
+		{
+			for (uint64_t bits = d.compressed[w]; bits; bits &= bits - 1)
+			{
+				size_t j = w * 64 + __builtin_ctzll(bits);
+
+				func(start + d.offset[j], d.length[j]);
+			}
+		}
+
+		start += d.total;
+	}
+}
+
+#endif /*!SDT_BLOCKLIST_HXX*/
@@ -0,0 +1,238 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <cerrno>
+
+extern "C"
+{
+#	include <sys/types.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+}
+
+#include "checkpoint.hxx"
+#include "extsort.hxx"
+
+static const char manifest_name[] = "manifest";
+static const char partial_suffix[] = ".partial";
+
+static const uint32_t checkpoint_magic = 0x7371636bUL; // sqck
+// bump when the stage file layout changes
+static const uint32_t checkpoint_version = 1;
+
+CheckpointDir::CheckpointDir(const char* new_dir)
+	: dir(new_dir), loaded(false), serial(0)
+{
+}
+
+std::string CheckpointDir::path(const std::string& name) const
+{
+	return dir + '/' + name;
+}
+
+std::string CheckpointDir::partial_path(const std::string& name)
+{
+	std::ostringstream ret;
+
+	ret << path(name) << partial_suffix << '.' << getpid() << '.'
+		<< serial++;
+	return ret.str();
+}
+
+void CheckpointDir::load()
+{
+	if (loaded)
+		return;
+
+	if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST)
+		throw IOError("Unable to create the work directory", errno);
+
+	// a missing manifest is an empty one
+	std::ifstream in(path(manifest_name).c_str());
+	std::string line;
+
+	while (std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		std::string name;
+		struct checkpoint_entry entry;
+
+		if (fields >> name >> entry.length >> entry.digest)
+			manifest[name] = entry;
+	}
+
+	loaded = true;
+}
+
+void CheckpointDir::save()
+{
+	std::string new_path = partial_path(manifest_name);
+
+	{
+		std::ofstream out(new_path.c_str(), std::ios::trunc);
+
+		for (std::map<std::string, struct checkpoint_entry>::iterator
+				i = manifest.begin(); i != manifest.end(); ++i)
+			out << i->first << ' ' << i->second.length << ' '
+				<< i->second.digest << '\n';
+
+		out.flush();
+		if (!out)
+			throw IOError("Unable to write the manifest", errno);
+	}
+
+	int fd = ::open(new_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fsync(fd) == -1)
+	{
+		int err = errno;
+		if (fd != -1)
+			::close(fd);
+		throw IOError("Unable to sync the manifest", err);
+	}
+	::close(fd);
+
+	if (rename(new_path.c_str(), path(manifest_name).c_str()) == -1)
+		throw IOError("Unable to replace the manifest", errno);
+}
+
+bool CheckpointDir::find(const std::string& name,
+		struct checkpoint_entry& entry)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	load();
+
+	std::map<std::string, struct checkpoint_entry>::iterator i
+		= manifest.find(name);
+	if (i == manifest.end())
+		return false;
+
+	entry = i->second;
+	return true;
+}
+
+void CheckpointDir::commit(const std::string& name,
+		const std::string& partial, const struct checkpoint_entry& entry)
+{
+	// the stage has to be on disk before the manifest lists it
+	int fd = ::open(partial.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fsync(fd) == -1)
+	{
+		int err = errno;
+		if (fd != -1)
+			::close(fd);
+		throw IOError("Unable to sync the stage file", err);
+	}
+	::close(fd);
+
+	std::lock_guard<std::mutex> guard(lock);
+	load();
+
+	if (rename(partial.c_str(), path(name).c_str()) == -1)
+		throw IOError("Unable to move the stage file into place", errno);
+
+	manifest[name] = entry;
+	save();
+}
+
+void CheckpointDir::drop(const std::string& name)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	load();
+
+	if (manifest.erase(name))
+		save();
+	unlink(path(name).c_str());
+}
+
+void write_checkpoint_header(SparseFileWriter& outf)
+{
+	outf.write(checkpoint_magic);
+	outf.write(checkpoint_version);
+}
+
+void write_checkpoint_blocks(SparseFileWriter& outf,
+		const std::list<struct compressed_block>& blocks)
+{
+	outf.write(static_cast<uint64_t>(blocks.size()));
+	for (std::list<struct compressed_block>::const_iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		struct spilled_block b;
+
+		b.offset = i->offset;
+		b.length = i->length;
+		b.uncompressed_length = i->uncompressed_length;
+		b.hash = i->hash;
+
+		outf.write(b);
+	}
+}
+
+void write_checkpoint_order(SparseFileWriter& outf,
+		const std::vector<uint32_t>& order)
+{
+	outf.write(static_cast<uint64_t>(order.size()));
+	if (!order.empty())
+		outf.write(&order[0], order.size() * sizeof(order[0]));
+}
+
+void read_checkpoint_header(MMAPFile& f)
+{
+	f.seek(0, std::ios::beg);
+	if (f.getlen() < 2 * sizeof(uint32_t)
+			|| f.read<uint32_t>() != checkpoint_magic
+			|| f.read<uint32_t>() != checkpoint_version)
+		throw std::runtime_error("Not a stage file of this version");
+}
+
+// the number of records that follows, checked against the file length
+static uint64_t read_count(MMAPFile& f, size_t record_size)
+{
+	if (f.getlen() - f.getpos() < sizeof(uint64_t))
+		throw std::runtime_error("Truncated stage file");
+
+	uint64_t count = f.read<uint64_t>();
+	if (count > (f.getlen() - f.getpos()) / record_size)
+		throw std::runtime_error("Truncated stage file");
+	return count;
+}
+
+void read_checkpoint_blocks(MMAPFile& f,
+		std::list<struct compressed_block>& blocks)
+{
+	uint64_t count = read_count(f, sizeof(struct spilled_block));
+
+	blocks.clear();
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		const struct spilled_block& b = f.read<struct spilled_block>();
+		struct compressed_block block;
+
+		block.offset = b.offset;
+		block.length = b.length;
+		block.uncompressed_length = b.uncompressed_length;
+		block.hash = b.hash;
+
+		blocks.push_back(block);
+	}
+}
+
+void read_checkpoint_order(MMAPFile& f, std::vector<uint32_t>& order)
+{
+	uint64_t count = read_count(f, sizeof(uint32_t));
+	const uint32_t* data = count ? f.read_array<uint32_t>(count) : 0;
+
+	order.assign(data, data + count);
+}
@@ -0,0 +1,92 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_CHECKPOINT_HXX
+#define SDT_CHECKPOINT_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "delta.hxx"
+#include "util.hxx"
+
+/**
+ * Work directory of a resumable run.
+ *
+ * The outputs of the completed stages are kept there, named after
+ * the digests of their inputs, and listed in the manifest with their
+ * length and BLAKE3 digest. A stage file is written under a temporary
+ * name and renamed when complete, so an interrupted run leaves no
+ * partial stage behind; a stage is reused only if its file still
+ * matches the manifest.
+ */
+
+struct checkpoint_entry
+{
+	uint64_t length;
+	// BLAKE3, in hex
+	std::string digest;
+};
+
+class CheckpointDir
+{
+	std::string dir;
+	std::mutex lock;
+	std::map<std::string, struct checkpoint_entry> manifest;
+	bool loaded;
+	// keeps the partial files of concurrent writers apart
+	std::atomic<unsigned> serial;
+
+	void load();
+	void save();
+
+public:
+	CheckpointDir(const char* new_dir);
+
+	// where the stage file is, and a new path to write it to
+	// before commit()
+	std::string path(const std::string& name) const;
+	std::string partial_path(const std::string& name);
+
+	// the manifest entry of the stage, false if there is none
+	bool find(const std::string& name, struct checkpoint_entry& entry);
+	// sync the written stage file, move it into place and record it
+	void commit(const std::string& name, const std::string& partial,
+			const struct checkpoint_entry& entry);
+	// forget a stage file not matching its entry
+	void drop(const std::string& name);
+};
+
+// stage files start with a header, and hold lists of blocks (and block
+// orders) in the host byte order
+void write_checkpoint_header(SparseFileWriter& outf);
+void write_checkpoint_blocks(SparseFileWriter& outf,
+		const std::list<struct compressed_block>& blocks);
+void write_checkpoint_order(SparseFileWriter& outf,
+		const std::vector<uint32_t>& order);
+
+// throw std::runtime_error if the file is not a stage file
+void read_checkpoint_header(MMAPFile& f);
+void read_checkpoint_blocks(MMAPFile& f,
+		std::list<struct compressed_block>& blocks);
+void read_checkpoint_order(MMAPFile& f, std::vector<uint32_t>& order);
+
+#endif /*!SDT_CHECKPOINT_HXX*/
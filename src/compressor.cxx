@@ -20,6 +20,7 @@
 #endif
 
 #include "compressor.hxx"
+#include "trace.hxx"
 
 namespace compressor_id
 {
@@ -110,6 +111,8 @@ void LZOCompressor::reset()
 size_t LZOCompressor::decompress(void* dest, const void* src,
 		size_t length, size_t out_size)
 {
+	TraceSpan span("LZOCompressor::decompress");
+
 	const unsigned char* src2 = static_cast<const unsigned char*>(src);
 	unsigned char* dest2 = static_cast<unsigned char*>(dest);
 
@@ -194,6 +197,11 @@ uint32_t LZOCompressor::get_compression_value() const
 	return ret;
 }
 
+Compressor* LZOCompressor::clone() const
+{
+	return new LZOCompressor(*this);
+}
+
 #endif /*ENABLE_LZO*/
 
 #ifdef ENABLE_LZ4
@@ -261,6 +269,8 @@ void LZ4Compressor::setup(MetadataReader* coptsr)
 size_t LZ4Compressor::decompress(void* dest, const void* src,
 		size_t length, size_t out_size)
 {
+	TraceSpan span("LZ4Compressor::decompress");
+
 	const char* src2 = static_cast<const char*>(src);
 	char* dest2 = static_cast<char*>(dest);
 	int out;
@@ -283,4 +293,9 @@ uint32_t LZ4Compressor::get_compression_value() const
 	return ret;
 }
 
+Compressor* LZ4Compressor::clone() const
+{
+	return new LZ4Compressor(*this);
+}
+
 #endif /*ENABLE_LZ4*/
@@ -36,6 +36,9 @@ public:
 			size_t length, size_t out_size) = 0;
 
 	virtual uint32_t get_compression_value() const = 0;
+
+	// a copy with the same setup, for concurrent use
+	virtual Compressor* clone() const = 0;
 };
 
 #ifdef ENABLE_LZO
@@ -55,6 +58,8 @@ public:
 			size_t length, size_t out_size);
 
 	virtual uint32_t get_compression_value() const;
+
+	virtual Compressor* clone() const;
 };
 #endif /*ENABLE_LZO*/
 
@@ -72,6 +77,8 @@ public:
 			size_t length, size_t out_size);
 
 	virtual uint32_t get_compression_value() const;
+
+	virtual Compressor* clone() const;
 };
 #endif /*ENABLE_LZ4*/
 
@@ -0,0 +1,1104 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <iterator>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <typeinfo>
+
+#include <cassert>
+#include <cstring>
+
+extern "C"
+{
+#	include <arpa/inet.h>
+}
+
+#include "blocklist.hxx"
+#include "delta.hxx"
+#include "extsort.hxx"
+#include "hash.hxx"
+#include "squashfs.hxx"
+#include "trace.hxx"
+#include "uring.hxx"
+
+// collects a progress message, and passes it to the session at the end
+// of the full expression
+class ProgressMessage
+{
+	const DeltaSession* session;
+	std::ostringstream text;
+
+public:
+	ProgressMessage(const DeltaSession* new_session)
+		: session(new_session)
+	{
+	}
+
+	~ProgressMessage()
+	{
+		if (session)
+			session->message(text.str());
+	}
+
+	template <class T>
+	ProgressMessage& operator<<(const T& value)
+	{
+		if (session)
+			text << value;
+		return *this;
+	}
+};
+
+// report every this many blocks
+static const size_t progress_interval = 1024;
+
+bool sort_by_offset(const struct compressed_block& lhs,
+		const struct compressed_block& rhs)
+{
+	return lhs.offset < rhs.offset;
+}
+
+bool sort_by_len_hash(const struct compressed_block& lhs,
+		const struct compressed_block& rhs)
+{
+	if (lhs.length == rhs.length)
+		return lhs.hash < rhs.hash;
+	return lhs.length < rhs.length;
+}
+
+// call func(block, data) for each block in the list, in order;
+// with io_uring, the reads are issued ahead of the consumer
+template <class F>
+static void for_each_block_data(MMAPFile& f,
+		std::list<struct compressed_block>& blocks, size_t max_length,
+		F func)
+{
+#ifdef ENABLE_IO_URING
+	UringBlockReader ur;
+
+	if (ur.open(f.getfd(), max_length, f.settings()))
+	{
+		for (std::list<struct compressed_block>::iterator i = blocks.begin();
+				i != blocks.end(); ++i)
+			ur.add((*i).offset, (*i).length);
+
+		for (std::list<struct compressed_block>::iterator i = blocks.begin();
+				i != blocks.end(); ++i)
+			func(*i, ur.next());
+		return;
+	}
+#endif
+
+	MMAPFile mf(f);
+	mf.advise(access_pattern::sequential, true);
+
+	for (std::list<struct compressed_block>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		mf.seek((*i).offset, std::ios::beg);
+		func(*i, mf.read_array<char>((*i).length));
+	}
+}
+
+// blocks of the external-memory lists are processed in chunks
+// of an in-memory list, within the memory given
+static size_t chunk_size(size_t memory)
+{
+	// list nodes carry two pointers on top of the block
+	size_t ret = memory / (sizeof(struct compressed_block) + 2 * sizeof(void*));
+
+	return std::max<size_t>(ret, 1024);
+}
+
+// call func(chunk) for consecutive chunks of the run
+template <class F>
+static void for_each_chunk(BlockRunReader& r, size_t chunk_blocks, F func)
+{
+	struct compressed_block block;
+
+	for (bool more = true; more;)
+	{
+		std::list<struct compressed_block> chunk;
+
+		while (chunk.size() < chunk_blocks && (more = r.next(block)))
+			chunk.push_back(block);
+		if (!chunk.empty())
+			func(chunk);
+	}
+}
+
+// check the super block, and set up the compressor for the image
+static const squashfs::super_block& read_super_block(MMAPFile& f,
+		Compressor*& c, size_t& block_size)
+{
+	const squashfs::super_block& sb = f.read<squashfs::super_block>();
+
+	if (sb.s_magic != squashfs::magic)
+		throw std::runtime_error(
+				"File is not a valid SquashFS image (no magic).");
+	if (sb.s_major != 4 || sb.s_minor != 0)
+		throw std::runtime_error("File is not SquashFS 4.0");
+
+	if (!block_size)
+		block_size = sb.block_size;
+	else if (block_size != sb.block_size)
+		throw std::runtime_error("Input files have different block sizes");
+
+	// the inode and fragment scans jump to the tables at the end
+	if (sb.inode_table_start < f.getlen())
+		f.will_need(sb.inode_table_start,
+				f.getlen() - sb.inode_table_start);
+
+	switch (sb.compression)
+	{
+		case squashfs::compression::lzo:
+#ifdef ENABLE_LZO
+			if (!c)
+				c = new LZOCompressor();
+			else if (typeid(*c) != typeid(LZOCompressor))
+				throw std::runtime_error("The two files use different compressors");
+#else
+			throw std::runtime_error("LZO compression support disabled at build time");
+#endif
+			break;
+		case squashfs::compression::lz4:
+#ifdef ENABLE_LZ4
+			if (!c)
+				c = new LZ4Compressor();
+			else if (typeid(*c) != typeid(LZ4Compressor))
+				throw std::runtime_error("The two files use different compressors");
+#else
+			throw std::runtime_error("LZ4 compression support disabled at build time");
+#endif
+			break;
+		default:
+			throw std::runtime_error("Unsupported compression algorithm.");
+	}
+
+	MetadataReader coptsr(f, sizeof(sb), *c);
+	c->setup(sb.flags & squashfs::flags::compression_options
+			? &coptsr : 0);
+	coptsr.block_num();
+
+	return sb;
+}
+
+// inodes of a part of the inode table, the positions are uncompressed
+// offsets in the table
+struct inode_range
+{
+	uint64_t start;
+	uint64_t end;
+	uint32_t inodes;
+	std::vector<struct compressed_block> blocks;
+	// the speculated start was wrong, or the parse failed
+	bool failed;
+};
+
+// parse the inodes starting in [start, end), start being at an inode
+static void parse_inode_range(MMAPFile& f, const squashfs::super_block& sb,
+		Compressor& c, const std::vector<uint64_t>& block_offsets,
+		uint64_t start, uint64_t end, struct inode_range& out)
+{
+	out.start = start;
+	out.end = start;
+	out.inodes = 0;
+	out.blocks.clear();
+	out.failed = false;
+
+	if (start >= end)
+		return;
+
+	size_t first = start / squashfs::metadata_size;
+	uint64_t base = first * squashfs::metadata_size;
+	InodeReader ir(f, sb, c, block_offsets[first]);
+
+	ir.skip(start - base);
+	while (base + ir.tell() < end)
+	{
+		struct squashfs::file_blocks fb;
+
+		if (ir.read_file(fb))
+			for_each_compressed_block(fb.block_list, fb.block_count,
+					fb.start_block, [&](uint64_t offset, uint32_t length) {
+						struct compressed_block block;
+						block.offset = offset;
+						block.length = length;
+
+						out.blocks.push_back(block);
+					});
+		++out.inodes;
+	}
+
+	if (ir.irregular())
+		throw std::runtime_error("Short metadata block within the inode table");
+	out.end = base + ir.tell();
+}
+
+// metadata blocks per chunk of the parallel inode scan
+static const size_t inode_chunk_blocks = 16;
+
+// state shared with the pool tasks, which may start after the scan
+// is done and find nothing left to do
+struct inode_scan
+{
+	MMAPFile f;
+	squashfs::super_block sb;
+	std::unique_ptr<Compressor> c;
+	std::vector<uint64_t> block_offsets;
+	uint64_t total;
+
+	std::vector<struct inode_range> ranges;
+	std::atomic<size_t> next;
+
+	std::mutex lock;
+	std::condition_variable finished_cond;
+	size_t finished;
+
+	inode_scan(const MMAPFile& new_f)
+		: f(new_f), next(0), finished(0)
+	{
+	}
+};
+
+// guess the first inode boundary within the block
+static bool speculate_inode_start(struct inode_scan& st, Compressor& c,
+		size_t block, uint64_t& start)
+{
+	char buf[3 * squashfs::metadata_size];
+	size_t length = 0;
+	MetadataBlockReader mbr(st.f, st.block_offsets[block], c);
+
+	// a few blocks, so that the chain of inodes can be long enough
+	for (size_t i = block; i < block + 3 && i < st.block_offsets.size(); ++i)
+		length += mbr.read(buf + length, squashfs::metadata_size);
+
+	size_t search = std::min<size_t>(length, squashfs::metadata_size);
+	size_t offset = InodeReader::find_inode(buf, length, search, st.sb);
+
+	start = block * squashfs::metadata_size + offset;
+	return offset != search;
+}
+
+static void inode_scan_worker(std::shared_ptr<struct inode_scan> st)
+{
+	std::unique_ptr<Compressor> c;
+
+	for (size_t k; (k = st->next++) < st->ranges.size();)
+	{
+		struct inode_range& r = st->ranges[k];
+		size_t block = k * inode_chunk_blocks;
+		uint64_t end = std::min<uint64_t>(st->total,
+				(block + inode_chunk_blocks) * squashfs::metadata_size);
+
+		try
+		{
+			TraceSpan span("InodeReader::read_chunk");
+			uint64_t start = 0;
+
+			if (!c)
+				c.reset(st->c->clone());
+
+			if (k == 0 || speculate_inode_start(*st, *c, block, start))
+				parse_inode_range(st->f, st->sb, *c, st->block_offsets,
+						start, end, r);
+			else
+				r.failed = true;
+		}
+		catch (std::exception& e)
+		{
+			// parsed serially later on, reporting the error then
+			r.failed = true;
+		}
+
+		std::lock_guard<std::mutex> guard(st->lock);
+		if (++st->finished == st->ranges.size())
+			st->finished_cond.notify_all();
+	}
+}
+
+// parse the inode table in chunks on the session thread pool; chunks
+// after the first start at a speculated inode boundary, which has to
+// match where the previous one ended, or the chunk is parsed again from
+// there; return false if the serial scan needs to be used
+template <class D>
+static bool scan_inodes_parallel(MMAPFile& f, const squashfs::super_block& sb,
+		Compressor& c, const DeltaSession* session, D add_data,
+		size_t& block_num)
+{
+	if (!session)
+		return false;
+
+	std::shared_ptr<struct inode_scan> st(new inode_scan(f));
+	MMAPFile pf(f);
+
+	pf.seek(sb.inode_table_start, std::ios::beg);
+	while (pf.getpos() < sb.directory_table_start)
+	{
+		st->block_offsets.push_back(pf.getpos());
+		pf.seek(pf.read<le16>() & ~squashfs::inode_size::uncompressed);
+	}
+
+	size_t blocks = st->block_offsets.size();
+	if (blocks < 2 * inode_chunk_blocks)
+		return false;
+
+	// all the blocks but the last one are full
+	char buf[squashfs::metadata_size];
+	MetadataBlockReader last(f, st->block_offsets.back(), c);
+	st->total = (blocks - 1) * squashfs::metadata_size
+		+ last.read(buf, sizeof(buf));
+
+	st->sb = sb;
+	st->c.reset(c.clone());
+	st->ranges.resize((blocks + inode_chunk_blocks - 1) / inode_chunk_blocks);
+
+	// the caller works too, so the scan finishes even if the pool
+	// does not get to the tasks
+	for (size_t i = 1; i < st->ranges.size() && i < 64; ++i)
+	{
+		if (!session->submit([st]() { inode_scan_worker(st); }))
+			break;
+	}
+	inode_scan_worker(st);
+
+	{
+		std::unique_lock<std::mutex> guard(st->lock);
+		while (st->finished < st->ranges.size())
+			st->finished_cond.wait(guard);
+	}
+
+	TraceSpan span("InodeReader::confirm");
+	uint64_t pos = 0;
+	uint32_t inodes = 0;
+
+	for (size_t k = 0; k < st->ranges.size(); ++k)
+	{
+		struct inode_range& r = st->ranges[k];
+
+		if (r.failed || r.start != pos)
+		{
+			uint64_t end = std::min<uint64_t>(st->total,
+					(k + 1) * inode_chunk_blocks * squashfs::metadata_size);
+
+			parse_inode_range(f, sb, c, st->block_offsets, pos, end, r);
+		}
+
+		pos = r.end;
+		inodes += r.inodes;
+	}
+
+	// an irregular table, leave it to the serial scan
+	if (pos != st->total || inodes != sb.inodes)
+		return false;
+
+	for (size_t k = 0; k < st->ranges.size(); ++k)
+	{
+		std::vector<struct compressed_block>& rb = st->ranges[k].blocks;
+
+		for (std::vector<struct compressed_block>::iterator i = rb.begin();
+				i != rb.end(); ++i)
+			add_data(*i);
+	}
+
+	block_num = blocks;
+	return true;
+}
+
+// parse the inode table serially, return the number of its blocks
+template <class D>
+static size_t scan_inodes(MMAPFile& f, const squashfs::super_block& sb,
+		Compressor& c, D add_data)
+{
+	InodeReader ir(f, sb, c);
+
+	// trace inode reads in batches, spans per inode would be too noisy
+	const uint32_t trace_batch = 4096;
+
+	for (uint32_t i = 0; i < sb.inodes;)
+	{
+		TraceSpan batch_span("InodeReader::read");
+		uint32_t batch_end = std::min<uint32_t>(i + trace_batch, sb.inodes);
+
+		for (; i < batch_end; ++i)
+		{
+			struct squashfs::file_blocks fb;
+
+			if (!ir.read_file(fb))
+				continue;
+
+			// the stored and sparse blocks are skipped over
+			for_each_compressed_block(fb.block_list, fb.block_count,
+					fb.start_block, [&](uint64_t offset, uint32_t length) {
+						struct compressed_block block;
+						block.offset = offset;
+						block.length = length;
+
+						add_data(block);
+					});
+		}
+	}
+
+	return ir.block_num();
+}
+
+// find all the compressed blocks, passing the data blocks (without
+// hashes, possibly duplicate) to add_data(block) and the metadata blocks
+// to add_metadata(block)
+template <class D, class M>
+static void scan_blocks(MMAPFile& f, const squashfs::super_block& sb,
+		Compressor& c, const DeltaSession* session,
+		D add_data, M add_metadata)
+{
+	ProgressMessage(session) << "Reading inodes...";
+
+	size_t block_num;
+
+	if (!scan_inodes_parallel(f, sb, c, session, add_data, block_num))
+		block_num = scan_inodes(f, sb, c, add_data);
+
+	ProgressMessage(session) << "Read " << sb.inodes << " inodes in "
+		<< block_num << " blocks.";
+
+	// record inode blocks
+
+	ProgressMessage(session) << "Hashing " << block_num
+		<< " inode blocks...";
+
+	MetadataBlockReader mir(f, sb.inode_table_start, c);
+	for (size_t i = 0; i < block_num; ++i)
+	{
+		const void* data;
+		size_t pos;
+		size_t length;
+		bool compressed;
+
+		mir.read_input_block(&data, &pos, &length, &compressed);
+		assert(length != 0);
+
+		if (compressed)
+		{
+			struct compressed_block block;
+			block.offset = pos;
+			block.length = length;
+			block.hash = murmurhash3(data, length, 0);
+
+			add_metadata(block);
+		}
+	}
+
+	// fragments
+	ProgressMessage(session) << "Reading fragment table...";
+
+	FragmentTableReader fr(f, sb, c);
+
+	for (uint32_t i = 0; i < sb.fragments; ++i)
+	{
+		const struct squashfs::fragment_entry& fe = fr.read();
+		assert(fe.size != 0);
+
+		if (!(fe.size & squashfs::block_size::uncompressed))
+		{
+			struct compressed_block block;
+			block.offset = fe.start_block;
+			block.length = fe.size;
+
+			add_data(block);
+		}
+	}
+
+	block_num = fr.block_num();
+	ProgressMessage(session) << "Read " << sb.fragments << " fragments in "
+		<< block_num << " blocks.";
+
+	// record fragment table
+
+	ProgressMessage(session) << "Hashing " << block_num
+		<< " fragment table blocks...";
+
+	MetadataBlockReader mfr(f, fr.start_offset, c);
+	for (size_t i = 0; i < block_num; ++i)
+	{
+		const void* data;
+		size_t pos;
+		size_t length;
+		bool compressed;
+
+		mfr.read_input_block(&data, &pos, &length, &compressed);
+
+		if (compressed)
+		{
+			struct compressed_block block;
+			block.offset = pos;
+			block.length = length;
+			block.hash = murmurhash3(data, length, 0);
+
+			add_metadata(block);
+		}
+	}
+}
+
+void read_image_header(MMAPFile& f, Compressor*& c, size_t& block_size)
+{
+	f.seek(0, std::ios::beg);
+	read_super_block(f, c, block_size);
+}
+
+std::list<struct compressed_block> get_blocks(MMAPFile& f, Compressor*& c,
+		size_t& block_size, const DeltaSession* session)
+{
+	TraceSpan span("get_blocks");
+
+	const squashfs::super_block& sb = read_super_block(f, c, block_size);
+
+	std::list<struct compressed_block>
+		compressed_metadata_blocks,
+		compressed_data_blocks;
+
+	scan_blocks(f, sb, *c, session,
+			[&](const struct compressed_block& block) {
+				compressed_data_blocks.push_back(block);
+			},
+			[&](const struct compressed_block& block) {
+				compressed_metadata_blocks.push_back(block);
+			});
+
+	// sort by offset to use sequential reads
+	compressed_data_blocks.sort(sort_by_offset);
+
+	// perform initial deduplication
+	for (std::list<struct compressed_block>::iterator
+			i = compressed_data_blocks.begin(),
+			j = compressed_data_blocks.end();
+			i != compressed_data_blocks.end();)
+	{
+		// duplicates will be adjacent after sorting
+		if ((*i).offset == ((*j).offset))
+		{
+			assert((*i).length == (*j).length);
+			i = compressed_data_blocks.erase(i);
+			continue;
+		}
+
+		j = i++;
+	}
+
+	size_t total = compressed_data_blocks.size();
+	size_t done = 0;
+
+	ProgressMessage(session) << "Hashing " << total << " data blocks...";
+
+	// record the checksums
+	for_each_block_data(f, compressed_data_blocks, sb.block_size,
+			[&](struct compressed_block& block, const void* data) {
+				block.hash = murmurhash3(data, block.length, 0);
+
+				if (session && ++done % progress_interval == 0)
+					session->progress(SQDELTA_STAGE_ANALYSE, done, total);
+			});
+	if (session)
+		session->progress(SQDELTA_STAGE_ANALYSE, total, total);
+
+	compressed_data_blocks.splice(compressed_data_blocks.end(),
+			compressed_metadata_blocks);
+
+	ProgressMessage(session) << "Total: " << compressed_data_blocks.size()
+		<< " compressed blocks.";
+
+	return compressed_data_blocks;
+}
+
+BlockRunFile* get_blocks_external(MMAPFile& f, Compressor*& c,
+		size_t& block_size, size_t memory, const char* tmpdir,
+		const DeltaSession* session)
+{
+	TraceSpan span("get_blocks_external");
+
+	const squashfs::super_block& sb = read_super_block(f, c, block_size);
+
+	// data blocks are read in offset order, and deduplicated on the way;
+	// the hashed ones go to the final table with the metadata blocks
+	ExternalBlockSorter data_blocks(sort_by_offset, memory / 2, tmpdir, true);
+	ExternalBlockSorter all_blocks(sort_by_len_hash, memory / 2, tmpdir);
+
+	scan_blocks(f, sb, *c, session,
+			[&](const struct compressed_block& block) {
+				data_blocks.add(block);
+			},
+			[&](const struct compressed_block& block) {
+				all_blocks.add(block);
+			});
+
+	std::unique_ptr<BlockRunFile> sorted_data(data_blocks.finish());
+	size_t total = sorted_data->size();
+	size_t done = 0;
+
+	ProgressMessage(session) << "Hashing " << total << " data blocks...";
+
+	BlockRunReader r(*sorted_data);
+	for_each_chunk(r, chunk_size(memory / 2),
+			[&](std::list<struct compressed_block>& chunk) {
+				for_each_block_data(f, chunk, sb.block_size,
+						[&](struct compressed_block& block, const void* data) {
+							block.hash = murmurhash3(data, block.length, 0);
+							all_blocks.add(block);
+
+							if (session && ++done % progress_interval == 0)
+								session->progress(SQDELTA_STAGE_ANALYSE,
+										done, total);
+						});
+			});
+	if (session)
+		session->progress(SQDELTA_STAGE_ANALYSE, total, total);
+
+	ProgressMessage(session) << "Total: " << all_blocks.size()
+		<< " compressed blocks.";
+
+	return all_blocks.finish();
+}
+
+// copy raw data from the current position, preferably in the kernel,
+// falling back to writing from the mapping in window-sized chunks
+void copy_raw(SparseFileWriter& outf, MMAPFile& inf, size_t length)
+{
+	size_t chunk = inf.window_size();
+	size_t copied = outf.copy_from(inf.getfd(), inf.getpos(), length);
+
+	inf.seek(copied);
+	length -= copied;
+
+	while (length > 0)
+	{
+		size_t step = length < chunk ? length : chunk;
+
+		outf.write(inf.read_array<char>(step), step);
+		length -= step;
+	}
+}
+
+// copy the raw data up to the block, and leave a hole in its place
+static void write_raw_part(SparseFileWriter& outf, MMAPFile& inf,
+		const struct compressed_block& block, size_t& prev_offset)
+{
+	assert(block.offset >= prev_offset);
+
+	size_t pre_length = block.offset - prev_offset;
+	prev_offset = block.offset + block.length;
+
+	// first, copy the data preceeding compressed block
+	copy_raw(outf, inf, pre_length);
+
+	// then, seek through the block
+	inf.seek(block.length);
+	outf.write_sparse(block.length);
+}
+
+// append the decompressed blocks, recording their lengths
+static void write_expanded_blocks(SparseFileWriter& outf, MMAPFile& inf,
+		std::list<struct compressed_block>& cb, Compressor& c,
+		char* buf, size_t block_size, const DeltaSession* session,
+		enum sqdelta_stage stage, size_t& done, size_t total,
+		const block_replacements* replacements)
+{
+	// the list holds metadata blocks too
+	for_each_block_data(inf, cb,
+			std::max<size_t>(block_size, squashfs::metadata_size),
+			[&](struct compressed_block& block, const void* data) {
+				size_t unc_length = c.decompress(buf, data,
+						block.length, block_size);
+
+				if (replacements)
+				{
+					block_replacements::const_iterator r
+						= replacements->find(block.offset);
+
+					if (r != replacements->end())
+					{
+						assert(r->second.size() == unc_length);
+						memcpy(buf, &r->second[0], unc_length);
+					}
+				}
+
+				block.uncompressed_length = unc_length;
+				outf.write_detect_sparse(buf, unc_length);
+
+				if (session && ++done % progress_interval == 0)
+					session->progress(stage, done, total);
+			});
+}
+
+void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
+		std::list<struct compressed_block>& cb, Compressor& c,
+		size_t block_size, const DeltaSession* session,
+		enum sqdelta_stage stage, const std::vector<uint32_t>* order,
+		const block_replacements* replacements)
+{
+	size_t prev_offset = 0;
+	inf.seek(0, std::ios::beg);
+	// both passes below read in offset order
+	inf.advise(access_pattern::sequential, true);
+
+	for (std::list<struct compressed_block>::iterator i = cb.begin();
+			i != cb.end(); ++i)
+		write_raw_part(outf, inf, *i, prev_offset);
+
+	// write the last block
+	copy_raw(outf, inf, inf.getlen() - prev_offset);
+
+	size_t total = cb.size();
+	size_t done = 0;
+
+	char* buf = static_cast<char*>(alloc_buffer(block_size, 64));
+	if (!buf)
+		throw std::bad_alloc();
+
+	try
+	{
+		bool has_skipped = std::find_if_not(cb.begin(), cb.end(),
+				is_block_expanded) != cb.end();
+
+		if ((order && !order->empty()) || has_skipped)
+		{
+			// expand copies in the order, without the back-references
+			// and the per-file blocks, then copy the lengths back
+			std::vector<struct compressed_block*> blocks;
+			std::vector<struct compressed_block*> expanded;
+			std::list<struct compressed_block> ordered;
+
+			blocks.reserve(cb.size());
+			for (std::list<struct compressed_block>::iterator i = cb.begin();
+					i != cb.end(); ++i)
+				blocks.push_back(&*i);
+			if (order && !order->empty())
+			{
+				for (std::vector<uint32_t>::const_iterator i = order->begin();
+						i != order->end(); ++i)
+				{
+					if (is_block_expanded(*blocks.at(*i)))
+						expanded.push_back(blocks[*i]);
+				}
+			}
+			else
+				std::remove_copy_if(blocks.begin(), blocks.end(),
+						std::back_inserter(expanded),
+						[](const struct compressed_block* b) {
+							return !is_block_expanded(*b);
+						});
+
+			for (std::vector<struct compressed_block*>::iterator
+					i = expanded.begin(); i != expanded.end(); ++i)
+				ordered.push_back(**i);
+
+			total = ordered.size();
+			write_expanded_blocks(outf, inf, ordered, c, buf, block_size,
+					session, stage, done, total, replacements);
+
+			std::list<struct compressed_block>::iterator o = ordered.begin();
+			for (std::vector<struct compressed_block*>::iterator
+					i = expanded.begin(); i != expanded.end(); ++i, ++o)
+				(*i)->uncompressed_length = o->uncompressed_length;
+		}
+		else
+			write_expanded_blocks(outf, inf, cb, c, buf, block_size,
+					session, stage, done, total, replacements);
+	}
+	catch (std::exception& e)
+	{
+		free_buffer(buf, block_size);
+		throw;
+	}
+	free_buffer(buf, block_size);
+
+	if (session)
+		session->progress(stage, total, total);
+}
+
+void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
+		const BlockRunFile& cb, BlockRunFile& out_cb, Compressor& c,
+		size_t block_size, size_t memory, const DeltaSession* session,
+		enum sqdelta_stage stage, const block_replacements* replacements)
+{
+	size_t prev_offset = 0;
+	inf.seek(0, std::ios::beg);
+	inf.advise(access_pattern::sequential, true);
+
+	{
+		BlockRunReader r(cb);
+		struct compressed_block block;
+
+		while (r.next(block))
+			write_raw_part(outf, inf, block, prev_offset);
+	}
+
+	copy_raw(outf, inf, inf.getlen() - prev_offset);
+
+	size_t total = cb.size();
+	size_t done = 0;
+
+	char* buf = static_cast<char*>(alloc_buffer(block_size, 64));
+	if (!buf)
+		throw std::bad_alloc();
+
+	try
+	{
+		BlockRunReader r(cb);
+
+		for_each_chunk(r, chunk_size(memory),
+				[&](std::list<struct compressed_block>& chunk) {
+					write_expanded_blocks(outf, inf, chunk, c, buf,
+							block_size, session, stage, done, total,
+							replacements);
+
+					for (std::list<struct compressed_block>::iterator
+							i = chunk.begin(); i != chunk.end(); ++i)
+						out_cb.append(*i);
+				});
+		out_cb.finish();
+	}
+	catch (std::exception& e)
+	{
+		free_buffer(buf, block_size);
+		throw;
+	}
+	free_buffer(buf, block_size);
+
+	if (session)
+		session->progress(stage, total, total);
+}
+
+bool is_block_ref(const struct compressed_block& block)
+{
+	return block.uncompressed_length & sqdelta_block_ref;
+}
+
+bool is_block_file(const struct compressed_block& block)
+{
+	return block.uncompressed_length & sqdelta_block_file;
+}
+
+bool is_block_expanded(const struct compressed_block& block)
+{
+	return !is_block_ref(block) && !is_block_file(block);
+}
+
+size_t dedupe_blocks(MMAPFile& f, std::list<struct compressed_block>& cb)
+{
+	TraceSpan span("dedupe_blocks");
+
+	// (length, hash) -> indexes of the distinct blocks with them
+	std::unordered_map<uint64_t, std::vector<uint32_t> > seen;
+	std::vector<const struct compressed_block*> blocks;
+	MMAPFile lf(f);
+	MMAPFile rf(f);
+	size_t refs = 0;
+
+	blocks.reserve(cb.size());
+	for (std::list<struct compressed_block>::iterator i = cb.begin();
+			i != cb.end(); ++i)
+	{
+		// the per-file blocks are neither copies nor originals
+		if (!is_block_expanded(*i))
+		{
+			blocks.push_back(&*i);
+			continue;
+		}
+
+		uint64_t key = (uint64_t((*i).length) << 32) | (*i).hash;
+		std::vector<uint32_t>& copies = seen[key];
+		std::vector<uint32_t>::iterator j;
+
+		// the hashes may collide, so compare the data
+		for (j = copies.begin(); j != copies.end(); ++j)
+		{
+			lf.seek((*i).offset, std::ios::beg);
+			rf.seek(blocks[*j]->offset, std::ios::beg);
+			if (!memcmp(lf.read_array<char>((*i).length),
+						rf.read_array<char>((*i).length), (*i).length))
+				break;
+		}
+
+		if (j != copies.end())
+		{
+			(*i).uncompressed_length = sqdelta_block_ref | *j;
+			++refs;
+		}
+		else
+			copies.push_back(blocks.size());
+
+		blocks.push_back(&*i);
+	}
+
+	return refs;
+}
+
+void remove_common_blocks(std::list<struct compressed_block>& source_blocks,
+		std::list<struct compressed_block>& target_blocks)
+{
+	source_blocks.sort(sort_by_len_hash);
+	target_blocks.sort(sort_by_len_hash);
+
+	for (std::list<struct compressed_block>::iterator
+			i = source_blocks.begin(),
+			j = target_blocks.begin();
+			i != source_blocks.end() && j != target_blocks.end();)
+	{
+		// seek until we find duplicates
+		if ((*i).length < (*j).length)
+			++i;
+		else if ((*j).length < (*i).length)
+			++j;
+		else if ((*i).hash < (*j).hash)
+			++i;
+		else if ((*j).hash < (*i).hash)
+			++j;
+		else
+		{
+			// found a match, remove the blocks then
+			std::list<struct compressed_block>::iterator
+				i_st = i, j_st = j;
+
+			// remove consecutive duplicates as well
+			while (i != source_blocks.end()
+					&& (*i).length == (*i_st).length
+					&& (*i).hash == (*i_st).hash)
+				++i;
+			while (j != target_blocks.end()
+					&& (*j).length == (*j_st).length
+					&& (*j).hash == (*j_st).hash)
+				++j;
+
+			source_blocks.erase(i_st, i);
+			target_blocks.erase(j_st, j);
+		}
+	}
+}
+
+void remove_common_blocks(const BlockRunFile& source_blocks,
+		const BlockRunFile& target_blocks, size_t memory,
+		const char* tmpdir, BlockRunFile*& source_unique,
+		BlockRunFile*& target_unique)
+{
+	TraceSpan span("remove_common_blocks");
+
+	ExternalBlockSorter source_sorter(sort_by_offset, memory / 2, tmpdir);
+	ExternalBlockSorter target_sorter(sort_by_offset, memory / 2, tmpdir);
+	BlockRunReader si(source_blocks);
+	BlockRunReader ti(target_blocks);
+	struct compressed_block i, j;
+	bool have_i = si.next(i);
+	bool have_j = ti.next(j);
+
+	// merge join, the same as the in-memory one
+	while (have_i && have_j)
+	{
+		if (sort_by_len_hash(i, j))
+		{
+			source_sorter.add(i);
+			have_i = si.next(i);
+		}
+		else if (sort_by_len_hash(j, i))
+		{
+			target_sorter.add(j);
+			have_j = ti.next(j);
+		}
+		else
+		{
+			struct compressed_block match = i;
+
+			// remove consecutive duplicates as well
+			while (have_i && !sort_by_len_hash(match, i))
+				have_i = si.next(i);
+			while (have_j && !sort_by_len_hash(match, j))
+				have_j = ti.next(j);
+		}
+	}
+
+	for (; have_i; have_i = si.next(i))
+		source_sorter.add(i);
+	for (; have_j; have_j = ti.next(j))
+		target_sorter.add(j);
+
+	std::unique_ptr<BlockRunFile> sorted_source(source_sorter.finish());
+	target_unique = target_sorter.finish();
+	source_unique = sorted_source.release();
+}
+
+void write_block_list(SparseFileWriter& outf, sqdelta_header h,
+		std::list<struct compressed_block>& cb, bool at_end)
+{
+	write_block_list(outf, h, cb, std::vector<uint32_t>(), at_end);
+}
+
+void write_block_list(SparseFileWriter& outf, sqdelta_header h,
+		std::list<struct compressed_block>& cb,
+		const std::vector<uint32_t>& order, bool at_end)
+{
+	// store the block count in header
+	h.block_count = htonl(cb.size());
+	if (!order.empty())
+		h.flags = htonl(ntohl(h.flags) | sqdelta_flags::block_order);
+	if (std::find_if(cb.begin(), cb.end(), is_block_ref) != cb.end())
+		h.flags = htonl(ntohl(h.flags) | sqdelta_flags::block_refs);
+
+	if (!at_end)
+		outf.write<struct sqdelta_header>(h);
+
+	for (std::list<struct compressed_block>::iterator i = cb.begin();
+			i != cb.end(); ++i)
+	{
+		struct serialized_compressed_block b;
+
+		b.offset = htonl((*i).offset);
+		b.length = htonl((*i).length);
+		b.uncompressed_length = htonl((*i).uncompressed_length);
+
+		outf.write<struct serialized_compressed_block>(b);
+	}
+
+	for (std::vector<uint32_t>::const_iterator i = order.begin();
+			i != order.end(); ++i)
+		outf.write<uint32_t>(htonl(*i));
+
+	if (at_end)
+		outf.write<struct sqdelta_header>(h);
+}
+
+void write_block_list(SparseFileWriter& outf, sqdelta_header h,
+		const BlockRunFile& cb, bool at_end)
+{
+	BlockRunReader r(cb);
+	struct compressed_block block;
+
+	h.block_count = htonl(cb.size());
+
+	if (!at_end)
+		outf.write<struct sqdelta_header>(h);
+
+	while (r.next(block))
+	{
+		struct serialized_compressed_block b;
+
+		b.offset = htonl(block.offset);
+		b.length = htonl(block.length);
+		b.uncompressed_length = htonl(block.uncompressed_length);
+
+		outf.write<struct serialized_compressed_block>(b);
+	}
+
+	if (at_end)
+		outf.write<struct sqdelta_header>(h);
+}
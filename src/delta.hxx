@@ -0,0 +1,196 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_DELTA_HXX
+#define SDT_DELTA_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <list>
+#include <vector>
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "compressor.hxx"
+#include "libsquashdelta.hxx"
+#include "normalise.hxx"
+#include "util.hxx"
+
+struct compressed_block
+{
+	size_t offset;
+	size_t length;
+	// known after the expansion, or a back-reference
+	size_t uncompressed_length;
+	uint32_t hash;
+
+	compressed_block()
+		: offset(0), length(0), uncompressed_length(0), hash(0)
+	{
+	}
+};
+
+#pragma pack(push, 1)
+struct serialized_compressed_block
+{
+	uint32_t offset;
+	uint32_t length;
+	uint32_t uncompressed_length;
+};
+
+struct sqdelta_header
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t compression;
+	uint32_t block_count;
+};
+
+// with sqdelta_flags::target_digest, follows the block list in the patch,
+// and is followed by the chaining values of the pieces
+struct sqdelta_digest_header
+{
+	uint32_t algorithm;
+	// the pieces are 1 << piece_log bytes, except for the last one
+	uint32_t piece_log;
+	uint32_t length_high;
+	uint32_t length_low;
+	uint32_t piece_count;
+	unsigned char digest[32];
+};
+
+// with sqdelta_flags::per_file, follows the block list (and the digest)
+// in the patch, and is followed by the entries of the files
+struct sqdelta_file_table
+{
+	uint32_t file_count;
+};
+
+// followed by the source blocks of the file, as serialized blocks
+// with their uncompressed lengths, and the uncompressed lengths of its
+// target blocks (as uint32_t); the deltas of the files follow all
+// the entries, in the same order, and precede the image delta
+struct sqdelta_file_entry
+{
+	uint32_t source_block_count;
+	uint32_t target_block_count;
+	uint32_t delta_length_high;
+	uint32_t delta_length_low;
+};
+#pragma pack(pop)
+
+const uint32_t sqdelta_magic = 0x5371ceb4;
+
+namespace sqdelta_flags
+{
+	enum sqdelta_flags
+	{
+		// the block list is followed by the order the blocks are
+		// expanded in, as indexes into the list
+		block_order = 1 << 0,
+		// the block list is followed by a digest of the target image
+		target_digest = 1 << 1,
+		// the list has back-references to identical earlier blocks
+		block_refs = 1 << 2,
+		// the start_block fields of the expanded inode and fragment
+		// table blocks are stored relative to the previous file
+		// or fragment
+		normalised_metadata = 1 << 3,
+		// some target blocks are in the per-file deltas, which
+		// are independent of the image delta and of each other
+		per_file = 1 << 4
+	};
+}
+
+// uncompressed_length of a block identical to an earlier block of the
+// same list, which is not expanded; the rest is the index of that block
+const uint32_t sqdelta_block_ref = 0x80000000UL;
+// uncompressed_length of a target block expanded by a per-file delta
+// instead; the rest is the index of the file, its blocks are in the list
+// order
+const uint32_t sqdelta_block_file = 0x40000000UL;
+
+namespace sqdelta_digest
+{
+	enum sqdelta_digest
+	{
+		blake3 = 1
+	};
+}
+
+class BlockRunFile;
+
+bool is_block_ref(const struct compressed_block& block);
+bool is_block_file(const struct compressed_block& block);
+// neither of the above
+bool is_block_expanded(const struct compressed_block& block);
+
+bool sort_by_offset(const struct compressed_block& lhs,
+		const struct compressed_block& rhs);
+bool sort_by_len_hash(const struct compressed_block& lhs,
+		const struct compressed_block& rhs);
+
+// copy length bytes from the current position of inf
+void copy_raw(SparseFileWriter& outf, MMAPFile& inf, size_t length);
+// check the super block and set up the compressor, as get_blocks()
+// does, without scanning the blocks
+void read_image_header(MMAPFile& f, Compressor*& c, size_t& block_size);
+// progress is reported to the session, if one is given
+std::list<struct compressed_block> get_blocks(MMAPFile& f, Compressor*& c,
+		size_t& block_size, const DeltaSession* session = 0);
+// the blocks are expanded in the order given, if any, and the ones
+// in replacements are written as given there
+void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
+		std::list<struct compressed_block>& cb, Compressor& c,
+		size_t block_size, const DeltaSession* session = 0,
+		enum sqdelta_stage stage = SQDELTA_STAGE_EXPAND_SOURCE,
+		const std::vector<uint32_t>* order = 0,
+		const block_replacements* replacements = 0);
+// replace the blocks repeated within the list (in the offset order)
+// with back-references to their first copy; returns their number
+size_t dedupe_blocks(MMAPFile& f, std::list<struct compressed_block>& cb);
+// remove the blocks present in both lists, leaving them sorted
+// by length and hash
+void remove_common_blocks(std::list<struct compressed_block>& source_blocks,
+		std::list<struct compressed_block>& target_blocks);
+void write_block_list(SparseFileWriter& outf, sqdelta_header h,
+		std::list<struct compressed_block>& cb, bool at_end = true);
+// with a non-empty order, stored after the list
+void write_block_list(SparseFileWriter& outf, sqdelta_header h,
+		std::list<struct compressed_block>& cb,
+		const std::vector<uint32_t>& order, bool at_end = true);
+
+// external-memory variants, using about memory bytes for the sorting
+// and spilling to run files in tmpdir
+
+// the blocks are returned sorted by length and hash
+BlockRunFile* get_blocks_external(MMAPFile& f, Compressor*& c,
+		size_t& block_size, size_t memory, const char* tmpdir,
+		const DeltaSession* session = 0);
+// the blocks are expanded in chunks, out_cb gets them with
+// the uncompressed lengths
+void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
+		const BlockRunFile& cb, BlockRunFile& out_cb, Compressor& c,
+		size_t block_size, size_t memory, const DeltaSession* session = 0,
+		enum sqdelta_stage stage = SQDELTA_STAGE_EXPAND_SOURCE,
+		const block_replacements* replacements = 0);
+// streaming merge join of the tables, the unique blocks are returned
+// sorted by offset
+void remove_common_blocks(const BlockRunFile& source_blocks,
+		const BlockRunFile& target_blocks, size_t memory,
+		const char* tmpdir, BlockRunFile*& source_unique,
+		BlockRunFile*& target_unique);
+void write_block_list(SparseFileWriter& outf, sqdelta_header h,
+		const BlockRunFile& cb, bool at_end = true);
+
+#endif /*!SDT_DELTA_HXX*/
@@ -0,0 +1,315 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <queue>
+#include <string>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#	include <fcntl.h>
+#	include <unistd.h>
+}
+
+#include "extsort.hxx"
+#include "trace.hxx"
+#include "util.hxx"
+
+BlockRunFile::BlockRunFile()
+	: fd(-1), count(0), buf(0), buf_pos(0)
+{
+}
+
+BlockRunFile::~BlockRunFile()
+{
+	if (buf)
+		free_buffer(buf, buffer_size);
+	if (fd != -1)
+		close(fd);
+}
+
+void BlockRunFile::open(const char* dir)
+{
+	std::string path = std::string(dir) + '/' + tmpfile_template;
+
+	fd = mkostemp(&path[0], O_CLOEXEC);
+	if (fd == -1)
+		throw IOError("Unable to create a temporary file", errno);
+	// nobody else needs it by name
+	unlink(path.c_str());
+
+	buf = static_cast<char*>(alloc_buffer(buffer_size, 64));
+	if (!buf)
+		throw std::bad_alloc();
+}
+
+void BlockRunFile::flush_buffer()
+{
+	const char* data = buf;
+
+	while (buf_pos > 0)
+	{
+		ssize_t ret = write(fd, data, buf_pos);
+
+		++io_stats.write;
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			throw IOError("Unable to write the block run", errno);
+
+		data += ret;
+		buf_pos -= ret;
+	}
+}
+
+void BlockRunFile::append(const struct compressed_block& block)
+{
+	struct spilled_block b;
+
+	b.offset = block.offset;
+	b.length = block.length;
+	b.uncompressed_length = block.uncompressed_length;
+	b.hash = block.hash;
+
+	if (buf_pos + sizeof(b) > buffer_size)
+		flush_buffer();
+	memcpy(buf + buf_pos, &b, sizeof(b));
+	buf_pos += sizeof(b);
+	++count;
+}
+
+void BlockRunFile::finish()
+{
+	flush_buffer();
+	free_buffer(buf, buffer_size);
+	buf = 0;
+}
+
+size_t BlockRunFile::size() const
+{
+	return count;
+}
+
+int BlockRunFile::getfd() const
+{
+	return fd;
+}
+
+BlockRunReader::BlockRunReader(const BlockRunFile& new_f)
+	: f(new_f), offset(0), left(new_f.size()),
+	buf(BlockRunFile::buffer_size), buf_pos(0), buf_len(0)
+{
+}
+
+bool BlockRunReader::next(struct compressed_block& block)
+{
+	struct spilled_block b;
+
+	if (left == 0)
+		return false;
+
+	if (buf_pos + sizeof(b) > buf_len)
+	{
+		// move the partial record to the front
+		buf_len -= buf_pos;
+		memmove(&buf[0], &buf[buf_pos], buf_len);
+		buf_pos = 0;
+
+		while (buf_len < sizeof(b))
+		{
+			// readers share the descriptor, so no read()
+			ssize_t ret = pread(f.getfd(), &buf[buf_len],
+					buf.size() - buf_len, offset);
+
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret == -1)
+				throw IOError("Unable to read the block run", errno);
+			if (ret == 0)
+				throw std::runtime_error("Block run truncated");
+
+			offset += ret;
+			buf_len += ret;
+		}
+	}
+
+	memcpy(&b, &buf[buf_pos], sizeof(b));
+	buf_pos += sizeof(b);
+	--left;
+
+	block.offset = b.offset;
+	block.length = b.length;
+	block.uncompressed_length = b.uncompressed_length;
+	block.hash = b.hash;
+	return true;
+}
+
+ExternalBlockSorter::ExternalBlockSorter(block_compare new_compare,
+		size_t new_memory, const char* new_dir, bool new_unique)
+	: compare(new_compare), unique(new_unique), memory(new_memory),
+	dir(new_dir), count(0)
+{
+}
+
+ExternalBlockSorter::~ExternalBlockSorter()
+{
+	for (std::vector<BlockRunFile*>::iterator i = runs.begin();
+			i != runs.end(); ++i)
+		delete *i;
+}
+
+void ExternalBlockSorter::spill()
+{
+	TraceSpan span("ExternalBlockSorter::spill");
+	BlockRunFile* f = new BlockRunFile();
+
+	try
+	{
+		f->open(dir);
+		std::sort(run.begin(), run.end(), compare);
+
+		for (std::vector<struct compressed_block>::iterator i = run.begin();
+				i != run.end(); ++i)
+		{
+			if (unique && i != run.begin() && !compare(*(i - 1), *i))
+				continue;
+			f->append(*i);
+		}
+		f->finish();
+	}
+	catch (...)
+	{
+		delete f;
+		throw;
+	}
+
+	runs.push_back(f);
+	run.clear();
+}
+
+void ExternalBlockSorter::add(const struct compressed_block& block)
+{
+	if (run.capacity() == 0)
+	{
+		size_t run_size = memory / sizeof(struct compressed_block);
+
+		run.reserve(std::max<size_t>(run_size, 1024));
+	}
+	else if (run.size() == run.capacity())
+		spill();
+
+	run.push_back(block);
+	++count;
+}
+
+size_t ExternalBlockSorter::size() const
+{
+	return count;
+}
+
+BlockRunFile* ExternalBlockSorter::merge(
+		std::vector<BlockRunFile*>::iterator first,
+		std::vector<BlockRunFile*>::iterator last)
+{
+	TraceSpan span("ExternalBlockSorter::merge");
+
+	typedef std::pair<struct compressed_block, size_t> head;
+
+	std::vector<BlockRunReader*> readers;
+	block_compare cmp = compare;
+	// the smallest block on top, the earlier run first on ties
+	std::priority_queue<head, std::vector<head>, std::function<bool(
+			const head&, const head&)> > heads(
+		[cmp](const head& lhs, const head& rhs) {
+			if (cmp(rhs.first, lhs.first))
+				return true;
+			if (cmp(lhs.first, rhs.first))
+				return false;
+			return rhs.second < lhs.second;
+		});
+	BlockRunFile* out = new BlockRunFile();
+
+	try
+	{
+		out->open(dir);
+
+		for (std::vector<BlockRunFile*>::iterator i = first; i != last; ++i)
+		{
+			struct compressed_block block;
+
+			readers.push_back(new BlockRunReader(**i));
+			if (readers.back()->next(block))
+				heads.push(head(block, readers.size() - 1));
+		}
+
+		struct compressed_block prev;
+		bool have_prev = false;
+
+		while (!heads.empty())
+		{
+			head h = heads.top();
+			heads.pop();
+
+			if (!unique || !have_prev || compare(prev, h.first))
+				out->append(h.first);
+			prev = h.first;
+			have_prev = true;
+
+			if (readers[h.second]->next(h.first))
+				heads.push(h);
+		}
+		out->finish();
+	}
+	catch (...)
+	{
+		for (std::vector<BlockRunReader*>::iterator i = readers.begin();
+				i != readers.end(); ++i)
+			delete *i;
+		delete out;
+		throw;
+	}
+
+	for (std::vector<BlockRunReader*>::iterator i = readers.begin();
+			i != readers.end(); ++i)
+		delete *i;
+	return out;
+}
+
+BlockRunFile* ExternalBlockSorter::finish()
+{
+	if (!run.empty() || runs.empty())
+		spill();
+	// release the run buffer for the merge
+	std::vector<struct compressed_block>().swap(run);
+
+	// each merged run needs a read buffer
+	size_t fan_in = std::max<size_t>(memory / BlockRunFile::buffer_size, 2);
+
+	while (runs.size() > 1)
+	{
+		size_t n = std::min(fan_in, runs.size());
+		BlockRunFile* merged = merge(runs.begin(), runs.begin() + n);
+
+		for (size_t i = 0; i < n; ++i)
+			delete runs[i];
+		runs.erase(runs.begin(), runs.begin() + n);
+		runs.push_back(merged);
+	}
+
+	BlockRunFile* ret = runs.back();
+	runs.clear();
+	return ret;
+}
@@ -0,0 +1,119 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_EXTSORT_HXX
+#define SDT_EXTSORT_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <vector>
+
+extern "C"
+{
+#	include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "delta.hxx"
+
+/**
+ * External-memory block tables, for images whose block lists do not fit
+ * in memory. The blocks are spilled to sorted run files and merged.
+ */
+
+#pragma pack(push, 1)
+// compact on-disk form of struct compressed_block
+struct spilled_block
+{
+	uint64_t offset;
+	uint32_t length;
+	uint32_t uncompressed_length;
+	uint32_t hash;
+};
+#pragma pack(pop)
+
+typedef bool (*block_compare)(const struct compressed_block& lhs,
+		const struct compressed_block& rhs);
+
+// sequence of blocks in an anonymous temporary file, written once
+// and then read by any number of readers
+class BlockRunFile
+{
+	int fd;
+	size_t count;
+
+	char* buf;
+	size_t buf_pos;
+
+	void flush_buffer();
+
+public:
+	static const size_t buffer_size = 64 * 1024;
+
+	BlockRunFile();
+	~BlockRunFile();
+
+	void open(const char* dir);
+	void append(const struct compressed_block& block);
+	// flush the written blocks, needs to be called before reading
+	void finish();
+
+	size_t size() const;
+	int getfd() const;
+};
+
+class BlockRunReader
+{
+	const BlockRunFile& f;
+	off_t offset;
+	size_t left;
+
+	std::vector<char> buf;
+	size_t buf_pos;
+	size_t buf_len;
+
+public:
+	BlockRunReader(const BlockRunFile& new_f);
+
+	// return false at the end of the run
+	bool next(struct compressed_block& block);
+};
+
+// k-way external merge sort of the blocks
+class ExternalBlockSorter
+{
+	block_compare compare;
+	bool unique;
+	size_t memory;
+	const char* dir;
+
+	std::vector<struct compressed_block> run;
+	std::vector<BlockRunFile*> runs;
+	size_t count;
+
+	void spill();
+	BlockRunFile* merge(std::vector<BlockRunFile*>::iterator first,
+			std::vector<BlockRunFile*>::iterator last);
+
+public:
+	// with unique, only the first of the blocks comparing equal is kept
+	ExternalBlockSorter(block_compare new_compare, size_t new_memory,
+			const char* new_dir, bool new_unique = false);
+	~ExternalBlockSorter();
+
+	void add(const struct compressed_block& block);
+	// the number of blocks added so far, including duplicates
+	size_t size() const;
+
+	// merge everything into a single sorted run, owned by the caller
+	BlockRunFile* finish();
+};
+
+#endif /*!SDT_EXTSORT_HXX*/
@@ -0,0 +1,2597 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <typeinfo>
+#include <unordered_set>
+#include <vector>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#	include <sys/types.h>
+#	include <sys/stat.h>
+#	include <sys/wait.h>
+#	include <fcntl.h>
+#	include <signal.h>
+#	include <time.h>
+#	include <unistd.h>
+#	include <arpa/inet.h>
+}
+
+#include "blake3.hxx"
+#include "checkpoint.hxx"
+#include "compressor.hxx"
+#include "delta.hxx"
+#include "extsort.hxx"
+#include "libsquashdelta.h"
+#include "libsquashdelta.hxx"
+#include "normalise.hxx"
+#include "perfile.hxx"
+#include "profile.hxx"
+#include "report.hxx"
+#include "similarity.hxx"
+#include "squashfs.hxx"
+#include "trace.hxx"
+#include "uring.hxx"
+#include "util.hxx"
+
+DeltaError::DeltaError(enum sqdelta_error new_code, const std::string& text,
+		const std::string& new_context, int new_errno)
+	: std::runtime_error(text), code(new_code), context(new_context),
+	errno_val(new_errno)
+{
+}
+
+// rethrow the exception being handled as DeltaError, adding the context
+[[noreturn]] static void rethrow_delta_error(const std::string& context)
+{
+	try
+	{
+		throw;
+	}
+	catch (DeltaError& e)
+	{
+		if (!e.context.empty())
+			throw;
+		throw DeltaError(e.code, e.what(), context, e.errno_val);
+	}
+	catch (IOError& e)
+	{
+		throw DeltaError(SQDELTA_ERR_IO, e.what(), context, e.errno_val);
+	}
+	catch (std::bad_alloc& e)
+	{
+		throw DeltaError(SQDELTA_ERR_NOMEM, "Out of memory", context);
+	}
+	catch (std::exception& e)
+	{
+		throw DeltaError(SQDELTA_ERR_FAILED, e.what(), context);
+	}
+}
+
+// installs the session allocator for the duration of a call
+class AllocatorScope
+{
+	const struct sqdelta_allocator* prev;
+
+public:
+	AllocatorScope(const struct sqdelta_allocator& allocator)
+		: prev(buffer_allocator)
+	{
+		buffer_allocator = allocator.alloc ? &allocator : 0;
+	}
+
+	~AllocatorScope()
+	{
+		buffer_allocator = prev;
+	}
+};
+
+// runs tasks on the caller-supplied pool, or inline without one;
+// the waiting thread runs the tasks not started yet, as it may be
+// a thread of the pool itself
+class TaskGroup
+{
+	// shared with the pool tasks, which may run after the group is gone
+	// and find nothing to do then
+	struct state
+	{
+		struct sqdelta_allocator allocator;
+
+		std::mutex lock;
+		std::condition_variable finished;
+		std::deque<std::function<void()> > queue;
+		// queued or running
+		unsigned pending;
+		std::exception_ptr error;
+	};
+
+	const struct sqdelta_thread_pool& pool;
+	std::shared_ptr<struct state> st;
+
+	static void run_task(void* arg);
+	// run the next queued task, return false if there is none
+	static bool run_next(struct state& st);
+	// run or wait for all the tasks
+	void drain();
+
+public:
+	TaskGroup(const struct sqdelta_thread_pool& new_pool,
+			const struct sqdelta_allocator& new_allocator);
+	~TaskGroup();
+
+	void submit(std::function<void()> func);
+	// wait for all the tasks, rethrowing the first error
+	void wait();
+};
+
+TaskGroup::TaskGroup(const struct sqdelta_thread_pool& new_pool,
+		const struct sqdelta_allocator& new_allocator)
+	: pool(new_pool), st(new state)
+{
+	st->allocator = new_allocator;
+	st->pending = 0;
+}
+
+TaskGroup::~TaskGroup()
+{
+	// the tasks refer to the caller's data, never leave them running
+	drain();
+}
+
+bool TaskGroup::run_next(struct state& st)
+{
+	std::function<void()> func;
+
+	{
+		std::lock_guard<std::mutex> guard(st.lock);
+		if (st.queue.empty())
+			return false;
+
+		func.swap(st.queue.front());
+		st.queue.pop_front();
+	}
+
+	{
+		AllocatorScope alloc_scope(st.allocator);
+
+		try
+		{
+			func();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> guard(st.lock);
+			if (!st.error)
+				st.error = std::current_exception();
+		}
+	}
+
+	std::lock_guard<std::mutex> guard(st.lock);
+	if (--st.pending == 0)
+		st.finished.notify_all();
+	return true;
+}
+
+void TaskGroup::run_task(void* arg)
+{
+	std::shared_ptr<struct state>* task_st
+		= static_cast<std::shared_ptr<struct state>*>(arg);
+
+	run_next(**task_st);
+	delete task_st;
+}
+
+void TaskGroup::submit(std::function<void()> func)
+{
+	{
+		std::lock_guard<std::mutex> guard(st->lock);
+		st->queue.push_back(func);
+		++st->pending;
+	}
+
+	if (pool.submit)
+	{
+		std::shared_ptr<struct state>* task_st
+			= new std::shared_ptr<struct state>(st);
+
+		if (pool.submit(pool.user, run_task, task_st) == 0)
+			return;
+
+		// the pool refused it, run it here then
+		delete task_st;
+	}
+
+	run_next(*st);
+}
+
+void TaskGroup::drain()
+{
+	while (run_next(*st))
+		;
+
+	// the ones taken by the pool
+	std::unique_lock<std::mutex> guard(st->lock);
+	while (st->pending > 0)
+		st->finished.wait(guard);
+}
+
+void TaskGroup::wait()
+{
+	drain();
+
+	std::lock_guard<std::mutex> guard(st->lock);
+	if (st->error)
+	{
+		std::exception_ptr e = st->error;
+		st->error = std::exception_ptr();
+		std::rethrow_exception(e);
+	}
+}
+
+DeltaImage::DeltaImage()
+	: f(0), c(0), blocks(0), table(0), block_size(0)
+{
+}
+
+DeltaImage::~DeltaImage()
+{
+	delete table;
+	delete blocks;
+	delete c;
+	delete f;
+}
+
+size_t DeltaImage::block_count() const
+{
+	if (table)
+		return table->size();
+	return blocks ? blocks->size() : 0;
+}
+
+size_t DeltaImage::memory_size() const
+{
+	size_t ret = 0;
+
+	// list nodes carry two pointers on top of the block
+	if (blocks)
+		ret += blocks->size() * (sizeof(struct compressed_block)
+				+ 2 * sizeof(void*));
+
+	if (f)
+		ret += f->mapped_size();
+	return ret;
+}
+
+DeltaSession::DeltaSession(const struct sqdelta_options* new_opts)
+{
+	// read nothing past the options the caller knows of
+	if (new_opts && new_opts->struct_size != sizeof(*new_opts))
+		throw DeltaError(SQDELTA_ERR_INVALID, "Options of a different "
+				"library version, use sqdelta_options_init()");
+
+	if (new_opts)
+		opts = *new_opts;
+	else
+		sqdelta_options_init(&opts);
+
+	io.reset(new io_settings());
+	if (opts.io_engine == SQDELTA_IO_URING)
+		io->engine = io_engine::uring;
+	io->budget.set_limit(opts.memory_limit);
+
+	set_callbacks(0);
+	set_thread_pool(0);
+	set_allocator(0);
+
+	created = std::chrono::steady_clock::now();
+	if (opts.work_dir)
+		checkpoints.reset(new CheckpointDir(opts.work_dir));
+}
+
+double DeltaSession::time_left() const
+{
+	if (!(opts.deadline > 0))
+		return std::numeric_limits<double>::infinity();
+
+	std::chrono::duration<double> elapsed
+		= std::chrono::steady_clock::now() - created;
+	return opts.deadline - elapsed.count();
+}
+
+void DeltaSession::set_callbacks(const struct sqdelta_callbacks* new_callbacks)
+{
+	if (new_callbacks)
+		callbacks = *new_callbacks;
+	else
+		memset(&callbacks, 0, sizeof(callbacks));
+}
+
+void DeltaSession::set_thread_pool(const struct sqdelta_thread_pool* new_pool)
+{
+	if (new_pool)
+		pool = *new_pool;
+	else
+		memset(&pool, 0, sizeof(pool));
+}
+
+void DeltaSession::set_allocator(const struct sqdelta_allocator* new_allocator)
+{
+	if (new_allocator && new_allocator->alloc && new_allocator->free)
+		allocator = *new_allocator;
+	else
+		memset(&allocator, 0, sizeof(allocator));
+}
+
+void DeltaSession::message(const std::string& text) const
+{
+	if (callbacks.message)
+		callbacks.message(callbacks.user, text.c_str());
+}
+
+void DeltaSession::progress(enum sqdelta_stage stage,
+		uint64_t done, uint64_t total) const
+{
+	if (callbacks.progress)
+		callbacks.progress(callbacks.user, stage, done, total);
+}
+
+// a detached task, keeping its own copy of the allocator
+struct session_task
+{
+	struct sqdelta_allocator allocator;
+	std::function<void()> func;
+
+	static void run(void* arg)
+	{
+		struct session_task* t = static_cast<struct session_task*>(arg);
+
+		{
+			AllocatorScope alloc_scope(t->allocator);
+
+			try
+			{
+				t->func();
+			}
+			catch (...)
+			{
+			}
+		}
+
+		delete t;
+	}
+};
+
+bool DeltaSession::submit(std::function<void()> func) const
+{
+	if (!pool.submit)
+		return false;
+
+	struct session_task* t = new session_task;
+	t->allocator = allocator;
+	t->func = func;
+
+	if (pool.submit(pool.user, session_task::run, t) == 0)
+		return true;
+
+	delete t;
+	return false;
+}
+
+void DeltaSession::analyse(DeltaImage& image, const char* path) const
+{
+	// the engine is probed once per process, so is the fallback told
+	static std::atomic<bool> fallback_reported(false);
+	if (io->engine == io_engine::uring && !use_io_uring(io.get())
+			&& !fallback_reported.exchange(true))
+		message("io_uring is not available, falling back to mmap.");
+
+	int flags = 0;
+
+	if (opts.populate)
+		flags |= mmap_flags::populate;
+	if (opts.huge_pages)
+		flags |= mmap_flags::huge_pages;
+
+	try
+	{
+		image.f = new MMAPFile();
+
+		int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			throw IOError("Unable to open file", errno);
+
+		// pipes are read once, into a temporary file in the mapped form
+		struct stat st;
+		if (fstat(fd, &st) == 0 && !S_ISREG(st.st_mode)
+				&& !S_ISBLK(st.st_mode))
+		{
+			message(std::string("Spooling the stream: ") + path);
+
+			int spool_fd;
+			try
+			{
+				spool_fd = spool_stream(fd, temporary_directory(opts.tmpdir));
+			}
+			catch (...)
+			{
+				::close(fd);
+				throw;
+			}
+
+			::close(fd);
+			fd = spool_fd;
+		}
+
+		image.f->open(fd, flags, opts.readahead, opts.window, io.get());
+
+		std::string table_name;
+		if (checkpoints && opts.sort_memory)
+			message("The work directory needs in-memory block tables, "
+					"not used.");
+		else if (checkpoints)
+		{
+			image.key = file_digest(*image.f);
+			table_name = image.key + ".table";
+
+			MMAPFile table_f;
+			if (load_checkpoint(table_name, table_f))
+			{
+				read_image_header(*image.f, image.c, image.block_size);
+				read_checkpoint_header(table_f);
+				image.blocks = new std::list<struct compressed_block>();
+				read_checkpoint_blocks(table_f, *image.blocks);
+
+				message("Block table loaded from the work directory.");
+				return;
+			}
+		}
+
+		if (opts.sort_memory)
+			image.table = get_blocks_external(*image.f, image.c,
+					image.block_size, opts.sort_memory,
+					temporary_directory(opts.tmpdir), this);
+		else
+			image.blocks = new std::list<struct compressed_block>(
+					get_blocks(*image.f, image.c, image.block_size, this));
+
+		if (!table_name.empty())
+		{
+			SparseFileWriter table_out(io.get());
+
+			std::string partial = checkpoints->partial_path(table_name);
+
+			table_out.open(partial.c_str());
+			write_checkpoint_header(table_out);
+			write_checkpoint_blocks(table_out, *image.blocks);
+			table_out.close();
+			save_checkpoint(table_name, partial);
+		}
+	}
+	catch (...)
+	{
+		rethrow_delta_error(std::string("file: ") + path);
+	}
+}
+
+DeltaImage* DeltaSession::open_image(const char* path) const
+{
+	AllocatorScope alloc_scope(allocator);
+	DeltaImage* image = new DeltaImage();
+
+	try
+	{
+		message(std::string("Image: ") + path);
+		analyse(*image, path);
+		message("");
+	}
+	catch (...)
+	{
+		delete image;
+		throw;
+	}
+
+	return image;
+}
+
+void DeltaSession::open_images(const char* source_path,
+		const char* target_path,
+		DeltaImage*& source, DeltaImage*& target) const
+{
+	AllocatorScope alloc_scope(allocator);
+	DeltaImage* new_source = new DeltaImage();
+	DeltaImage* new_target = new DeltaImage();
+
+	try
+	{
+		TaskGroup tasks(pool, allocator);
+
+		tasks.submit([&]() {
+				message(std::string("Source: ") + source_path);
+				analyse(*new_source, source_path);
+				message("");
+			});
+		tasks.submit([&]() {
+				message(std::string("Target: ") + target_path);
+				analyse(*new_target, target_path);
+				message("");
+			});
+		tasks.wait();
+	}
+	catch (...)
+	{
+		delete new_source;
+		delete new_target;
+		throw;
+	}
+
+	source = new_source;
+	target = new_target;
+}
+
+// blocks SIGPIPE in the calling thread, so that writing to a dead child
+// fails with EPIPE without touching the process signal handlers
+class SigpipeBlock
+{
+	sigset_t old_mask;
+	bool was_pending;
+
+public:
+	SigpipeBlock()
+	{
+		sigset_t set;
+		sigset_t pending;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &set, &old_mask);
+
+		sigpending(&pending);
+		was_pending = sigismember(&pending, SIGPIPE);
+	}
+
+	~SigpipeBlock()
+	{
+		sigset_t set;
+		sigset_t pending;
+
+		// consume the signal we caused before unblocking it
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		sigpending(&pending);
+		if (!was_pending && sigismember(&pending, SIGPIPE))
+		{
+			struct timespec zero = { 0, 0 };
+			sigtimedwait(&set, 0, &zero);
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old_mask, 0);
+	}
+};
+
+// the unique blocks of one of the images, in offset order; kept in a run
+// file instead of the list in the external-memory mode
+class UniqueBlocks
+{
+	const char* tmpdir;
+	size_t memory;
+
+public:
+	std::list<struct compressed_block> list;
+	std::unique_ptr<BlockRunFile> run;
+	// the order of the list blocks in the expanded file, if not
+	// the offset order
+	std::vector<uint32_t> order;
+	// the normalised metadata blocks
+	block_replacements replacements;
+
+	UniqueBlocks(const char* new_tmpdir, size_t new_memory)
+		: tmpdir(new_tmpdir), memory(new_memory)
+	{
+	}
+
+	size_t size() const
+	{
+		return run ? run->size() : list.size();
+	}
+
+	// drop all the blocks, leaving them compressed in the image
+	void clear()
+	{
+		list.clear();
+		order.clear();
+		replacements.clear();
+		if (run)
+		{
+			run.reset(new BlockRunFile());
+			run->open(tmpdir);
+			run->finish();
+		}
+	}
+
+	// call func(block) for each block, in the offset order
+	template <class F>
+	void for_each(F func) const
+	{
+		if (run)
+		{
+			BlockRunReader r(*run);
+			struct compressed_block block;
+
+			while (r.next(block))
+				func(block);
+		}
+		else
+		{
+			for (std::list<struct compressed_block>::const_iterator
+					i = list.begin(); i != list.end(); ++i)
+				func(*i);
+		}
+	}
+
+	// normalise the metadata blocks, returns the fields rewritten
+	size_t normalise(MMAPFile& f, Compressor& c)
+	{
+		std::unordered_set<size_t> offsets;
+		std::unordered_set<uint32_t> referenced;
+
+		// the copies of a repeated block need to stay identical
+		for_each([&](const struct compressed_block& block) {
+				if (is_block_ref(block))
+					referenced.insert(block.uncompressed_length
+							& ~sqdelta_block_ref);
+			});
+
+		uint32_t index = 0;
+		for_each([&](const struct compressed_block& block) {
+				if (is_block_expanded(block) && !referenced.count(index))
+					offsets.insert(block.offset);
+				++index;
+			});
+
+		return normalise_metadata(f, c, offsets, replacements);
+	}
+
+	// compressed length of the blocks to expand
+	uint64_t unique_length() const
+	{
+		uint64_t ret = 0;
+
+		for_each([&](const struct compressed_block& block) {
+				if (is_block_expanded(block))
+					ret += block.length;
+			});
+		return ret;
+	}
+
+	// decompress up to max_length of the blocks, returning
+	// the compressed bytes per second and the expansion ratio
+	void sample_expansion(MMAPFile& f, Compressor& c, size_t block_size,
+			uint64_t max_length, double& rate, double& ratio) const
+	{
+		std::vector<char> buf(std::max<size_t>(block_size,
+					squashfs::metadata_size));
+		std::chrono::steady_clock::time_point start
+			= std::chrono::steady_clock::now();
+		uint64_t length = 0;
+		uint64_t expanded = 0;
+
+		c.reset();
+		for_each([&](const struct compressed_block& block) {
+				if (length >= max_length || !is_block_expanded(block))
+					return;
+
+				f.seek(block.offset, std::ios::beg);
+				expanded += c.decompress(&buf[0],
+						f.read_array<char>(block.length), block.length,
+						buf.size());
+				length += block.length;
+			});
+
+		std::chrono::duration<double> elapsed
+			= std::chrono::steady_clock::now() - start;
+		rate = length / std::max(elapsed.count(), 1e-6);
+		ratio = length ? static_cast<double>(expanded) / length : 1;
+	}
+
+	void expand(SparseFileWriter& outf, MMAPFile& inf, Compressor& c,
+			size_t block_size, const DeltaSession* session,
+			enum sqdelta_stage stage)
+	{
+		if (!run)
+		{
+			write_unpacked_file(outf, inf, list, c, block_size,
+					session, stage, &order, &replacements);
+			return;
+		}
+
+		// the expanded blocks get their uncompressed lengths
+		std::unique_ptr<BlockRunFile> expanded(new BlockRunFile());
+		expanded->open(tmpdir);
+		write_unpacked_file(outf, inf, *run, *expanded, c, block_size,
+				memory, session, stage, &replacements);
+		run.swap(expanded);
+	}
+
+	void write_list(SparseFileWriter& outf, const sqdelta_header& h,
+			bool at_end = true)
+	{
+		if (run)
+			write_block_list(outf, h, *run, at_end);
+		else
+			write_block_list(outf, h, list, order, at_end);
+	}
+};
+
+void DeltaSession::match(const DeltaImage& source, const DeltaImage& target,
+		UniqueBlocks& source_blocks, UniqueBlocks& target_blocks) const
+{
+	if (source.block_size != target.block_size)
+		throw DeltaError(SQDELTA_ERR_INVALID,
+				"Input files have different block sizes");
+	if (typeid(*source.c) != typeid(*target.c))
+		throw DeltaError(SQDELTA_ERR_INVALID,
+				"The two files use different compressors");
+
+	if (source.table && target.table)
+	{
+		BlockRunFile* source_unique;
+		BlockRunFile* target_unique;
+
+		try
+		{
+			remove_common_blocks(*source.table, *target.table,
+					opts.sort_memory, temporary_directory(opts.tmpdir),
+					source_unique, target_unique);
+		}
+		catch (...)
+		{
+			rethrow_delta_error("block tables");
+		}
+		source_blocks.run.reset(source_unique);
+		target_blocks.run.reset(target_unique);
+	}
+	else if (source.blocks && target.blocks)
+	{
+		// the images keep their lists for the next patches
+		source_blocks.list = *source.blocks;
+		target_blocks.list = *target.blocks;
+
+		remove_common_blocks(source_blocks.list, target_blocks.list);
+	}
+	else
+		throw DeltaError(SQDELTA_ERR_INVALID,
+				"The images were analysed with different sort_memory");
+
+	std::ostringstream unique_msg;
+	unique_msg << "Unique blocks found: "
+		<< source_blocks.size() << " in source and "
+		<< target_blocks.size() << " in target.";
+	message(unique_msg.str());
+
+	source_blocks.list.sort(sort_by_offset);
+	target_blocks.list.sort(sort_by_offset);
+}
+
+// blocks sketched per task
+static const size_t sketch_chunk = 256;
+// less similar blocks are left unpaired
+static const double min_pair_similarity = 0.2;
+
+// sketch the decompressed blocks, in parallel chunks
+static void sketch_blocks(const struct sqdelta_thread_pool& pool,
+		const struct sqdelta_allocator& allocator, const MMAPFile& f,
+		const Compressor& c, size_t block_size,
+		const std::list<struct compressed_block>& blocks,
+		std::vector<struct block_sketch>& sketches)
+{
+	TraceSpan span("sketch_blocks");
+	TaskGroup tasks(pool, allocator);
+	std::list<struct compressed_block>::const_iterator chunk = blocks.begin();
+
+	sketches.resize(blocks.size());
+	for (size_t start = 0; start < blocks.size(); start += sketch_chunk)
+	{
+		tasks.submit([&, chunk, start]() {
+				std::unique_ptr<Compressor> tc(c.clone());
+				MMAPFile tf(f);
+				std::vector<char> buf(std::max<size_t>(block_size,
+							squashfs::metadata_size));
+				std::list<struct compressed_block>::const_iterator i = chunk;
+
+				for (size_t j = start; j < sketches.size()
+						&& j < start + sketch_chunk; ++j, ++i)
+				{
+					tf.seek(i->offset, std::ios::beg);
+					size_t length = tc->decompress(&buf[0],
+							tf.read_array<char>(i->length), i->length,
+							buf.size());
+
+					sketch_block(&buf[0], length, sketches[j]);
+				}
+			});
+
+		for (size_t j = 0; j < sketch_chunk && chunk != blocks.end(); ++j)
+			++chunk;
+	}
+	tasks.wait();
+}
+
+// the target digest pieces, hashed in tasks of digest_chunk pieces
+static const int digest_piece_log = 20;
+static const size_t digest_chunk = 16;
+
+// the chaining value of piece i of the file
+static struct blake3_cv hash_piece(MMAPFile& f, size_t i)
+{
+	const size_t piece_size = size_t(1) << digest_piece_log;
+	size_t offset = i * piece_size;
+	size_t piece = std::min(piece_size, f.getlen() - offset);
+
+	f.seek(offset, std::ios::beg);
+	return blake3_piece_cv(f.read_array<char>(piece), piece,
+			offset / blake3_chunk_size);
+}
+
+static size_t piece_count(const MMAPFile& f)
+{
+	const size_t piece_size = size_t(1) << digest_piece_log;
+
+	return (f.getlen() + piece_size - 1) / piece_size;
+}
+
+// BLAKE3 chaining values of the pieces of the image; the root is only
+// computed by write_digest(), as it needs all of them
+static void digest_pieces(TaskGroup& tasks, const MMAPFile& f,
+		std::vector<struct blake3_cv>& pieces)
+{
+	pieces.resize(piece_count(f));
+	for (size_t start = 0; start < pieces.size(); start += digest_chunk)
+	{
+		tasks.submit([&, start]() {
+				TraceSpan span("digest_pieces");
+				MMAPFile tf(f);
+
+				for (size_t i = start; i < pieces.size()
+						&& i < start + digest_chunk; ++i)
+					pieces[i] = hash_piece(tf, i);
+			});
+	}
+}
+
+// the digest of the whole file from its pieces
+static void digest_root(const MMAPFile& f,
+		const std::vector<struct blake3_cv>& pieces,
+		unsigned char out[blake3_out_len])
+{
+	if (pieces.size() > 1)
+		blake3_root(pieces, out);
+	else
+	{
+		// a single piece is the root itself
+		MMAPFile tf(f);
+		tf.seek(0, std::ios::beg);
+		blake3_hash(tf.read_array<char>(f.getlen()), f.getlen(), out);
+	}
+}
+
+static std::string hex_digest(const unsigned char* digest, size_t length)
+{
+	std::string hex;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		char buf[3];
+
+		snprintf(buf, sizeof(buf), "%02x", digest[i]);
+		hex += buf;
+	}
+	return hex;
+}
+
+// write the digest extension, returning the digest in hex
+static std::string write_digest(SparseFileWriter& outf, const MMAPFile& f,
+		const std::vector<struct blake3_cv>& pieces)
+{
+	struct sqdelta_digest_header h;
+	uint64_t length = f.getlen();
+
+	h.algorithm = htonl(sqdelta_digest::blake3);
+	h.piece_log = htonl(digest_piece_log);
+	h.length_high = htonl(length >> 32);
+	h.length_low = htonl(length & 0xffffffffUL);
+	h.piece_count = htonl(pieces.size());
+
+	digest_root(f, pieces, h.digest);
+
+	outf.write<struct sqdelta_digest_header>(h);
+	for (std::vector<struct blake3_cv>::const_iterator i = pieces.begin();
+			i != pieces.end(); ++i)
+	{
+		unsigned char cv[blake3_out_len];
+
+		i->to_bytes(cv);
+		outf.write(cv, sizeof(cv));
+	}
+
+	return hex_digest(h.digest, sizeof(h.digest));
+}
+
+// pieces hashed by the caller of file_digest() and the pool workers
+struct file_hashing
+{
+	MMAPFile f;
+	std::vector<struct blake3_cv> pieces;
+	std::atomic<size_t> next;
+
+	std::mutex lock;
+	std::condition_variable finished_cond;
+	size_t finished;
+	std::exception_ptr error;
+
+	file_hashing(const MMAPFile& new_f)
+		: f(new_f), pieces(piece_count(new_f)), next(0), finished(0)
+	{
+	}
+};
+
+static void file_hashing_worker(std::shared_ptr<struct file_hashing> st)
+{
+	TraceSpan span("file_digest");
+	MMAPFile tf(st->f);
+	size_t i;
+
+	while ((i = st->next++) < st->pieces.size())
+	{
+		try
+		{
+			st->pieces[i] = hash_piece(tf, i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> guard(st->lock);
+			if (!st->error)
+				st->error = std::current_exception();
+		}
+
+		std::lock_guard<std::mutex> guard(st->lock);
+		if (++st->finished == st->pieces.size())
+			st->finished_cond.notify_all();
+	}
+}
+
+std::string DeltaSession::file_digest(const MMAPFile& f) const
+{
+	std::shared_ptr<struct file_hashing> st(new file_hashing(f));
+
+	// the caller works too, as it may be running on the pool itself,
+	// e.g. analysing the images
+	for (size_t i = 1; i < st->pieces.size() / digest_chunk && i < 64; ++i)
+	{
+		if (!submit([st]() { file_hashing_worker(st); }))
+			break;
+	}
+	file_hashing_worker(st);
+
+	{
+		std::unique_lock<std::mutex> guard(st->lock);
+		while (st->finished < st->pieces.size())
+			st->finished_cond.wait(guard);
+	}
+
+	if (st->error)
+		std::rethrow_exception(st->error);
+
+	unsigned char digest[blake3_out_len];
+	digest_root(f, st->pieces, digest);
+	return hex_digest(digest, sizeof(digest));
+}
+
+bool DeltaSession::load_checkpoint(const std::string& name,
+		MMAPFile& f) const
+{
+	struct checkpoint_entry entry;
+
+	if (!checkpoints->find(name, entry))
+		return false;
+
+	try
+	{
+		f.open(checkpoints->path(name).c_str(), 0,
+				MMAPFile::default_readahead, 0, io.get());
+		if (f.getlen() == entry.length && file_digest(f) == entry.digest)
+			return true;
+	}
+	catch (IOError& e)
+	{
+	}
+
+	message("Stage " + name + " does not match the manifest, redoing it.");
+	checkpoints->drop(name);
+	return false;
+}
+
+void DeltaSession::save_checkpoint(const std::string& name,
+		const std::string& partial) const
+{
+	struct checkpoint_entry entry;
+	MMAPFile f;
+
+	f.open(partial.c_str(), 0, MMAPFile::default_readahead, 0, io.get());
+	entry.length = f.getlen();
+	entry.digest = file_digest(f);
+	checkpoints->commit(name, partial, entry);
+}
+
+// the expansion order of the source blocks: the source block most
+// similar to each target block, in the target order, then the rest
+// in the offset order; return the number of pairs
+static size_t pair_similar_blocks(
+		const std::vector<struct block_sketch>& source,
+		const std::vector<struct block_sketch>& target,
+		std::vector<uint32_t>& order)
+{
+	TraceSpan span("pair_similar_blocks");
+	SimilarityIndex index(source);
+	std::vector<bool> placed(source.size());
+	size_t pairs = 0;
+
+	order.clear();
+	order.reserve(source.size());
+
+	for (size_t i = 0; i < target.size(); ++i)
+	{
+		long j = index.find(target[i], min_pair_similarity);
+
+		if (j == -1)
+			continue;
+		++pairs;
+		if (placed[j])
+			continue;
+
+		order.push_back(j);
+		placed[j] = true;
+	}
+
+	for (size_t j = 0; j < source.size(); ++j)
+	{
+		if (!placed[j])
+			order.push_back(j);
+	}
+
+	return pairs;
+}
+
+// run xdelta3, encoding in_fd against the source file into out_fd
+static pid_t spawn_xdelta(const char* source_path, int in_fd, int out_fd,
+		const struct encoder_profile& profile)
+{
+	// no allocations after fork()
+	std::vector<std::string> args = encoder_arguments(profile);
+	std::vector<const char*> argv;
+
+	argv.push_back("xdelta3");
+	argv.push_back("-v");
+	for (std::vector<std::string>::iterator i = args.begin();
+			i != args.end(); ++i)
+		argv.push_back(i->c_str());
+	argv.push_back("-s");
+	argv.push_back(source_path);
+	argv.push_back(0);
+
+	pid_t child = fork();
+	if (child == -1)
+	{
+		int fork_errno = errno;
+		throw DeltaError(SQDELTA_ERR_IO, "fork() failed", "", fork_errno);
+	}
+	if (child == 0)
+	{
+		// in child, the caller may be multithreaded so stick
+		// to async-signal-safe calls; the other descriptors
+		// are close-on-exec
+		if (dup2(in_fd, 0) == -1)
+			_exit(127);
+		if (dup2(out_fd, 1) == -1)
+			_exit(127);
+
+		signal(SIGPIPE, SIG_DFL);
+		execvp("xdelta3", const_cast<char* const*>(&argv[0]));
+		_exit(127);
+	}
+
+	return child;
+}
+
+static int wait_xdelta(pid_t child)
+{
+	TraceSpan wait_span("waitpid");
+	int status;
+
+	while (waitpid(child, &status, 0) == -1 && errno == EINTR)
+		;
+	return status;
+}
+
+static void check_xdelta_status(int status)
+{
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+		throw DeltaError(SQDELTA_ERR_DELTA, "Unable to run xdelta3");
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		std::ostringstream status_msg;
+		status_msg << "xdelta3 terminated with error status (return code: "
+			<< WEXITSTATUS(status) << ")";
+		throw DeltaError(SQDELTA_ERR_DELTA, status_msg.str());
+	}
+}
+
+struct encoder_profile DeltaSession::pick_profile(const DeltaImage& source,
+		const DeltaImage& target, uint64_t source_unique,
+		uint64_t target_unique, double expansion) const
+{
+	uint64_t target_size = target.f->getlen();
+
+	return pick_profile(source.f->getlen()
+				+ static_cast<uint64_t>(source_unique * (expansion - 1)),
+			target_size
+				+ static_cast<uint64_t>(target_unique * (expansion - 1)),
+			target_size
+				? static_cast<double>(target_unique) / target_size : 0);
+}
+
+struct encoder_profile DeltaSession::pick_profile(uint64_t expanded_source,
+		uint64_t expanded_target, double unique_ratio) const
+{
+	struct encoder_inputs in;
+
+	in.expanded_source = expanded_source;
+	in.expanded_target = expanded_target;
+	in.unique_ratio = unique_ratio;
+	in.time_budget = opts.encoder.time_budget;
+	// the target is expanded while being encoded, all the time left
+	// goes to the encoder
+	double left = time_left();
+	if (left < std::numeric_limits<double>::infinity()
+			&& !(in.time_budget > 0 && in.time_budget < left))
+		in.time_budget = std::max(left, 1e-3);
+	in.memory_limit = io->budget.get_limit();
+
+	struct encoder_profile profile = choose_encoder_profile(in);
+	try
+	{
+		override_encoder_profile(profile, opts.encoder);
+	}
+	catch (std::invalid_argument& e)
+	{
+		throw DeltaError(SQDELTA_ERR_INVALID, e.what());
+	}
+
+	return profile;
+}
+
+// typical expansion of the compressed blocks, for the encoder profiles
+// picked before they are expanded
+static const double estimate_expansion = 2;
+
+// sample this much of the unique blocks for the expansion throughput
+static const uint64_t deadline_sample = 4 * 1024 * 1024;
+// the similarity pairing decompresses the unique blocks once more,
+// and sketches them
+static const double pairing_cost = 2;
+
+bool DeltaSession::plan_deadline(const DeltaImage& source,
+		const DeltaImage& target, UniqueBlocks& source_blocks,
+		UniqueBlocks& target_blocks, bool& pair_similar) const
+{
+	double left = time_left();
+	if (left == std::numeric_limits<double>::infinity())
+		return false;
+
+	uint64_t source_unique = source_blocks.unique_length();
+	uint64_t target_unique = target_blocks.unique_length();
+	if (source_unique + target_unique == 0)
+		return false;
+
+	double rate;
+	double ratio;
+	{
+		const DeltaImage& image = target_unique ? target : source;
+		MMAPFile f(*image.f);
+		std::unique_ptr<Compressor> c(image.c->clone());
+
+		(target_unique ? target_blocks : source_blocks).sample_expansion(
+				f, *c, image.block_size, deadline_sample, rate, ratio);
+	}
+
+	uint64_t expanded_target = target.f->getlen()
+		+ static_cast<uint64_t>(target_unique * (ratio - 1));
+	// the target is expanded while being encoded
+	double patch_time = source_unique / rate
+		+ std::max(target_unique / rate, encode_seconds(expanded_target, 1));
+
+	std::ostringstream plan_msg;
+	plan_msg << std::fixed << std::setprecision(1) << "Deadline: "
+		<< std::max(left, 0.0) << " s left, expanding at "
+		<< rate / 1e6 << " MB/s, projected " << patch_time << " s.";
+	message(plan_msg.str());
+
+	if (patch_time > left)
+	{
+		// xdelta3 still finds the blocks common to both images,
+		// only the changed ones cost more
+		source_blocks.clear();
+		target_blocks.clear();
+		pair_similar = false;
+		message("Deadline: delta of the whole images, "
+				"the unique blocks are not expanded.");
+		return true;
+	}
+
+	if (pair_similar && patch_time + pairing_cost
+			* (source_unique + target_unique) / rate > left)
+	{
+		pair_similar = false;
+		message("Deadline: similarity pairing skipped.");
+	}
+	return false;
+}
+
+// write the blocks decompressed, one after another, recording
+// their uncompressed lengths
+static void write_decompressed(SparseFileWriter& outf, MMAPFile& f,
+		Compressor& c, size_t block_size,
+		std::vector<struct compressed_block>& blocks)
+{
+	std::vector<char> buf(std::max<size_t>(block_size,
+				squashfs::metadata_size));
+
+	c.reset();
+	for (std::vector<struct compressed_block>::iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+	{
+		f.seek(i->offset, std::ios::beg);
+		const char* data = f.read_array<char>(i->length);
+
+		i->uncompressed_length = c.decompress(&buf[0], data, i->length,
+				buf.size());
+		outf.write(&buf[0], i->uncompressed_length);
+	}
+}
+
+// delta-encode the decompressed target blocks against the decompressed
+// source blocks into delta_out, returning the delta length
+static uint64_t encode_blocks(const MMAPFile& source_file,
+		const MMAPFile& target_file, const Compressor& proto_c,
+		size_t block_size, const char* tmpdir,
+		const struct encoder_profile& profile,
+		std::vector<struct compressed_block>& source,
+		std::vector<struct compressed_block>& target,
+		SparseFileWriter& delta_out)
+{
+	std::unique_ptr<Compressor> c(proto_c.clone());
+	MMAPFile source_f(source_file);
+	MMAPFile target_f(target_file);
+	TemporarySparseFileWriter source_temp(source_file.settings());
+	TemporarySparseFileWriter target_temp(target_file.settings());
+
+	source_temp.open(tmpdir);
+	write_decompressed(source_temp, source_f, *c, block_size, source);
+	source_temp.flush();
+
+	target_temp.open(tmpdir);
+	write_decompressed(target_temp, target_f, *c, block_size, target);
+	target_temp.flush();
+
+	int target_fd = open(target_temp.name(), O_RDONLY | O_CLOEXEC);
+	if (target_fd == -1)
+		throw IOError("Unable to reopen the expanded target blocks", errno);
+
+	int status;
+	try
+	{
+		status = wait_xdelta(spawn_xdelta(source_temp.name(), target_fd,
+					delta_out.fd, profile));
+	}
+	catch (...)
+	{
+		::close(target_fd);
+		throw;
+	}
+	::close(target_fd);
+	check_xdelta_status(status);
+
+	off_t delta_size = lseek(delta_out.fd, 0, SEEK_END);
+	if (delta_size == -1)
+		throw IOError("Unable to get the delta size", errno);
+
+	source_temp.close();
+	target_temp.close();
+	return delta_size;
+}
+
+// files with fewer unique target bytes (compressed) are left to
+// the image delta, a delta of their own would lose the context
+static const uint64_t per_file_min_length = 64 * 1024;
+
+// a file delta-encoded on its own, with the blocks of its two versions
+struct file_delta
+{
+	std::string path;
+	std::vector<struct compressed_block> source;
+	std::vector<struct compressed_block> target;
+	struct encoder_profile profile;
+	TemporarySparseFileWriter delta;
+	uint64_t delta_length;
+
+	file_delta()
+		: delta_length(0)
+	{
+	}
+};
+
+// the file table, then the deltas; returns their total length
+static uint64_t write_file_deltas(SparseFileWriter& outf,
+		std::list<struct file_delta>& files)
+{
+	struct sqdelta_file_table ft;
+	uint64_t total = 0;
+
+	ft.file_count = htonl(files.size());
+	outf.write(ft);
+
+	for (std::list<struct file_delta>::iterator i = files.begin();
+			i != files.end(); ++i)
+	{
+		struct sqdelta_file_entry fe;
+
+		fe.source_block_count = htonl(i->source.size());
+		fe.target_block_count = htonl(i->target.size());
+		fe.delta_length_high = htonl(i->delta_length >> 32);
+		fe.delta_length_low = htonl(i->delta_length & 0xffffffffUL);
+		outf.write(fe);
+
+		for (std::vector<struct compressed_block>::iterator
+				j = i->source.begin(); j != i->source.end(); ++j)
+		{
+			struct serialized_compressed_block b;
+
+			b.offset = htonl(j->offset);
+			b.length = htonl(j->length);
+			b.uncompressed_length = htonl(j->uncompressed_length);
+			outf.write(b);
+		}
+
+		for (std::vector<struct compressed_block>::iterator
+				j = i->target.begin(); j != i->target.end(); ++j)
+			outf.write<uint32_t>(htonl(j->uncompressed_length));
+	}
+
+	for (std::list<struct file_delta>::iterator i = files.begin();
+			i != files.end(); ++i)
+	{
+		MMAPFile df;
+
+		df.open(i->delta.name());
+		copy_raw(outf, df, i->delta_length);
+		i->delta.close();
+		total += i->delta_length;
+	}
+
+	return total;
+}
+
+void DeltaSession::split_files(const DeltaImage& source,
+		const DeltaImage& target, UniqueBlocks& source_blocks,
+		UniqueBlocks& target_blocks, std::list<struct file_delta>& files)
+		const
+{
+	std::vector<size_t> source_offsets;
+	std::vector<size_t> target_offsets;
+	std::vector<struct compressed_block*> source_list;
+	std::vector<struct compressed_block*> target_list;
+
+	for (std::list<struct compressed_block>::iterator
+			i = source_blocks.list.begin(); i != source_blocks.list.end();
+			++i)
+	{
+		source_offsets.push_back(i->offset);
+		source_list.push_back(&*i);
+	}
+	for (std::list<struct compressed_block>::iterator
+			i = target_blocks.list.begin(); i != target_blocks.list.end();
+			++i)
+	{
+		target_offsets.push_back(i->offset);
+		target_list.push_back(&*i);
+	}
+
+	file_blocks source_files;
+	file_blocks target_files;
+
+	try
+	{
+		// the images may be shared by concurrent patches
+		std::unique_ptr<Compressor> source_c(source.c->clone());
+		std::unique_ptr<Compressor> target_c(target.c->clone());
+		MMAPFile source_f(*source.f);
+		MMAPFile target_f(*target.f);
+
+		group_file_blocks(source_f, *source_c, source_offsets,
+				source_files);
+		group_file_blocks(target_f, *target_c, target_offsets,
+				target_files);
+	}
+	catch (...)
+	{
+		rethrow_delta_error("file grouping");
+	}
+
+	// in the path order, so that the patch does not depend
+	// on the hash order
+	std::vector<file_blocks::const_iterator> paired;
+
+	for (file_blocks::const_iterator i = target_files.begin();
+			i != target_files.end(); ++i)
+	{
+		if (source_files.count(i->first))
+			paired.push_back(i);
+	}
+	std::sort(paired.begin(), paired.end(),
+			[](const file_blocks::const_iterator& lhs,
+				const file_blocks::const_iterator& rhs) {
+				return lhs->first < rhs->first;
+			});
+
+	// files sharing blocks, the first one gets them
+	std::vector<bool> claimed(target_list.size());
+	size_t moved = 0;
+
+	for (std::vector<file_blocks::const_iterator>::iterator
+			i = paired.begin(); i != paired.end(); ++i)
+	{
+		std::vector<size_t> indexes;
+		uint64_t target_length = 0;
+
+		for (std::vector<size_t>::const_iterator j = (*i)->second.begin();
+				j != (*i)->second.end(); ++j)
+		{
+			if (claimed[*j])
+				continue;
+			indexes.push_back(*j);
+			target_length += target_list[*j]->length;
+		}
+
+		if (target_length < per_file_min_length)
+			continue;
+
+		// the blocks are expanded in the list order
+		std::sort(indexes.begin(), indexes.end());
+
+		files.emplace_back();
+		struct file_delta& fd = files.back();
+		uint64_t source_length = 0;
+
+		fd.path = (*i)->first;
+		for (std::vector<size_t>::iterator j = indexes.begin();
+				j != indexes.end(); ++j)
+		{
+			claimed[*j] = true;
+			fd.target.push_back(*target_list[*j]);
+			target_list[*j]->uncompressed_length = sqdelta_block_file
+				| (files.size() - 1);
+		}
+
+		const std::vector<size_t>& source_indexes
+			= source_files.find((*i)->first)->second;
+		for (std::vector<size_t>::const_iterator j = source_indexes.begin();
+				j != source_indexes.end(); ++j)
+		{
+			fd.source.push_back(*source_list[*j]);
+			source_length += source_list[*j]->length;
+		}
+
+		fd.profile = pick_profile(
+				static_cast<uint64_t>(source_length * estimate_expansion),
+				static_cast<uint64_t>(target_length * estimate_expansion),
+				1);
+		moved += indexes.size();
+	}
+
+	std::ostringstream files_msg;
+	files_msg << "Per-file deltas: " << files.size() << " of "
+		<< target_files.size() << " files, " << moved << " of "
+		<< target_blocks.size() << " target blocks.";
+	message(files_msg.str());
+}
+
+void DeltaSession::write_patch(const DeltaImage& source,
+		const DeltaImage& target, SparseFileWriter& patch_out) const
+{
+	const char* tmpdir = temporary_directory(opts.tmpdir);
+	UniqueBlocks source_blocks(tmpdir, opts.sort_memory);
+	UniqueBlocks target_blocks(tmpdir, opts.sort_memory);
+	size_t block_size = source.block_size;
+
+	// the stages of the patch are named after the images and the options
+	// that change the expanded files
+	std::string stage_key;
+	if (!source.key.empty() && !target.key.empty() && opts.per_file)
+		message("Per-file deltas: the stages are not kept in the work "
+				"directory.");
+	else if (!source.key.empty() && !target.key.empty())
+	{
+		std::ostringstream inputs;
+		unsigned char key[blake3_out_len];
+
+		inputs << source.key << ' ' << target.key
+			<< " dedupe=" << !!opts.dedupe
+			<< " pair_similar=" << !!opts.pair_similar
+			<< " normalise_metadata=" << !!opts.normalise_metadata
+			<< " target_digest=" << !!opts.target_digest;
+		blake3_hash(inputs.str().data(), inputs.str().size(), key);
+		stage_key = hex_digest(key, sizeof(key));
+	}
+
+	bool resumed_match = false;
+	bool resumed_source = false;
+	if (!stage_key.empty())
+	{
+		MMAPFile match_f;
+		MMAPFile list_f;
+		MMAPFile source_f;
+
+		try
+		{
+			if (load_checkpoint(stage_key + ".match", match_f))
+			{
+				read_checkpoint_header(match_f);
+				read_checkpoint_blocks(match_f, source_blocks.list);
+				read_checkpoint_order(match_f, source_blocks.order);
+				read_checkpoint_blocks(match_f, target_blocks.list);
+				resumed_match = true;
+				message("Unique blocks loaded from the work directory.");
+			}
+
+			if (resumed_match
+					&& load_checkpoint(stage_key + ".source-list", list_f)
+					&& load_checkpoint(stage_key + ".source", source_f))
+			{
+				// with the uncompressed lengths
+				read_checkpoint_header(list_f);
+				read_checkpoint_blocks(list_f, source_blocks.list);
+				read_checkpoint_order(list_f, source_blocks.order);
+				resumed_source = true;
+			}
+		}
+		catch (...)
+		{
+			rethrow_delta_error("work directory");
+		}
+	}
+
+	if (!resumed_match)
+		match(source, target, source_blocks, target_blocks);
+
+	bool pair_similar = opts.pair_similar && !resumed_match;
+	if (plan_deadline(source, target, source_blocks, target_blocks,
+				pair_similar) && !stage_key.empty())
+	{
+		message("Deadline: the stages are not kept in the work directory.");
+		stage_key.clear();
+		resumed_source = false;
+	}
+
+	// before the back-references and the expansion order, which are
+	// indexes into the lists the per-file blocks stay in
+	std::list<struct file_delta> files;
+	TaskGroup file_tasks(pool, allocator);
+	if (opts.per_file && source_blocks.run)
+		message("Per-file deltas need in-memory block tables, skipped.");
+	else if (opts.per_file)
+	{
+		split_files(source, target, source_blocks, target_blocks, files);
+
+		// encoded while the rest of the patch is prepared
+		for (std::list<struct file_delta>::iterator i = files.begin();
+				i != files.end(); ++i)
+		{
+			struct file_delta* fd = &*i;
+
+			file_tasks.submit([&, fd]() {
+					fd->delta.open(tmpdir);
+					fd->delta_length = encode_blocks(*source.f, *target.f,
+							*target.c, block_size, tmpdir, fd->profile,
+							fd->source, fd->target, fd->delta);
+				});
+		}
+	}
+
+	// the loaded unique blocks have been through these
+	if (!resumed_match)
+	{
+		if (opts.dedupe && source_blocks.run)
+			message("Deduplication needs in-memory block tables, "
+					"skipped.");
+		else if (opts.dedupe)
+		{
+			size_t source_refs = dedupe_blocks(*source.f,
+					source_blocks.list);
+			size_t target_refs = dedupe_blocks(*target.f,
+					target_blocks.list);
+
+			std::ostringstream dedupe_msg;
+			dedupe_msg << "Repeated blocks: " << source_refs
+				<< " in source, " << target_refs << " in target.";
+			message(dedupe_msg.str());
+		}
+
+		if (pair_similar && source_blocks.run)
+			message("Similarity pairing needs in-memory block tables, "
+					"skipped.");
+		else if (pair_similar && source_blocks.size() > 0)
+		{
+			std::vector<struct block_sketch> source_sketches;
+			std::vector<struct block_sketch> target_sketches;
+
+			message("Sketching the unique blocks...");
+			try
+			{
+				sketch_blocks(pool, allocator, *source.f, *source.c,
+						source.block_size, source_blocks.list,
+						source_sketches);
+				sketch_blocks(pool, allocator, *target.f, *target.c,
+						target.block_size, target_blocks.list,
+						target_sketches);
+			}
+			catch (...)
+			{
+				rethrow_delta_error("similarity");
+			}
+
+			size_t pairs = pair_similar_blocks(source_sketches,
+					target_sketches, source_blocks.order);
+
+			std::ostringstream pair_msg;
+			pair_msg << "Paired " << pairs << " of "
+				<< target_blocks.size()
+				<< " target blocks with similar source blocks.";
+			message(pair_msg.str());
+		}
+	}
+
+	if (!stage_key.empty() && !resumed_match)
+	{
+		std::string name = stage_key + ".match";
+
+		try
+		{
+			SparseFileWriter match_out(io.get());
+
+			std::string partial = checkpoints->partial_path(name);
+
+			match_out.open(partial.c_str());
+			write_checkpoint_header(match_out);
+			write_checkpoint_blocks(match_out, source_blocks.list);
+			write_checkpoint_order(match_out, source_blocks.order);
+			write_checkpoint_blocks(match_out, target_blocks.list);
+			match_out.close();
+			save_checkpoint(name, partial);
+		}
+		catch (...)
+		{
+			rethrow_delta_error("work directory");
+		}
+	}
+
+	// the images may be shared by concurrent patches
+	std::unique_ptr<Compressor> source_c(source.c->clone());
+	std::unique_ptr<Compressor> target_c(target.c->clone());
+
+	// now we need to write the expanded files
+
+	struct sqdelta_header dh;
+	dh.flags = htonl(0);
+	dh.magic = htonl(sqdelta_magic);
+	dh.compression = htonl(source_c->get_compression_value());
+
+	MMAPFile source_f(*source.f);
+	MMAPFile target_f(*target.f);
+
+	if (opts.normalise_metadata)
+	{
+		size_t source_fields;
+		size_t target_fields;
+
+		try
+		{
+			// the expanded source has them already
+			source_fields = resumed_source ? 0
+				: source_blocks.normalise(source_f, *source_c);
+			target_fields = target_blocks.normalise(target_f, *target_c);
+		}
+		catch (...)
+		{
+			rethrow_delta_error("metadata");
+		}
+
+		dh.flags = htonl(ntohl(dh.flags)
+				| sqdelta_flags::normalised_metadata);
+
+		std::ostringstream normalise_msg;
+		normalise_msg << "Normalised " << source_fields << " source and "
+			<< target_fields << " target metadata fields.";
+		message(normalise_msg.str());
+	}
+
+	std::vector<struct blake3_cv> digest;
+	TaskGroup digest_tasks(pool, allocator);
+
+	// the target is hashed while the source is expanded
+	if (opts.target_digest)
+	{
+		dh.flags = htonl(ntohl(dh.flags) | sqdelta_flags::target_digest);
+		digest_pieces(digest_tasks, *target.f, digest);
+	}
+
+	// kept in the work directory, if there is one
+	TemporarySparseFileWriter source_temp(io.get());
+	SparseFileWriter source_kept(io.get());
+	SparseFileWriter& source_out = stage_key.empty()
+		? static_cast<SparseFileWriter&>(source_temp) : source_kept;
+	std::string source_path;
+	std::string source_partial;
+	if (resumed_source)
+	{
+		message("Expanded source file loaded from the work directory.");
+		source_path = checkpoints->path(stage_key + ".source");
+	}
+	else
+	{
+		try
+		{
+			message("Writing expanded source file...");
+
+			source_c->reset();
+			if (stage_key.empty())
+			{
+				source_temp.open(tmpdir,
+						opts.preallocate ? source_f.getlen() : 0);
+				source_path = source_temp.name();
+			}
+			else
+			{
+				source_partial = checkpoints->partial_path(
+						stage_key + ".source");
+				source_kept.open(source_partial.c_str(),
+						opts.preallocate ? source_f.getlen() : 0);
+			}
+			if (io->budget.get_limit())
+				source_out.set_writeback(MMAPFile::default_readahead);
+			source_blocks.expand(source_out, source_f, *source_c, block_size,
+					this, SQDELTA_STAGE_EXPAND_SOURCE);
+			source_blocks.write_list(source_out, dh);
+			// xdelta3 reads it by name
+			source_out.flush();
+		}
+		catch (...)
+		{
+			rethrow_delta_error("temporary file for source");
+		}
+	}
+
+	if (!stage_key.empty() && !resumed_source)
+	{
+		std::string name = stage_key + ".source-list";
+
+		try
+		{
+			SparseFileWriter list_out(io.get());
+			std::string partial = checkpoints->partial_path(name);
+
+			source_kept.close();
+			list_out.open(partial.c_str());
+			write_checkpoint_header(list_out);
+			write_checkpoint_blocks(list_out, source_blocks.list);
+			write_checkpoint_order(list_out, source_blocks.order);
+			list_out.close();
+
+			save_checkpoint(stage_key + ".source", source_partial);
+			save_checkpoint(name, partial);
+			source_path = checkpoints->path(stage_key + ".source");
+		}
+		catch (...)
+		{
+			rethrow_delta_error("work directory");
+		}
+	}
+
+	try
+	{
+		digest_tasks.wait();
+
+		if (!files.empty())
+			dh.flags = htonl(ntohl(dh.flags) | sqdelta_flags::per_file);
+		source_blocks.write_list(patch_out, dh, false);
+		if (opts.target_digest)
+			message("Target digest: "
+					+ write_digest(patch_out, *target.f, digest));
+	}
+	catch (...)
+	{
+		rethrow_delta_error("patch header");
+	}
+
+	if (!files.empty())
+	{
+		try
+		{
+			message("Waiting for the per-file deltas...");
+			file_tasks.wait();
+
+			std::ostringstream files_msg;
+			files_msg << "Per-file deltas written: "
+				<< write_file_deltas(patch_out, files) << " bytes.";
+			message(files_msg.str());
+		}
+		catch (...)
+		{
+			rethrow_delta_error("per-file deltas");
+		}
+	}
+
+	try
+	{
+		// xdelta3 appends to the same descriptor
+		patch_out.flush();
+	}
+	catch (...)
+	{
+		rethrow_delta_error("patch header");
+	}
+
+	// the expansion of the source blocks tells about the target ones
+	uint64_t source_unique = 0;
+	uint64_t source_expanded = 0;
+	uint64_t target_unique = 0;
+
+	source_blocks.for_each([&](const struct compressed_block& block) {
+			if (!is_block_expanded(block))
+				return;
+			source_unique += block.length;
+			source_expanded += block.uncompressed_length;
+		});
+	target_blocks.for_each([&](const struct compressed_block& block) {
+			if (is_block_expanded(block))
+				target_unique += block.length;
+		});
+
+	struct encoder_profile profile = pick_profile(source, target,
+			source_unique, target_unique, source_unique
+				? static_cast<double>(source_expanded) / source_unique : 1);
+
+	std::ostringstream profile_msg;
+	profile_msg << "Encoder profile: " << profile;
+	message(profile_msg.str());
+
+	message("Calling xdelta to generate the diff...");
+
+	// the expanded target is streamed to xdelta3 through a pipe,
+	// so it is encoded while being decompressed
+	int target_pipe[2];
+	if (pipe2(target_pipe, O_CLOEXEC) == -1)
+		throw DeltaError(SQDELTA_ERR_IO, "pipe() failed", "", errno);
+
+	pid_t child;
+	try
+	{
+		child = spawn_xdelta(source_path.c_str(), target_pipe[0],
+				patch_out.fd, profile);
+	}
+	catch (...)
+	{
+		::close(target_pipe[0]);
+		::close(target_pipe[1]);
+		throw;
+	}
+
+	SparseFileWriter target_stream(io.get());
+	std::exception_ptr target_error;
+	int status;
+
+	::close(target_pipe[0]);
+
+	try
+	{
+		SigpipeBlock sigpipe_block;
+
+		message("Streaming expanded target file...");
+
+		target_stream.attach(target_pipe[1]);
+		target_c->reset();
+		target_blocks.expand(target_stream, target_f, *target_c, block_size,
+				this, SQDELTA_STAGE_EXPAND_TARGET);
+		target_blocks.write_list(target_stream, dh);
+		target_stream.close();
+	}
+	catch (...)
+	{
+		target_error = std::current_exception();
+		// do not let xdelta3 finish a patch for a truncated target
+		kill(child, SIGTERM);
+	}
+
+	status = wait_xdelta(child);
+
+	// the stream fails with EPIPE then, report the actual cause
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+		throw DeltaError(SQDELTA_ERR_DELTA, "Unable to run xdelta3");
+
+	if (target_error)
+	{
+		try
+		{
+			std::rethrow_exception(target_error);
+		}
+		catch (...)
+		{
+			rethrow_delta_error("target stream");
+		}
+	}
+
+	check_xdelta_status(status);
+
+	if (!source_path.empty() && stage_key.empty())
+		source_temp.close();
+	patch_out.close();
+
+	double left = time_left();
+	if (left < std::numeric_limits<double>::infinity())
+	{
+		std::ostringstream deadline_msg;
+		deadline_msg << std::fixed << std::setprecision(1) << "Deadline: "
+			<< (left >= 0 ? "met with " : "missed by ")
+			<< std::fabs(left) << " s"
+			<< (left >= 0 ? " to spare." : ".");
+		message(deadline_msg.str());
+	}
+}
+
+void DeltaSession::make_patch(const DeltaImage& source,
+		const DeltaImage& target, const char* patch_path) const
+{
+	AllocatorScope alloc_scope(allocator);
+	SparseFileWriter patch_out(io.get());
+
+	try
+	{
+		patch_out.open(patch_path);
+	}
+	catch (...)
+	{
+		rethrow_delta_error(std::string("file: ") + patch_path);
+	}
+
+	try
+	{
+		write_patch(source, target, patch_out);
+	}
+	catch (...)
+	{
+		rethrow_delta_error("");
+	}
+}
+
+void DeltaSession::make_patch(const DeltaImage& source,
+		const DeltaImage& target, int patch_fd) const
+{
+	AllocatorScope alloc_scope(allocator);
+	SparseFileWriter patch_out(io.get());
+
+	// our own copy, kept out of the xdelta3 children
+	int fd = fcntl(patch_fd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
+		throw DeltaError(SQDELTA_ERR_IO, "Unable to duplicate the patch "
+				"descriptor", "", errno);
+
+	try
+	{
+		patch_out.attach(fd);
+	}
+	catch (...)
+	{
+		// closed by patch_out
+		rethrow_delta_error("patch descriptor");
+	}
+
+	try
+	{
+		write_patch(source, target, patch_out);
+	}
+	catch (...)
+	{
+		rethrow_delta_error("");
+	}
+}
+
+// the samples are split into batches run through xdelta3 separately,
+// the spread between the batches gives the confidence interval
+static const size_t estimate_batches = 16;
+// at least this many samples, the interval is useless with fewer
+static const size_t estimate_min_samples = 64;
+// unique source blocks taken on each side of a sample position
+static const size_t estimate_neighbours = 4;
+
+// two-sided 95% quantiles of Student's t, by the degrees of freedom
+static const double t_quantile[estimate_batches] = {
+	0, 12.71, 4.30, 3.18, 2.78, 2.57, 2.45, 2.36,
+	2.31, 2.26, 2.23, 2.20, 2.18, 2.16, 2.14, 2.13
+};
+
+struct estimate_batch
+{
+	std::vector<struct compressed_block> source;
+	std::vector<struct compressed_block> target;
+	// compressed size of the target blocks, and their delta size
+	uint64_t compressed;
+	uint64_t delta;
+
+	estimate_batch()
+		: compressed(0), delta(0)
+	{
+	}
+};
+
+// delta-encode the target blocks of the batch against its source blocks
+static void run_estimate_batch(struct estimate_batch& batch,
+		const MMAPFile& source_file, const MMAPFile& target_file,
+		const Compressor& proto_c, size_t block_size, const char* tmpdir,
+		const struct encoder_profile& profile)
+{
+	TemporarySparseFileWriter delta_temp(source_file.settings());
+
+	delta_temp.open(tmpdir);
+	batch.delta = encode_blocks(source_file, target_file, proto_c,
+			block_size, tmpdir, profile, batch.source, batch.target,
+			delta_temp);
+	delta_temp.close();
+}
+
+void DeltaSession::estimate_patch(const DeltaImage& source,
+		const DeltaImage& target, double fraction,
+		struct sqdelta_estimate& estimate) const
+{
+	if (!(fraction > 0 && fraction <= 1))
+		throw DeltaError(SQDELTA_ERR_INVALID,
+				"The sampled fraction needs to be in (0, 1]");
+
+	const char* tmpdir = temporary_directory(opts.tmpdir);
+	UniqueBlocks source_blocks(tmpdir, opts.sort_memory);
+	UniqueBlocks target_blocks(tmpdir, opts.sort_memory);
+
+	match(source, target, source_blocks, target_blocks);
+
+	size_t source_count = source_blocks.size();
+	size_t target_count = target_blocks.size();
+
+	memset(&estimate, 0, sizeof(estimate));
+	estimate.source_unique = source_count;
+	estimate.target_unique = target_count;
+	estimate.target_size = target.f->getlen();
+
+	// the block lists are known exactly; the target one is counted
+	// as if xdelta3 could not do anything with it
+	uint64_t fixed = 2 * sizeof(struct sqdelta_header)
+		+ (source_count + target_count)
+			* sizeof(struct serialized_compressed_block);
+
+	estimate.patch_size = fixed;
+	estimate.patch_size_low = fixed;
+	estimate.patch_size_high = fixed;
+	if (target_count == 0)
+		return;
+
+	// systematic sample, the middle block of each stratum
+	size_t samples = std::min(target_count, std::max(estimate_min_samples,
+				static_cast<size_t>(ceil(fraction * target_count))));
+	size_t batch_count = std::min(samples, estimate_batches);
+	std::vector<struct estimate_batch> batches(batch_count);
+	std::vector<uint64_t> positions;
+	uint64_t target_total = 0;
+	size_t index = 0;
+
+	positions.reserve(samples);
+	target_blocks.for_each([&](const struct compressed_block& block) {
+			size_t next = positions.size();
+
+			if (next < samples && index == (2 * next + 1) * target_count
+					/ (2 * samples))
+			{
+				// same relative position in the source
+				positions.push_back(static_cast<uint64_t>(
+						static_cast<double>(block.offset)
+						* source.f->getlen() / target.f->getlen()));
+
+				struct estimate_batch& b = batches[next % batch_count];
+				b.target.push_back(block);
+				b.compressed += block.length;
+			}
+
+			target_total += block.length;
+			++index;
+		});
+
+	// the unique source blocks nearest to each position; the positions
+	// are increasing, so are the ranges of the block indexes
+	std::vector<size_t> first(samples);
+	uint64_t source_total = 0;
+	size_t k = 0;
+
+	index = 0;
+	source_blocks.for_each([&](const struct compressed_block& block) {
+			for (; k < samples && positions[k] <= block.offset; ++k)
+				first[k] = index > estimate_neighbours
+					? index - estimate_neighbours : 0;
+			source_total += block.length;
+			++index;
+		});
+	for (; k < samples; ++k)
+		first[k] = source_count > estimate_neighbours
+			? source_count - estimate_neighbours : 0;
+
+	// the last block index added to each batch
+	std::vector<size_t> added(batch_count, source_count);
+
+	k = 0;
+	index = 0;
+	source_blocks.for_each([&](const struct compressed_block& block) {
+			for (; k < samples && first[k] + 2 * estimate_neighbours
+					<= index; ++k)
+				;
+			for (size_t i = k; i < samples && first[i] <= index; ++i)
+			{
+				if (index >= first[i] + 2 * estimate_neighbours)
+					continue;
+				if (added[i % batch_count] == index)
+					continue;
+
+				batches[i % batch_count].source.push_back(block);
+				added[i % batch_count] = index;
+			}
+			++index;
+		});
+
+	// nothing is expanded yet, so the expansion is a guess
+	struct encoder_profile profile = pick_profile(source, target,
+			source_total, target_total, estimate_expansion);
+
+	std::ostringstream sample_msg;
+	sample_msg << "Estimating from " << samples << " target blocks in "
+		<< batch_count << " batches, encoder profile: " << profile;
+	message(sample_msg.str());
+
+	try
+	{
+		TaskGroup tasks(pool, allocator);
+
+		for (size_t i = 0; i < batch_count; ++i)
+		{
+			struct estimate_batch& b = batches[i];
+
+			tasks.submit([&]() {
+					run_estimate_batch(b, *source.f, *target.f, *target.c,
+							source.block_size, tmpdir, profile);
+				});
+		}
+		tasks.wait();
+	}
+	catch (...)
+	{
+		rethrow_delta_error("estimate");
+	}
+
+	// ratio estimator of the delta size per compressed byte
+	uint64_t compressed = 0;
+	uint64_t delta = 0;
+
+	for (size_t i = 0; i < batch_count; ++i)
+	{
+		compressed += batches[i].compressed;
+		delta += batches[i].delta;
+	}
+
+	double ratio = static_cast<double>(delta) / compressed;
+	double expected = ratio * target_total;
+	double margin = 0;
+
+	if (batch_count > 1)
+	{
+		double sq_sum = 0;
+
+		for (size_t i = 0; i < batch_count; ++i)
+		{
+			double residual = batches[i].delta
+				- ratio * batches[i].compressed;
+			sq_sum += residual * residual;
+		}
+
+		double mean_compressed = static_cast<double>(compressed)
+			/ batch_count;
+		double ratio_se = sqrt(sq_sum / (batch_count - 1) / batch_count)
+			/ mean_compressed;
+		// the finite population correction
+		ratio_se *= sqrt(1 - static_cast<double>(samples) / target_count);
+
+		margin = t_quantile[batch_count - 1] * ratio_se * target_total;
+	}
+
+	estimate.sampled = samples;
+	estimate.patch_size = fixed + static_cast<uint64_t>(expected);
+	estimate.patch_size_low = fixed
+		+ static_cast<uint64_t>(std::max(expected - margin, 0.0));
+	estimate.patch_size_high = fixed
+		+ static_cast<uint64_t>(expected + margin);
+}
+
+void DeltaSession::make_estimate(const DeltaImage& source,
+		const DeltaImage& target, double fraction,
+		struct sqdelta_estimate& estimate) const
+{
+	AllocatorScope alloc_scope(allocator);
+
+	try
+	{
+		estimate_patch(source, target, fraction, estimate);
+	}
+	catch (...)
+	{
+		rethrow_delta_error("");
+	}
+}
+
+void DeltaSession::write_report(const DeltaImage& source,
+		const DeltaImage& target, const char* json_path,
+		std::ostream* table, size_t top) const
+{
+	const char* tmpdir = temporary_directory(opts.tmpdir);
+	UniqueBlocks source_blocks(tmpdir, opts.sort_memory);
+	UniqueBlocks target_blocks(tmpdir, opts.sort_memory);
+
+	match(source, target, source_blocks, target_blocks);
+
+	std::vector<struct compressed_block> source_list;
+	std::vector<struct compressed_block> target_list;
+
+	source_list.reserve(source_blocks.size());
+	source_blocks.for_each([&](const struct compressed_block& block) {
+			source_list.push_back(block);
+		});
+	target_list.reserve(target_blocks.size());
+	target_blocks.for_each([&](const struct compressed_block& block) {
+			target_list.push_back(block);
+		});
+
+	message("Attributing the unique blocks...");
+
+	std::unique_ptr<ImageAttribution> source_report;
+	std::unique_ptr<ImageAttribution> target_report;
+
+	try
+	{
+		TaskGroup tasks(pool, allocator);
+
+		tasks.submit([&]() {
+				std::unique_ptr<Compressor> c(source.c->clone());
+				MMAPFile f(*source.f);
+
+				source_report.reset(new ImageAttribution(f, *c,
+							source_list));
+			});
+		tasks.submit([&]() {
+				std::unique_ptr<Compressor> c(target.c->clone());
+				MMAPFile f(*target.f);
+
+				target_report.reset(new ImageAttribution(f, *c,
+							target_list));
+			});
+		tasks.wait();
+	}
+	catch (...)
+	{
+		rethrow_delta_error("report");
+	}
+
+	if (json_path)
+	{
+		std::ofstream out(json_path);
+
+		out << "{\n\t\"source\": ";
+		source_report->write_json(out);
+		out << ",\n\t\"target\": ";
+		target_report->write_json(out);
+		out << "\n}\n";
+		out.close();
+
+		if (!out)
+			throw DeltaError(SQDELTA_ERR_IO, "Unable to write the report",
+					std::string("file: ") + json_path, errno);
+	}
+
+	if (table)
+	{
+		*table << "Source:\n";
+		source_report->write_table(*table, top);
+		*table << "\nTarget:\n";
+		target_report->write_table(*table, top);
+	}
+}
+
+void DeltaSession::make_report(const DeltaImage& source,
+		const DeltaImage& target, const char* json_path,
+		std::ostream* table, size_t top) const
+{
+	AllocatorScope alloc_scope(allocator);
+
+	try
+	{
+		write_report(source, target, json_path, table, top);
+	}
+	catch (...)
+	{
+		rethrow_delta_error("");
+	}
+}
+
+// C API
+
+struct sqdelta_session
+{
+	DeltaSession session;
+	std::string error;
+	int errno_val;
+
+	sqdelta_session(const struct sqdelta_options* opts)
+		: session(opts), errno_val(0)
+	{
+	}
+};
+
+struct sqdelta_image
+{
+	DeltaImage* image;
+};
+
+// call func, storing the error in the session
+template <class F>
+static int guarded(sqdelta_session* s, F func)
+{
+	try
+	{
+		try
+		{
+			func();
+		}
+		catch (...)
+		{
+			rethrow_delta_error("");
+		}
+	}
+	catch (DeltaError& e)
+	{
+		s->error = e.what();
+		if (!e.context.empty())
+			s->error += std::string(" (at ") + e.context + ")";
+		s->errno_val = e.errno_val;
+		return e.code;
+	}
+
+	s->error.clear();
+	s->errno_val = 0;
+	return SQDELTA_OK;
+}
+
+extern "C" void sqdelta_options_init(struct sqdelta_options* opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->struct_size = sizeof(*opts);
+	opts->readahead = MMAPFile::default_readahead;
+	opts->io_engine = SQDELTA_IO_DEFAULT;
+	opts->encoder.level = -1;
+}
+
+extern "C" int sqdelta_session_new(sqdelta_session** session,
+		const struct sqdelta_options* opts)
+{
+	try
+	{
+		*session = new sqdelta_session(opts);
+	}
+	catch (DeltaError& e)
+	{
+		return e.code;
+	}
+	catch (std::bad_alloc& e)
+	{
+		return SQDELTA_ERR_NOMEM;
+	}
+
+	return SQDELTA_OK;
+}
+
+extern "C" void sqdelta_session_free(sqdelta_session* session)
+{
+	delete session;
+}
+
+extern "C" void sqdelta_session_set_callbacks(sqdelta_session* session,
+		const struct sqdelta_callbacks* callbacks)
+{
+	session->session.set_callbacks(callbacks);
+}
+
+extern "C" void sqdelta_session_set_thread_pool(sqdelta_session* session,
+		const struct sqdelta_thread_pool* pool)
+{
+	session->session.set_thread_pool(pool);
+}
+
+extern "C" void sqdelta_session_set_allocator(sqdelta_session* session,
+		const struct sqdelta_allocator* allocator)
+{
+	session->session.set_allocator(allocator);
+}
+
+extern "C" const char* sqdelta_session_error(const sqdelta_session* session)
+{
+	return session->error.c_str();
+}
+
+extern "C" int sqdelta_session_errno(const sqdelta_session* session)
+{
+	return session->errno_val;
+}
+
+extern "C" int sqdelta_image_open(sqdelta_session* session, const char* path,
+		sqdelta_image** image)
+{
+	if (!path || !image)
+		return SQDELTA_ERR_INVALID;
+
+	return guarded(session, [&]() {
+			*image = new sqdelta_image;
+			try
+			{
+				(*image)->image = session->session.open_image(path);
+			}
+			catch (...)
+			{
+				delete *image;
+				*image = 0;
+				throw;
+			}
+		});
+}
+
+extern "C" int sqdelta_image_open_pair(sqdelta_session* session,
+		const char* source_path, const char* target_path,
+		sqdelta_image** source, sqdelta_image** target)
+{
+	if (!source_path || !target_path || !source || !target)
+		return SQDELTA_ERR_INVALID;
+
+	return guarded(session, [&]() {
+			sqdelta_image* s = new sqdelta_image;
+			sqdelta_image* t = 0;
+
+			try
+			{
+				t = new sqdelta_image;
+				session->session.open_images(source_path, target_path,
+						s->image, t->image);
+			}
+			catch (...)
+			{
+				delete s;
+				delete t;
+				throw;
+			}
+
+			*source = s;
+			*target = t;
+		});
+}
+
+extern "C" void sqdelta_image_free(sqdelta_image* image)
+{
+	if (image)
+		delete image->image;
+	delete image;
+}
+
+extern "C" uint64_t sqdelta_image_block_count(const sqdelta_image* image)
+{
+	return image->image->block_count();
+}
+
+extern "C" uint64_t sqdelta_image_memory_size(const sqdelta_image* image)
+{
+	return image->image->memory_size();
+}
+
+extern "C" int sqdelta_make_patch(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		const char* patch_path)
+{
+	if (!source || !target || !patch_path)
+		return SQDELTA_ERR_INVALID;
+
+	return guarded(session, [&]() {
+			session->session.make_patch(*source->image, *target->image,
+					patch_path);
+		});
+}
+
+extern "C" int sqdelta_make_patch_fd(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		int patch_fd)
+{
+	if (!source || !target || patch_fd < 0)
+		return SQDELTA_ERR_INVALID;
+
+	return guarded(session, [&]() {
+			session->session.make_patch(*source->image, *target->image,
+					patch_fd);
+		});
+}
+
+extern "C" int sqdelta_estimate_patch(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		double fraction, struct sqdelta_estimate* estimate)
+{
+	if (!source || !target || !estimate)
+		return SQDELTA_ERR_INVALID;
+
+	return guarded(session, [&]() {
+			session->session.make_estimate(*source->image, *target->image,
+					fraction, *estimate);
+		});
+}
+
+extern "C" int sqdelta_write_report(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		const char* json_path)
+{
+	if (!source || !target || !json_path)
+		return SQDELTA_ERR_INVALID;
+
+	return guarded(session, [&]() {
+			session->session.make_report(*source->image, *target->image,
+					json_path);
+		});
+}
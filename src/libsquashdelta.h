@@ -0,0 +1,240 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef LIBSQUASHDELTA_H
+#define LIBSQUASHDELTA_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * SquashFS delta library, C API.
+ *
+ * A session holds the settings, the callbacks and the last error.
+ * Images are analysed once and can be used for any number of patches,
+ * including concurrent ones, so a long-lived process can keep its base
+ * images hot.
+ *
+ * All the functions returning int return SQDELTA_OK or one of the error
+ * codes, and sqdelta_session_error() describes the error then.
+ */
+
+enum sqdelta_error
+{
+	SQDELTA_OK = 0,
+	/* invalid arguments, or images that can not be paired */
+	SQDELTA_ERR_INVALID,
+	/* I/O failure, sqdelta_session_errno() holds the errno value */
+	SQDELTA_ERR_IO,
+	SQDELTA_ERR_NOMEM,
+	/* xdelta3 failed to run or to create the patch */
+	SQDELTA_ERR_DELTA,
+	/* other errors, e.g. a corrupted or unsupported image */
+	SQDELTA_ERR_FAILED
+};
+
+enum sqdelta_stage
+{
+	/* reading and hashing the blocks of an image */
+	SQDELTA_STAGE_ANALYSE,
+	/* decompressing the unique blocks of source and target */
+	SQDELTA_STAGE_EXPAND_SOURCE,
+	SQDELTA_STAGE_EXPAND_TARGET
+};
+
+enum sqdelta_io_engine
+{
+	SQDELTA_IO_DEFAULT = 0,
+	SQDELTA_IO_MMAP,
+	SQDELTA_IO_URING
+};
+
+/* xdelta3 settings; the unset ones are picked from the image pair */
+struct sqdelta_encoder
+{
+	/* 0 to 9, -1 is unset */
+	int level;
+	/* -B and -W, 0 is unset */
+	size_t source_window;
+	size_t input_window;
+	/* "none", "fgk", "djw" or "lzma", NULL is unset */
+	const char* secondary;
+	/* seconds the encoding should take at most, 0 for no limit;
+	 * picks a lower level if needed */
+	double time_budget;
+};
+
+struct sqdelta_options
+{
+	/* sizeof(struct sqdelta_options), set by sqdelta_options_init();
+	 * sessions are refused options of a different size, e.g. from
+	 * an older header */
+	size_t struct_size;
+	/* prefault the images, hint transparent huge pages */
+	int populate;
+	int huge_pages;
+	/* read-ahead for sequential passes, 0 disables */
+	size_t readahead;
+	/* map the images in windows of given size, 0 maps them whole */
+	size_t window;
+	/* preallocate the temporary files */
+	int preallocate;
+	/* directory for temporary files, NULL uses $TMPDIR */
+	const char* tmpdir;
+	enum sqdelta_io_engine io_engine;
+	/* bytes the mappings of the images may take, 0 for no limit;
+	 * the heap (block tables, sort buffers, sketches) is not counted,
+	 * it is bounded by sort_memory instead */
+	size_t memory_limit;
+	/* keep the block tables in sorted run files in tmpdir, using about
+	 * this much memory per image for sorting; 0 keeps them in memory.
+	 * All the images of a patch need to use the same mode. */
+	size_t sort_memory;
+	/* expand the unique source blocks in the order of the most similar
+	 * target blocks, for in-memory block tables; the patches need
+	 * an applier supporting the block order */
+	int pair_similar;
+	/* store a BLAKE3 digest of the target image in the patch, with
+	 * the digests of its 1 MiB pieces; needs an applier supporting it */
+	int target_digest;
+	/* expand the blocks repeated within an image only once, storing
+	 * back-references for the other copies, for in-memory block tables;
+	 * needs an applier supporting it */
+	int dedupe;
+	/* store the start blocks in the expanded inode and fragment tables
+	 * relative to the previous file or fragment, so that they do not
+	 * change when the data before them grows; needs an applier
+	 * supporting it */
+	int normalise_metadata;
+	struct sqdelta_encoder encoder;
+	/* seconds from the creation of the session a patch needs to be
+	 * written in, 0 for none. The expansion and encoding times are
+	 * projected from the measured throughput, and the encoder level
+	 * stepped down, the similarity pairing skipped, or the whole images
+	 * delta-encoded without expanding them to keep to it. */
+	double deadline;
+	/* keep the block tables, the unique blocks and the expanded source
+	 * of the patches in this directory, so that an interrupted run
+	 * resumes from them; needs in-memory block tables. The images are
+	 * hashed to name them, and the files are verified before use. */
+	const char* work_dir;
+	/* delta-encode the changed data blocks of each file found in both
+	 * images against its previous version, as independent jobs on
+	 * the thread pool, leaving the rest to the image delta; needs
+	 * in-memory block tables and an applier supporting it */
+	int per_file;
+};
+
+/* callbacks may be called from pool threads, concurrently */
+struct sqdelta_callbacks
+{
+	void* user;
+	/* human-readable progress, one line per call, without newline */
+	void (*message)(void* user, const char* text);
+	/* done out of total blocks of the stage, may be NULL */
+	void (*progress)(void* user, enum sqdelta_stage stage,
+			uint64_t done, uint64_t total);
+};
+
+struct sqdelta_thread_pool
+{
+	void* user;
+	/* run task(arg) on a pool thread, return 0 if it was queued;
+	 * the library waits for its tasks itself */
+	int (*submit)(void* user, void (*task)(void* arg), void* arg);
+};
+
+/* used for the large I/O and decompression buffers */
+struct sqdelta_allocator
+{
+	void* user;
+	/* return NULL on failure */
+	void* (*alloc)(void* user, size_t size, size_t alignment);
+	void (*free)(void* user, void* ptr, size_t size);
+};
+
+/* result of sqdelta_estimate_patch() */
+struct sqdelta_estimate
+{
+	/* unique blocks found by the matching */
+	uint64_t source_unique;
+	uint64_t target_unique;
+	/* unique target blocks run through xdelta3 */
+	uint64_t sampled;
+	/* expected patch size, with a 95% confidence interval */
+	uint64_t patch_size;
+	uint64_t patch_size_low;
+	uint64_t patch_size_high;
+	/* size of the target image, for comparison */
+	uint64_t target_size;
+};
+
+typedef struct sqdelta_session sqdelta_session;
+typedef struct sqdelta_image sqdelta_image;
+
+void sqdelta_options_init(struct sqdelta_options* opts);
+
+/* opts may be NULL for the defaults; returns SQDELTA_ERR_INVALID
+ * for options not set up by sqdelta_options_init() of this version */
+int sqdelta_session_new(sqdelta_session** session,
+		const struct sqdelta_options* opts);
+void sqdelta_session_free(sqdelta_session* session);
+
+/* the structures are copied, NULL restores the defaults */
+void sqdelta_session_set_callbacks(sqdelta_session* session,
+		const struct sqdelta_callbacks* callbacks);
+void sqdelta_session_set_thread_pool(sqdelta_session* session,
+		const struct sqdelta_thread_pool* pool);
+void sqdelta_session_set_allocator(sqdelta_session* session,
+		const struct sqdelta_allocator* allocator);
+
+const char* sqdelta_session_error(const sqdelta_session* session);
+int sqdelta_session_errno(const sqdelta_session* session);
+
+/* the path may name a pipe, e.g. /dev/stdin; it is read once then,
+ * into a temporary file */
+int sqdelta_image_open(sqdelta_session* session, const char* path,
+		sqdelta_image** image);
+/* analyse both images, in parallel if a thread pool is set */
+int sqdelta_image_open_pair(sqdelta_session* session,
+		const char* source_path, const char* target_path,
+		sqdelta_image** source, sqdelta_image** target);
+void sqdelta_image_free(sqdelta_image* image);
+
+uint64_t sqdelta_image_block_count(const sqdelta_image* image);
+/* memory held by the image: its in-memory block table and mapping */
+uint64_t sqdelta_image_memory_size(const sqdelta_image* image);
+
+int sqdelta_make_patch(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		const char* patch_path);
+/* write the patch to an open descriptor instead, which is left open;
+ * it is written sequentially, so it may be a pipe or a socket */
+int sqdelta_make_patch_fd(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		int patch_fd);
+/* estimate the patch size without writing it: only the given fraction
+ * (0 < fraction <= 1) of the unique target blocks is delta-encoded,
+ * against the unique source blocks at the same relative position */
+int sqdelta_estimate_patch(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		double fraction, struct sqdelta_estimate* estimate);
+/* write a JSON report attributing the unique bytes of both images
+ * to their files and to the block categories */
+int sqdelta_write_report(sqdelta_session* session,
+		const sqdelta_image* source, const sqdelta_image* target,
+		const char* json_path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*!LIBSQUASHDELTA_H*/
@@ -0,0 +1,163 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_LIBSQUASHDELTA_HXX
+#define SDT_LIBSQUASHDELTA_HXX 1
+
+#include <chrono>
+#include <functional>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "libsquashdelta.h"
+
+/**
+ * SquashFS delta library, C++ API.
+ *
+ * Same model as the C API, but the errors are thrown as DeltaError.
+ */
+
+class BlockRunFile;
+class CheckpointDir;
+class Compressor;
+class MMAPFile;
+class SparseFileWriter;
+class UniqueBlocks;
+struct encoder_profile;
+struct compressed_block;
+struct file_delta;
+struct io_settings;
+
+class DeltaError : public std::runtime_error
+{
+public:
+	enum sqdelta_error code;
+	// what the error happened at, e.g. "file: foo.sqfs"
+	std::string context;
+	int errno_val;
+
+	DeltaError(enum sqdelta_error new_code, const std::string& text,
+			const std::string& new_context = std::string(),
+			int new_errno = 0);
+};
+
+class DeltaSession;
+
+// an analysed image
+class DeltaImage
+{
+	MMAPFile* f;
+	Compressor* c;
+	// one of those, depending on sort_memory
+	std::list<struct compressed_block>* blocks;
+	BlockRunFile* table;
+	size_t block_size;
+	// digest of the image, naming its stages in the work directory
+	std::string key;
+
+	friend class DeltaSession;
+
+	DeltaImage();
+
+public:
+	~DeltaImage();
+
+	size_t block_count() const;
+	// in-memory block table and mapping
+	size_t memory_size() const;
+};
+
+class DeltaSession
+{
+	struct sqdelta_options opts;
+	struct sqdelta_callbacks callbacks;
+	struct sqdelta_thread_pool pool;
+	struct sqdelta_allocator allocator;
+	// the deadline is counted from here
+	std::chrono::steady_clock::time_point created;
+	// shared by the copies of the session
+	std::shared_ptr<CheckpointDir> checkpoints;
+	// the engine and the memory budget of the images, likewise
+	std::shared_ptr<struct io_settings> io;
+
+	// seconds left until the deadline, infinity if there is none
+	double time_left() const;
+	void analyse(DeltaImage& image, const char* path) const;
+	// BLAKE3 of the file in hex, hashed on the thread pool
+	std::string file_digest(const MMAPFile& f) const;
+	// open the stage file in f, if it is complete and still matches
+	// the manifest
+	bool load_checkpoint(const std::string& name, MMAPFile& f) const;
+	// record the stage file written to the partial path
+	void save_checkpoint(const std::string& name,
+			const std::string& partial) const;
+	// find the blocks unique to each image, leaving them in offset order
+	void match(const DeltaImage& source, const DeltaImage& target,
+			UniqueBlocks& source_blocks, UniqueBlocks& target_blocks) const;
+	// fit the patch into the deadline, dropping the unique blocks
+	// or disabling pair_similar if the projected time is too long;
+	// returns true if the blocks were dropped
+	bool plan_deadline(const DeltaImage& source, const DeltaImage& target,
+			UniqueBlocks& source_blocks, UniqueBlocks& target_blocks,
+			bool& pair_similar) const;
+	// move the unique target blocks of the files found in both images
+	// to per-file deltas, flagging them in the target list
+	void split_files(const DeltaImage& source, const DeltaImage& target,
+			UniqueBlocks& source_blocks, UniqueBlocks& target_blocks,
+			std::list<struct file_delta>& files) const;
+	// the patch is written sequentially, so patch_out may be a pipe
+	void write_patch(const DeltaImage& source, const DeltaImage& target,
+			SparseFileWriter& patch_out) const;
+	// the unique blocks expand by about expansion
+	struct encoder_profile pick_profile(const DeltaImage& source,
+			const DeltaImage& target, uint64_t source_unique,
+			uint64_t target_unique, double expansion) const;
+	struct encoder_profile pick_profile(uint64_t expanded_source,
+			uint64_t expanded_target, double unique_ratio) const;
+	void estimate_patch(const DeltaImage& source, const DeltaImage& target,
+			double fraction, struct sqdelta_estimate& estimate) const;
+	void write_report(const DeltaImage& source, const DeltaImage& target,
+			const char* json_path, std::ostream* table, size_t top) const;
+
+public:
+	DeltaSession(const struct sqdelta_options* new_opts = 0);
+
+	void set_callbacks(const struct sqdelta_callbacks* new_callbacks);
+	void set_thread_pool(const struct sqdelta_thread_pool* new_pool);
+	void set_allocator(const struct sqdelta_allocator* new_allocator);
+
+	DeltaImage* open_image(const char* path) const;
+	void open_images(const char* source_path, const char* target_path,
+			DeltaImage*& source, DeltaImage*& target) const;
+
+	void make_patch(const DeltaImage& source, const DeltaImage& target,
+			const char* patch_path) const;
+	// write the patch to an open descriptor, e.g. a pipe or a socket;
+	// the descriptor is not closed
+	void make_patch(const DeltaImage& source, const DeltaImage& target,
+			int patch_fd) const;
+	// delta-encode a sample of the unique target blocks only
+	void make_estimate(const DeltaImage& source, const DeltaImage& target,
+			double fraction, struct sqdelta_estimate& estimate) const;
+	// attribute the unique blocks to files and block categories,
+	// writing JSON to json_path and the top files to table if not NULL
+	void make_report(const DeltaImage& source, const DeltaImage& target,
+			const char* json_path, std::ostream* table = 0,
+			size_t top = 20) const;
+
+	// progress reporting, used by the delta steps
+	void message(const std::string& text) const;
+	void progress(enum sqdelta_stage stage,
+			uint64_t done, uint64_t total) const;
+	// run func on the thread pool without waiting for it, the errors
+	// are dropped; return false if there is no pool or it refused
+	bool submit(std::function<void()> func) const;
+};
+
+#endif /*!SDT_LIBSQUASHDELTA_HXX*/
@@ -0,0 +1,317 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "normalise.hxx"
+#include "squashfs.hxx"
+#include "trace.hxx"
+
+namespace
+{
+	// a metadata block of a table, and where its contents are
+	// in the uncompressed table
+	struct table_block
+	{
+		size_t offset;
+		uint64_t start;
+		size_t length;
+		// the unique block, normalised, if any
+		std::vector<char>* data;
+		bool changed;
+	};
+
+	class Table
+	{
+		std::vector<struct table_block> blocks;
+		block_replacements& out;
+
+		struct table_block& block_at(uint64_t pos);
+
+	public:
+		Table(block_replacements& new_out)
+			: out(new_out)
+		{
+		}
+
+		// read the count blocks at offset, or up to end
+		void read(MMAPFile& f, Compressor& c, size_t offset,
+				size_t count, size_t end,
+				const std::unordered_set<size_t>& unique_offsets);
+		// get the little-endian field at given table position,
+		// if it lies wholly within the unique blocks
+		bool field(uint64_t pos, size_t width, uint64_t& value);
+		// rewrite it, likewise
+		bool rewrite(uint64_t pos, size_t width, uint64_t value);
+		// move the changed blocks to out
+		void finish();
+	};
+}
+
+void Table::read(MMAPFile& f, Compressor& c, size_t offset, size_t count,
+		size_t end, const std::unordered_set<size_t>& unique_offsets)
+{
+	MetadataBlockReader mbr(f, offset, c);
+	std::vector<char> buf(squashfs::metadata_size);
+	uint64_t start = 0;
+
+	for (size_t i = 0; i < count && offset < end; ++i)
+	{
+		struct table_block b;
+		const void* data;
+		size_t length;
+		bool compressed;
+
+		mbr.read_input_block(&data, &b.offset, &length, &compressed);
+		offset = b.offset + length;
+
+		b.start = start;
+		b.length = compressed ? c.decompress(&buf[0], data, length,
+					buf.size()) : length;
+		b.data = 0;
+		b.changed = false;
+		start += b.length;
+
+		// only the compressed blocks are expanded
+		if (compressed && unique_offsets.count(b.offset))
+		{
+			std::pair<block_replacements::iterator, bool> r = out.insert(
+					std::make_pair(b.offset, std::vector<char>()));
+
+			// the blocks given are taken as they are
+			if (r.second)
+				r.first->second.assign(buf.begin(), buf.begin() + b.length);
+			else if (r.first->second.size() != b.length)
+				throw std::runtime_error("Metadata block length mismatch");
+			b.data = &r.first->second;
+		}
+
+		blocks.push_back(b);
+	}
+}
+
+struct table_block& Table::block_at(uint64_t pos)
+{
+	struct table_block key;
+	key.start = pos;
+
+	std::vector<struct table_block>::iterator i = std::upper_bound(
+			blocks.begin(), blocks.end(), key,
+			[](const struct table_block& lhs, const struct table_block& rhs) {
+				return lhs.start < rhs.start;
+			});
+
+	if (i == blocks.begin() || pos >= (i - 1)->start + (i - 1)->length)
+		throw std::runtime_error("Metadata field outside the table");
+	return *(i - 1);
+}
+
+bool Table::field(uint64_t pos, size_t width, uint64_t& value)
+{
+	value = 0;
+	for (size_t i = 0; i < width; ++i)
+	{
+		struct table_block& b = block_at(pos + i);
+
+		if (!b.data)
+			return false;
+		value |= uint64_t(static_cast<unsigned char>(
+					(*b.data)[pos + i - b.start])) << (i * 8);
+	}
+
+	return true;
+}
+
+bool Table::rewrite(uint64_t pos, size_t width, uint64_t value)
+{
+	for (size_t i = 0; i < width; ++i)
+	{
+		if (!block_at(pos + i).data)
+			return false;
+	}
+
+	for (size_t i = 0; i < width; ++i)
+	{
+		struct table_block& b = block_at(pos + i);
+		char& byte = (*b.data)[pos + i - b.start];
+		char new_byte = value >> (i * 8);
+
+		if (byte != new_byte)
+		{
+			byte = new_byte;
+			b.changed = true;
+		}
+	}
+
+	return true;
+}
+
+void Table::finish()
+{
+	for (std::vector<struct table_block>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+	{
+		if (i->data && !i->changed)
+			out.erase(i->offset);
+	}
+}
+
+// sum of the on-disk sizes of the blocks
+static uint64_t blocks_length(const le32* block_list, uint32_t count)
+{
+	uint64_t ret = 0;
+
+	for (uint32_t i = 0; i < count; ++i)
+		ret += block_list[i] & ~squashfs::block_size::uncompressed;
+	return ret;
+}
+
+// the value of a field of given width (in bytes), modulo its width
+static uint64_t field_value(uint64_t value, size_t width)
+{
+	if (width < sizeof(uint64_t))
+		value &= (uint64_t(1) << (width * 8)) - 1;
+	return value;
+}
+
+// walk the start_block fields of the inode and fragment tables
+// in order; convert(table, pos, width, prev_end, start) gets the value
+// found in the image in start, and leaves the original one there;
+// returns the number of fields it converted
+template <class F>
+static size_t walk_tables(MMAPFile& f, Compressor& c,
+		const std::unordered_set<size_t>& unique_offsets,
+		block_replacements& out, F convert)
+{
+	MMAPFile sbf(f);
+	sbf.seek(0, std::ios::beg);
+	const squashfs::super_block sb = sbf.read<squashfs::super_block>();
+	size_t fields = 0;
+
+	// inode table
+	{
+		Table table(out);
+		table.read(f, c, sb.inode_table_start, static_cast<size_t>(-1),
+				sb.directory_table_start, unique_offsets);
+
+		InodeReader ir(f, sb, c);
+		uint64_t prev_end = 0;
+
+		for (uint32_t i = 0; i < sb.inodes; ++i)
+		{
+			uint64_t pos = ir.tell();
+			union squashfs::inode::inode& in = ir.read();
+			const char* base = reinterpret_cast<const char*>(&in);
+			uint64_t start;
+			uint32_t count;
+			const le32* block_list;
+			size_t field;
+			size_t width;
+
+			switch (in.as_base.inode_type)
+			{
+				case squashfs::inode::type::reg:
+					start = in.as_reg.start_block;
+					count = in.as_reg.block_count(sb.block_size, sb.block_log);
+					block_list = in.as_reg.block_list();
+					field = reinterpret_cast<const char*>(
+							&in.as_reg.start_block) - base;
+					width = sizeof(le32);
+					break;
+				case squashfs::inode::type::lreg:
+					start = in.as_lreg.start_block;
+					count = in.as_lreg.block_count(sb.block_size,
+							sb.block_log);
+					block_list = in.as_lreg.block_list();
+					field = reinterpret_cast<const char*>(
+							&in.as_lreg.start_block) - base;
+					width = sizeof(le64);
+					break;
+				default:
+					continue;
+			}
+
+			// fragment-only files have no meaningful start
+			if (count == 0)
+				continue;
+
+			if (convert(table, pos + field, width, prev_end, start))
+				++fields;
+			prev_end = start + blocks_length(block_list, count);
+		}
+
+		table.finish();
+	}
+
+	// fragment table
+	if (sb.fragments > 0)
+	{
+		size_t table_blocks = (sb.fragments * sizeof(squashfs::fragment_entry)
+				+ squashfs::metadata_size - 1) / squashfs::metadata_size;
+		Table table(out);
+		FragmentTableReader fr(f, sb, c);
+
+		table.read(f, c, fr.start_offset, table_blocks, f.getlen(),
+				unique_offsets);
+
+		uint64_t prev_end = 0;
+
+		for (uint32_t i = 0; i < sb.fragments; ++i)
+		{
+			const struct squashfs::fragment_entry& fe = fr.read();
+			uint64_t start = fe.start_block;
+
+			if (convert(table, uint64_t(i) * sizeof(fe), sizeof(le64),
+						prev_end, start))
+				++fields;
+			prev_end = start + (fe.size & ~squashfs::block_size::uncompressed);
+		}
+
+		table.finish();
+	}
+
+	return fields;
+}
+
+size_t normalise_metadata(MMAPFile& f, Compressor& c,
+		const std::unordered_set<size_t>& unique_offsets,
+		block_replacements& out)
+{
+	TraceSpan span("normalise_metadata");
+
+	return walk_tables(f, c, unique_offsets, out,
+			[](Table& table, uint64_t pos, size_t width, uint64_t prev_end,
+					uint64_t& start) {
+				// the difference wraps around in a 32-bit field
+				return table.rewrite(pos, width, start - prev_end);
+			});
+}
+
+size_t denormalise_metadata(MMAPFile& f, Compressor& c,
+		const std::unordered_set<size_t>& unique_offsets,
+		block_replacements& blocks)
+{
+	TraceSpan span("denormalise_metadata");
+
+	return walk_tables(f, c, unique_offsets, blocks,
+			[](Table& table, uint64_t pos, size_t width, uint64_t prev_end,
+					uint64_t& start) {
+				uint64_t diff;
+
+				if (!table.field(pos, width, diff))
+					return false;
+
+				// exact, the original value fits the field
+				start = field_value(diff + prev_end, width);
+				return table.rewrite(pos, width, start);
+			});
+}
@@ -0,0 +1,57 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_NORMALISE_HXX
+#define SDT_NORMALISE_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cstdlib> // size_t
+
+#include "compressor.hxx"
+#include "util.hxx"
+
+/**
+ * Position-independent form of the inode and fragment tables.
+ *
+ * The start_block of each regular file with data blocks is replaced
+ * by its difference from the end of the previous such file, and the
+ * start_block of each fragment by its difference from the end of the
+ * previous fragment. These are usually zero, so the tables do not
+ * change when a file before them grows.
+ *
+ * Only the fields lying wholly within the expanded (unique) metadata
+ * blocks are rewritten. The predictions use the original values of all
+ * the files, so an applier can undo the transform walking the tables
+ * in order, restoring each field before predicting the next one. The
+ * differences are stored modulo the field width, which is exact since
+ * the original values fit their fields.
+ */
+
+// the decompressed contents of the metadata blocks to use instead,
+// by the offset of their compressed data
+typedef std::unordered_map<size_t, std::vector<char> > block_replacements;
+
+// fill out (empty) with the normalised unique blocks (given by their
+// offsets) that differ from the original ones; returns the fields
+// rewritten
+size_t normalise_metadata(MMAPFile& f, Compressor& c,
+		const std::unordered_set<size_t>& unique_offsets,
+		block_replacements& out);
+// the inverse, restoring the normalised unique blocks in place; only
+// the layout of the tables and the fields outside the unique blocks
+// are read from the image, the same in both forms
+size_t denormalise_metadata(MMAPFile& f, Compressor& c,
+		const std::unordered_set<size_t>& unique_offsets,
+		block_replacements& blocks);
+
+#endif /*!SDT_NORMALISE_HXX*/
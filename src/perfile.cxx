@@ -0,0 +1,97 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <utility>
+
+#include "perfile.hxx"
+#include "squashfs.hxx"
+#include "trace.hxx"
+
+void group_file_blocks(MMAPFile& f, Compressor& c,
+		const std::vector<size_t>& offsets, file_blocks& out)
+{
+	TraceSpan span("group_file_blocks");
+
+	MMAPFile sbf(f);
+	sbf.seek(0, std::ios::beg);
+	const squashfs::super_block sb = sbf.read<squashfs::super_block>();
+
+	InodePaths paths;
+	// (inode number, block indexes) of the files
+	std::vector<std::pair<uint32_t, std::vector<size_t> > > files;
+	InodeReader ir(f, sb, c);
+
+	for (uint32_t i = 0; i < sb.inodes; ++i)
+	{
+		union squashfs::inode::inode& in = ir.read();
+		uint64_t start_block;
+		uint32_t block_count;
+		const le32* block_list;
+
+		switch (in.as_base.inode_type)
+		{
+			case squashfs::inode::type::reg:
+				start_block = in.as_reg.start_block;
+				block_count = in.as_reg.block_count(sb.block_size,
+						sb.block_log);
+				block_list = in.as_reg.block_list();
+				break;
+			case squashfs::inode::type::lreg:
+				start_block = in.as_lreg.start_block;
+				block_count = in.as_lreg.block_count(sb.block_size,
+						sb.block_log);
+				block_list = in.as_lreg.block_list();
+				break;
+			case squashfs::inode::type::dir:
+				paths.add_directory(f, sb, c, in.as_base.inode_number,
+						in.as_dir.start_block, in.as_dir.offset,
+						in.as_dir.file_size);
+				continue;
+			case squashfs::inode::type::ldir:
+				paths.add_directory(f, sb, c, in.as_base.inode_number,
+						in.as_ldir.start_block, in.as_ldir.offset,
+						in.as_ldir.file_size);
+				continue;
+			default:
+				continue;
+		}
+
+		std::vector<size_t> indexes;
+		uint64_t pos = start_block;
+
+		for (uint32_t j = 0; j < block_count; ++j)
+		{
+			uint32_t v = block_list[j];
+
+			// sparse blocks have no data
+			if (v != 0)
+			{
+				std::vector<size_t>::const_iterator k = std::lower_bound(
+						offsets.begin(), offsets.end(), pos);
+				if (k != offsets.end() && *k == pos)
+					indexes.push_back(k - offsets.begin());
+			}
+
+			pos += v & ~squashfs::block_size::uncompressed;
+		}
+
+		if (!indexes.empty())
+		{
+			files.push_back(std::make_pair(in.as_base.inode_number,
+						std::vector<size_t>()));
+			files.back().second.swap(indexes);
+		}
+	}
+
+	for (std::vector<std::pair<uint32_t, std::vector<size_t> > >::iterator
+			i = files.begin(); i != files.end(); ++i)
+		out[paths.path(i->first)].swap(i->second);
+}
@@ -0,0 +1,39 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_PERFILE_HXX
+#define SDT_PERFILE_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdlib> // size_t
+
+#include "compressor.hxx"
+#include "util.hxx"
+
+/**
+ * Grouping of the unique data blocks by the regular files owning them,
+ * so that each changed file can be delta-encoded against its previous
+ * version on its own.
+ *
+ * The fragments are shared by many files, so they are not grouped.
+ */
+
+// indexes of the blocks of each file, in the file order, by its path
+typedef std::unordered_map<std::string, std::vector<size_t> > file_blocks;
+
+// offsets are the offsets of the unique blocks, sorted; the files
+// owning none of them are left out
+void group_file_blocks(MMAPFile& f, Compressor& c,
+		const std::vector<size_t>& offsets, file_blocks& out);
+
+#endif /*!SDT_PERFILE_HXX*/
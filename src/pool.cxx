@@ -0,0 +1,86 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include "pool.hxx"
+
+ThreadPool::ThreadPool(unsigned threads)
+	: stopping(false)
+{
+	if (!threads)
+		threads = std::thread::hardware_concurrency();
+	if (!threads)
+		threads = 1;
+
+	for (unsigned i = 0; i < threads; ++i)
+		workers.push_back(std::thread(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	queued.notify_all();
+
+	for (std::vector<std::thread>::iterator i = workers.begin();
+			i != workers.end(); ++i)
+		(*i).join();
+}
+
+void ThreadPool::worker()
+{
+	while (true)
+	{
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (tasks.empty() && !stopping)
+				queued.wait(guard);
+			if (tasks.empty())
+				return;
+
+			task = tasks.front();
+			tasks.pop_front();
+		}
+
+		task();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		tasks.push_back(task);
+	}
+	queued.notify_one();
+}
+
+unsigned ThreadPool::size() const
+{
+	return workers.size();
+}
+
+int ThreadPool::submit_task(void* user, void (*task)(void* arg), void* arg)
+{
+	static_cast<ThreadPool*>(user)->submit([task, arg]() { task(arg); });
+	return 0;
+}
+
+struct sqdelta_thread_pool ThreadPool::c_pool()
+{
+	struct sqdelta_thread_pool ret;
+
+	ret.user = this;
+	ret.submit = submit_task;
+	return ret;
+}
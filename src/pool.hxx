@@ -0,0 +1,47 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_POOL_HXX
+#define SDT_POOL_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "libsquashdelta.h"
+
+// fixed-size worker pool, usable as the library thread pool
+class ThreadPool
+{
+	std::mutex lock;
+	std::condition_variable queued;
+	std::deque<std::function<void()> > tasks;
+	std::vector<std::thread> workers;
+	bool stopping;
+
+	void worker();
+	static int submit_task(void* user, void (*task)(void* arg), void* arg);
+
+public:
+	// 0 uses the number of CPUs
+	ThreadPool(unsigned threads = 0);
+	// finishes the queued tasks first
+	~ThreadPool();
+
+	void submit(std::function<void()> task);
+	unsigned size() const;
+
+	struct sqdelta_thread_pool c_pool();
+};
+
+#endif /*!SDT_POOL_HXX*/
@@ -0,0 +1,166 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <cstring>
+
+#include "profile.hxx"
+
+const double encoder_throughput[10] = {
+	300, 220, 190, 160, 120, 100, 80, 60, 45, 35
+};
+
+// xdelta3 defaults, and its limits
+static const size_t default_source_window = 64 * 1024 * 1024;
+static const size_t max_source_window = 2048UL * 1024 * 1024;
+static const size_t min_source_window = 16 * 1024 * 1024;
+static const size_t default_input_window = 8 * 1024 * 1024;
+static const size_t max_input_window = 16 * 1024 * 1024;
+
+// targets this large get the largest input window
+static const uint64_t large_target = 1024ULL * 1024 * 1024;
+
+static const char* const secondary_names[] = {
+	"none", "fgk", "djw", "lzma"
+};
+
+static size_t round_up_pow2(uint64_t v, size_t limit)
+{
+	size_t ret = 1;
+
+	while (ret < v && ret < limit)
+		ret <<= 1;
+	return std::min(ret, limit);
+}
+
+struct encoder_profile choose_encoder_profile(
+		const struct encoder_inputs& in)
+{
+	struct encoder_profile p;
+
+	// with few unique blocks, the patch is mostly long copies,
+	// which the fast levels find as well
+	if (in.unique_ratio < 0.01)
+		p.level = 3;
+	else if (in.unique_ratio < 0.1)
+		p.level = 6;
+	else
+		p.level = 9;
+
+	if (in.time_budget > 0)
+	{
+		while (p.level > 1 && encode_seconds(in.expanded_target, p.level)
+				> in.time_budget)
+			--p.level;
+	}
+
+	if (p.level >= 6)
+		p.secondary = secondary_compressor::djw;
+	else if (p.level >= 3)
+		p.secondary = secondary_compressor::fgk;
+	else
+		p.secondary = secondary_compressor::none;
+
+	// the whole expanded source in the window, so that no distant
+	// matches are lost
+	p.source_window = std::max(default_source_window,
+			round_up_pow2(in.expanded_source, max_source_window));
+	if (in.memory_limit)
+	{
+		size_t cap = min_source_window;
+
+		while (cap * 2 <= in.memory_limit / 2 && cap < max_source_window)
+			cap <<= 1;
+		p.source_window = std::min(p.source_window, cap);
+	}
+
+	p.input_window = in.expanded_target >= large_target
+		? max_input_window : default_input_window;
+
+	return p;
+}
+
+double encode_seconds(uint64_t expanded_target, int level)
+{
+	return expanded_target / 1e6 / encoder_throughput[level];
+}
+
+void override_encoder_profile(struct encoder_profile& profile,
+		const struct sqdelta_encoder& settings)
+{
+	if (settings.level >= 0)
+	{
+		if (settings.level > 9)
+			throw std::invalid_argument("Invalid encoder level");
+		profile.level = settings.level;
+	}
+	if (settings.source_window)
+		profile.source_window = settings.source_window;
+	if (settings.input_window)
+		profile.input_window = settings.input_window;
+	if (settings.secondary)
+		profile.secondary = parse_secondary_compressor(settings.secondary);
+}
+
+const char* secondary_compressor_name(
+		secondary_compressor::secondary_compressor secondary)
+{
+	return secondary_names[secondary];
+}
+
+secondary_compressor::secondary_compressor parse_secondary_compressor(
+		const char* name)
+{
+	for (int i = secondary_compressor::none;
+			i <= secondary_compressor::lzma; ++i)
+	{
+		if (!strcmp(name, secondary_names[i]))
+			return static_cast<secondary_compressor::secondary_compressor>(i);
+	}
+
+	throw std::invalid_argument("Invalid secondary compressor");
+}
+
+std::vector<std::string> encoder_arguments(
+		const struct encoder_profile& profile)
+{
+	std::vector<std::string> args;
+	std::ostringstream level;
+	std::ostringstream source_window;
+	std::ostringstream input_window;
+
+	level << '-' << profile.level;
+	source_window << profile.source_window;
+	input_window << profile.input_window;
+
+	args.push_back(level.str());
+	args.push_back("-S");
+	args.push_back(secondary_compressor_name(profile.secondary));
+	args.push_back("-B");
+	args.push_back(source_window.str());
+	args.push_back("-W");
+	args.push_back(input_window.str());
+	return args;
+}
+
+std::ostream& operator<<(std::ostream& out,
+		const struct encoder_profile& profile)
+{
+	std::vector<std::string> args = encoder_arguments(profile);
+
+	for (std::vector<std::string>::iterator i = args.begin();
+			i != args.end(); ++i)
+		out << (i != args.begin() ? " " : "") << *i;
+	return out;
+}
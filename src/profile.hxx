@@ -0,0 +1,93 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_PROFILE_HXX
+#define SDT_PROFILE_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <cstdlib> // size_t
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "libsquashdelta.h"
+
+/**
+ * xdelta3 settings picked from the sizes of the image pair.
+ */
+
+namespace secondary_compressor
+{
+	enum secondary_compressor
+	{
+		none,
+		fgk,
+		djw,
+		lzma
+	};
+}
+
+struct encoder_profile
+{
+	// -0 to -9
+	int level;
+	// -B and -W
+	size_t source_window;
+	size_t input_window;
+	secondary_compressor::secondary_compressor secondary;
+};
+
+struct encoder_inputs
+{
+	uint64_t expanded_source;
+	// expected, the target is expanded while being encoded
+	uint64_t expanded_target;
+	// unique target blocks, compressed, to the target image size
+	double unique_ratio;
+	// seconds, 0 for no limit
+	double time_budget;
+	// for the source window, 0 for no limit
+	size_t memory_limit;
+};
+
+// expanded target MB/s per level, used for the time budget;
+// calibrated with make bench
+extern const double encoder_throughput[10];
+
+// projected seconds to encode the expanded target at given level
+double encode_seconds(uint64_t expanded_target, int level);
+
+struct encoder_profile choose_encoder_profile(
+		const struct encoder_inputs& in);
+// replace the picked settings with the ones set by the user
+void override_encoder_profile(struct encoder_profile& profile,
+		const struct sqdelta_encoder& settings);
+
+const char* secondary_compressor_name(
+		secondary_compressor::secondary_compressor secondary);
+// throws std::invalid_argument for unknown names
+secondary_compressor::secondary_compressor parse_secondary_compressor(
+		const char* name);
+
+// the xdelta3 arguments, without the files
+std::vector<std::string> encoder_arguments(
+		const struct encoder_profile& profile);
+
+std::ostream& operator<<(std::ostream& out,
+		const struct encoder_profile& profile);
+
+#endif /*!SDT_PROFILE_HXX*/
@@ -0,0 +1,375 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <utility>
+
+#include <cstdio>
+
+#include "compressor.hxx"
+#include "report.hxx"
+
+static const char* const category_names[block_category::count] = {
+	"data", "fragment", "inode_table", "fragment_table", "other"
+};
+
+static void write_json_string(std::ostream& out, const std::string& s)
+{
+	out << '"';
+	for (std::string::const_iterator i = s.begin(); i != s.end(); ++i)
+	{
+		unsigned char ch = *i;
+
+		if (ch == '"' || ch == '\\')
+			out << '\\' << ch;
+		else if (ch < 0x20)
+		{
+			char buf[8];
+
+			snprintf(buf, sizeof(buf), "\\u%04x", ch);
+			out << buf;
+		}
+		else
+			out << ch;
+	}
+	out << '"';
+}
+
+static void write_json_bytes(std::ostream& out,
+		const struct unique_bytes& bytes)
+{
+	out << "\"blocks\": " << bytes.blocks
+		<< ", \"compressed\": " << bytes.compressed
+		<< ", \"expanded\": " << bytes.expanded;
+}
+
+void ImageAttribution::add(struct unique_bytes& bytes, uint64_t compressed,
+		uint64_t expanded, bool new_block)
+{
+	if (new_block)
+		++bytes.blocks;
+	bytes.compressed += compressed;
+	bytes.expanded += expanded;
+}
+
+ImageAttribution::ImageAttribution(MMAPFile& f, Compressor& c,
+		const std::vector<struct compressed_block>& blocks)
+{
+	MMAPFile sbf(f);
+	sbf.seek(0, std::ios::beg);
+	const squashfs::super_block sb = sbf.read<squashfs::super_block>();
+
+	// the blocks already attributed
+	std::vector<bool> matched(blocks.size());
+	std::vector<char> buf(std::max<size_t>(sb.block_size,
+				squashfs::metadata_size));
+
+	// index of the unique block at given offset, or blocks.size()
+	auto find_block = [&](uint64_t offset) -> size_t {
+		struct compressed_block key;
+		key.offset = offset;
+
+		std::vector<struct compressed_block>::const_iterator i
+			= std::lower_bound(blocks.begin(), blocks.end(), key,
+					sort_by_offset);
+		if (i == blocks.end() || i->offset != offset
+				|| matched[i - blocks.begin()])
+			return blocks.size();
+
+		matched[i - blocks.begin()] = true;
+		return i - blocks.begin();
+	};
+
+	struct dir_info
+	{
+		uint32_t inode_number;
+		uint32_t start_block;
+		uint16_t offset;
+		uint32_t file_size;
+	};
+
+	std::vector<struct dir_info> dirs;
+	// the files using each fragment, with their tail lengths
+	std::vector<std::vector<std::pair<size_t, uint64_t> > >
+		fragment_users(sb.fragments);
+
+	// data blocks, attributed to the files
+	InodeReader ir(f, sb, c);
+
+	for (uint32_t i = 0; i < sb.inodes; ++i)
+	{
+		union squashfs::inode::inode& in = ir.read();
+		uint64_t start_block;
+		uint64_t file_size;
+		uint32_t fragment;
+		uint32_t block_count;
+		const le32* block_list;
+
+		switch (in.as_base.inode_type)
+		{
+			case squashfs::inode::type::reg:
+				start_block = in.as_reg.start_block;
+				file_size = in.as_reg.file_size;
+				fragment = in.as_reg.fragment;
+				block_count = in.as_reg.block_count(sb.block_size,
+						sb.block_log);
+				block_list = in.as_reg.block_list();
+				break;
+			case squashfs::inode::type::lreg:
+				start_block = in.as_lreg.start_block;
+				file_size = in.as_lreg.file_size;
+				fragment = in.as_lreg.fragment;
+				block_count = in.as_lreg.block_count(sb.block_size,
+						sb.block_log);
+				block_list = in.as_lreg.block_list();
+				break;
+			case squashfs::inode::type::dir:
+			{
+				struct dir_info d;
+				d.inode_number = in.as_base.inode_number;
+				d.start_block = in.as_dir.start_block;
+				d.offset = in.as_dir.offset;
+				d.file_size = in.as_dir.file_size;
+
+				dirs.push_back(d);
+				continue;
+			}
+			case squashfs::inode::type::ldir:
+			{
+				struct dir_info d;
+				d.inode_number = in.as_base.inode_number;
+				d.start_block = in.as_ldir.start_block;
+				d.offset = in.as_ldir.offset;
+				d.file_size = in.as_ldir.file_size;
+
+				dirs.push_back(d);
+				continue;
+			}
+			default:
+				continue;
+		}
+
+		struct file_info fi;
+		fi.inode_number = in.as_base.inode_number;
+		files.push_back(fi);
+
+		struct unique_bytes& bytes = files.back().bytes;
+		uint64_t pos = start_block;
+
+		for (uint32_t j = 0; j < block_count; ++j)
+		{
+			uint32_t v = block_list[j];
+			uint32_t length = v & ~squashfs::block_size::uncompressed;
+
+			if (v != 0 && !(v & squashfs::block_size::uncompressed)
+					&& find_block(pos) != blocks.size())
+			{
+				uint64_t expanded = std::min<uint64_t>(sb.block_size,
+						file_size - uint64_t(j) * sb.block_size);
+
+				add(bytes, length, expanded);
+				add(categories[block_category::data], length, expanded);
+			}
+
+			pos += length;
+		}
+
+		if (fragment != squashfs::invalid_frag && fragment < sb.fragments)
+			fragment_users[fragment].push_back(std::make_pair(
+					files.size() - 1,
+					file_size - uint64_t(block_count) * sb.block_size));
+	}
+
+	// fragment blocks, split between the files by their tail lengths
+	FragmentTableReader fr(f, sb, c);
+
+	for (uint32_t i = 0; i < sb.fragments; ++i)
+	{
+		const struct squashfs::fragment_entry& fe = fr.read();
+
+		if ((fe.size & squashfs::block_size::uncompressed)
+				|| find_block(fe.start_block) == blocks.size())
+			continue;
+
+		MMAPFile df(f);
+		df.seek(fe.start_block, std::ios::beg);
+		uint64_t length = fe.size;
+		uint64_t expanded = c.decompress(&buf[0],
+				df.read_array<char>(length), length, buf.size());
+
+		add(categories[block_category::fragment], length, expanded);
+
+		std::vector<std::pair<size_t, uint64_t> >& users
+			= fragment_users[i];
+		uint64_t tails = 0;
+
+		for (size_t j = 0; j < users.size(); ++j)
+			tails += users[j].second;
+
+		// the remainders go to the last user
+		uint64_t left = length;
+		uint64_t expanded_left = expanded;
+
+		for (size_t j = 0; j < users.size(); ++j)
+		{
+			uint64_t share = left;
+			uint64_t expanded_share = expanded_left;
+
+			if (j + 1 < users.size())
+			{
+				share = tails ? length * users[j].second / tails : 0;
+				expanded_share = tails
+					? expanded * users[j].second / tails : 0;
+			}
+
+			add(files[users[j].first].bytes, share, expanded_share);
+			left -= share;
+			expanded_left -= expanded_share;
+		}
+	}
+
+	// the metadata blocks of the tables
+	auto add_metadata = [&](uint64_t header_offset,
+			enum block_category::block_category category) {
+		size_t idx = find_block(header_offset + sizeof(le16));
+
+		if (idx == blocks.size())
+			return;
+
+		MetadataBlockReader mbr(f, header_offset, c);
+		add(categories[category], blocks[idx].length,
+				mbr.read(&buf[0], buf.size()));
+	};
+
+	MMAPFile tf(f);
+	tf.seek(sb.inode_table_start, std::ios::beg);
+	while (tf.getpos() < sb.directory_table_start)
+	{
+		uint64_t header_offset = tf.getpos();
+
+		tf.seek(tf.read<le16>() & ~squashfs::inode_size::uncompressed);
+		add_metadata(header_offset, block_category::inode_table);
+	}
+
+	if (sb.fragments > 0)
+	{
+		size_t index_size = (sb.fragments * sizeof(squashfs::fragment_entry)
+				+ squashfs::metadata_size - 1) / squashfs::metadata_size;
+
+		tf.seek(sb.fragment_table_start, std::ios::beg);
+		const le64* index = tf.read_array<le64>(index_size);
+
+		for (size_t i = 0; i < index_size; ++i)
+			add_metadata(index[i], block_category::fragment_table);
+	}
+
+	// whatever get_blocks() found elsewhere
+	for (size_t i = 0; i < blocks.size(); ++i)
+	{
+		if (!matched[i])
+			add(categories[block_category::other], blocks[i].length,
+					blocks[i].length);
+	}
+
+	for (int i = 0; i < block_category::count; ++i)
+	{
+		add(total, categories[i].compressed, categories[i].expanded, false);
+		total.blocks += categories[i].blocks;
+	}
+
+	// drop the files without unique blocks, and name the rest
+	std::vector<struct file_info>::iterator new_end = std::remove_if(
+			files.begin(), files.end(), [](const struct file_info& fi) {
+				return fi.bytes.blocks == 0;
+			});
+	files.erase(new_end, files.end());
+
+	InodePaths paths;
+
+	for (std::vector<struct dir_info>::iterator i = dirs.begin();
+			i != dirs.end(); ++i)
+		paths.add_directory(f, sb, c, i->inode_number, i->start_block,
+				i->offset, i->file_size);
+
+	for (std::vector<struct file_info>::iterator i = files.begin();
+			i != files.end(); ++i)
+		i->path = paths.path(i->inode_number);
+
+	std::sort(files.begin(), files.end(),
+			[](const struct file_info& lhs, const struct file_info& rhs) {
+				if (lhs.bytes.compressed != rhs.bytes.compressed)
+					return lhs.bytes.compressed > rhs.bytes.compressed;
+				return lhs.path < rhs.path;
+			});
+}
+
+void ImageAttribution::write_json(std::ostream& out) const
+{
+	out << "{\n\t\t\"unique\": {";
+	write_json_bytes(out, total);
+	out << "},\n\t\t\"categories\": {";
+
+	for (int i = 0; i < block_category::count; ++i)
+	{
+		out << (i ? ",\n\t\t\t" : "\n\t\t\t");
+		write_json_string(out, category_names[i]);
+		out << ": {";
+		write_json_bytes(out, categories[i]);
+		out << '}';
+	}
+
+	out << "\n\t\t},\n\t\t\"files\": [";
+
+	for (std::vector<struct file_info>::const_iterator i = files.begin();
+			i != files.end(); ++i)
+	{
+		out << (i != files.begin() ? ",\n\t\t\t{" : "\n\t\t\t{")
+			<< "\"path\": ";
+		write_json_string(out, i->path);
+		out << ", \"inode\": " << i->inode_number << ", ";
+		write_json_bytes(out, i->bytes);
+		out << '}';
+	}
+
+	out << (files.empty() ? "]\n\t}" : "\n\t\t]\n\t}");
+}
+
+void ImageAttribution::write_table(std::ostream& out, size_t top) const
+{
+	out << std::left << std::setw(16) << "category" << std::right
+		<< std::setw(10) << "blocks"
+		<< std::setw(14) << "compressed"
+		<< std::setw(14) << "expanded" << "\n";
+
+	for (int i = 0; i <= block_category::count; ++i)
+	{
+		const struct unique_bytes& b = i < block_category::count
+			? categories[i] : total;
+
+		out << std::left << std::setw(16)
+			<< (i < block_category::count ? category_names[i] : "total")
+			<< std::right
+			<< std::setw(10) << b.blocks
+			<< std::setw(14) << b.compressed
+			<< std::setw(14) << b.expanded << "\n";
+	}
+
+	out << "\n" << std::setw(14) << "compressed"
+		<< std::setw(14) << "expanded"
+		<< std::setw(10) << "blocks" << "  path\n";
+
+	for (size_t i = 0; i < files.size() && i < top; ++i)
+		out << std::setw(14) << files[i].bytes.compressed
+			<< std::setw(14) << files[i].bytes.expanded
+			<< std::setw(10) << files[i].bytes.blocks
+			<< "  " << files[i].path << "\n";
+}
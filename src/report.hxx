@@ -0,0 +1,85 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_REPORT_HXX
+#define SDT_REPORT_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "delta.hxx"
+#include "squashfs.hxx"
+
+/**
+ * Attribution of the unique blocks of an image to the files owning
+ * them, and to the kinds of blocks, to find out what makes a patch large.
+ */
+
+namespace block_category
+{
+	enum block_category
+	{
+		data,
+		fragment,
+		inode_table,
+		fragment_table,
+		other,
+
+		count
+	};
+}
+
+struct unique_bytes
+{
+	uint64_t blocks;
+	uint64_t compressed;
+	uint64_t expanded;
+
+	unique_bytes()
+		: blocks(0), compressed(0), expanded(0)
+	{
+	}
+};
+
+class ImageAttribution
+{
+	struct file_info
+	{
+		uint32_t inode_number;
+		std::string path;
+		struct unique_bytes bytes;
+	};
+
+	std::vector<struct file_info> files;
+	struct unique_bytes categories[block_category::count];
+	struct unique_bytes total;
+
+	void add(struct unique_bytes& bytes, uint64_t compressed,
+			uint64_t expanded, bool new_block = true);
+
+public:
+	// blocks are the unique blocks of the image, sorted by offset
+	ImageAttribution(MMAPFile& f, Compressor& c,
+			const std::vector<struct compressed_block>& blocks);
+
+	void write_json(std::ostream& out) const;
+	// the categories, and the top files by the compressed bytes
+	void write_table(std::ostream& out, size_t top) const;
+};
+
+#endif /*!SDT_REPORT_HXX*/
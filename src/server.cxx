@@ -0,0 +1,632 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+extern "C"
+{
+#	include <sys/types.h>
+#	include <sys/signalfd.h>
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <sys/un.h>
+#	include <fcntl.h>
+#	include <poll.h>
+#	include <signal.h>
+#	include <unistd.h>
+}
+
+#include "server.hxx"
+#include "util.hxx"
+
+ImageCache::ImageCache(const DeltaSession& new_session, size_t new_limit)
+	: session(new_session), limit(new_limit), used(0), hits(0), misses(0),
+	next_generation(0)
+{
+}
+
+void ImageCache::drop(std::map<std::string, struct entry>::iterator it)
+{
+	// requests in progress keep their reference to the image
+	used -= it->second.memory;
+	lru.erase(it->second.lru_pos);
+	entries.erase(it);
+}
+
+void ImageCache::evict()
+{
+	std::list<std::string>::iterator i = lru.end();
+
+	while (used > limit && i != lru.begin())
+	{
+		std::list<std::string>::iterator victim = --i;
+
+		// the most recently used image stays, even if it exceeds the limit
+		if (victim == lru.begin())
+			break;
+
+		// images being analysed are not accounted yet
+		std::map<std::string, struct entry>::iterator it = entries.find(*victim);
+		if (!it->second.memory)
+			continue;
+
+		++i;
+		drop(it);
+	}
+}
+
+ImageCache::image_ptr ImageCache::get(const std::string& path)
+{
+	struct stat st;
+
+	if (stat(path.c_str(), &st) == -1)
+		throw DeltaError(SQDELTA_ERR_IO, "Unable to stat file",
+				"file: " + path, errno);
+
+	std::promise<image_ptr> promise;
+	uint64_t generation;
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		std::map<std::string, struct entry>::iterator it = entries.find(path);
+
+		if (it != entries.end())
+		{
+			struct entry& e = it->second;
+
+			if (e.dev == st.st_dev && e.ino == st.st_ino
+					&& e.mtime == st.st_mtime && e.size == st.st_size)
+			{
+				std::shared_future<image_ptr> image = e.image;
+
+				++hits;
+				lru.splice(lru.begin(), lru, e.lru_pos);
+
+				// wait for the analysis outside the lock
+				guard.unlock();
+				return image.get();
+			}
+
+			// the file changed
+			drop(it);
+		}
+
+		struct entry e;
+		e.dev = st.st_dev;
+		e.ino = st.st_ino;
+		e.mtime = st.st_mtime;
+		e.size = st.st_size;
+		e.image = promise.get_future().share();
+		e.memory = 0;
+		e.generation = generation = next_generation++;
+		e.lru_pos = lru.insert(lru.begin(), path);
+
+		entries[path] = e;
+		++misses;
+	}
+
+	image_ptr image;
+	try
+	{
+		image = image_ptr(session.open_image(path.c_str()));
+	}
+	catch (...)
+	{
+		promise.set_exception(std::current_exception());
+
+		// do not cache the failure
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::string, struct entry>::iterator it = entries.find(path);
+		if (it != entries.end() && it->second.generation == generation)
+			drop(it);
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		std::map<std::string, struct entry>::iterator it = entries.find(path);
+
+		if (it != entries.end() && it->second.generation == generation)
+		{
+			it->second.memory = image->memory_size();
+			used += it->second.memory;
+			evict();
+		}
+	}
+
+	promise.set_value(image);
+	return image;
+}
+
+void ImageCache::stats(uint64_t& new_hits, uint64_t& new_misses,
+		size_t& new_used)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	new_hits = hits;
+	new_misses = misses;
+	new_used = used;
+}
+
+// block the stop signals in the calling thread, and the threads it
+// starts later, returning a descriptor to read them from
+static int block_stop_signals()
+{
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+
+	int err = pthread_sigmask(SIG_BLOCK, &mask, 0);
+	if (err != 0)
+		throw IOError("Unable to block the signals", err);
+
+	int fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (fd == -1)
+		throw IOError("signalfd() failed", errno);
+	return fd;
+}
+
+// write all of it, without raising SIGPIPE on a closed connection
+static void send_all(int fd, const char* data, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t ret = send(fd, data, length, MSG_NOSIGNAL);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			throw IOError("send() failed", errno);
+
+		data += ret;
+		length -= ret;
+	}
+}
+
+DeltaServer::DeltaServer(const DeltaSession& new_session, size_t cache_size,
+		unsigned jobs)
+	: session(new_session), cache(new_session, cache_size),
+	signal_fd(block_stop_signals()), pool(jobs), listen_fd(-1)
+{
+	if (pipe2(wake_fds, O_CLOEXEC | O_NONBLOCK) == -1)
+	{
+		int err = errno;
+		close(signal_fd);
+		throw IOError("pipe() failed", err);
+	}
+}
+
+DeltaServer::~DeltaServer()
+{
+	close(wake_fds[0]);
+	close(wake_fds[1]);
+	close(signal_fd);
+	if (listen_fd != -1)
+	{
+		close(listen_fd);
+		unlink(socket_path.c_str());
+	}
+}
+
+void DeltaServer::listen(const char* path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		throw DeltaError(SQDELTA_ERR_INVALID, "Socket path too long");
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1)
+		throw IOError("socket() failed", errno);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// a stale socket of a previous instance
+	unlink(path);
+	if (bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr),
+				sizeof(addr)) == -1)
+		throw IOError("bind() failed", errno);
+	socket_path = path;
+
+	if (::listen(listen_fd, 64) == -1)
+		throw IOError("listen() failed", errno);
+}
+
+// requests are short, anything longer is garbage
+static const size_t max_line = 3 * 4096;
+
+void DeltaServer::run()
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	std::cerr << "Listening on " << socket_path << " with "
+		<< pool.size() << " workers.\n";
+
+	bool stopping = false;
+
+	while (true)
+	{
+		std::vector<struct pollfd> fds;
+		struct pollfd p;
+
+		p.events = POLLIN;
+		p.revents = 0;
+		p.fd = wake_fds[0];
+		fds.push_back(p);
+		if (!stopping)
+		{
+			p.fd = signal_fd;
+			fds.push_back(p);
+			p.fd = listen_fd;
+			fds.push_back(p);
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			// when stopping, only wait for the requests in progress
+			if (stopping && connections.empty())
+				break;
+
+			for (std::map<int, struct connection>::iterator
+					i = connections.begin(); i != connections.end(); ++i)
+			{
+				if (!i->second.busy && !i->second.eof)
+				{
+					p.fd = i->first;
+					fds.push_back(p);
+				}
+			}
+		}
+
+		if (poll(&fds[0], fds.size(), -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw IOError("poll() failed", errno);
+		}
+
+		for (std::vector<struct pollfd>::iterator i = fds.begin();
+				i != fds.end(); ++i)
+		{
+			if (!i->revents)
+				continue;
+
+			if (i->fd == wake_fds[0])
+			{
+				char data[64];
+
+				while (read(wake_fds[0], data, sizeof(data)) > 0)
+					;
+			}
+			else if (i->fd == signal_fd)
+			{
+				struct signalfd_siginfo si;
+
+				if (read(signal_fd, &si, sizeof(si)) != sizeof(si))
+					continue;
+
+				// the idle clients get EOF, the requests in progress
+				// fail to send their replies
+				std::lock_guard<std::mutex> guard(lock);
+
+				stopping = true;
+				for (std::map<int, struct connection>::iterator
+						j = connections.begin(); j != connections.end();
+						++j)
+				{
+					shutdown(j->first, SHUT_RDWR);
+					j->second.eof = true;
+					j->second.broken = true;
+				}
+			}
+			else if (i->fd == listen_fd)
+			{
+				int fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+
+				if (fd == -1)
+				{
+					if (errno == EINTR || errno == ECONNABORTED)
+						continue;
+					throw IOError("accept() failed", errno);
+				}
+
+				struct connection c;
+				c.busy = false;
+				c.eof = false;
+				c.broken = false;
+
+				std::lock_guard<std::mutex> guard(lock);
+				connections[fd] = c;
+			}
+			else
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				read_connection(i->fd, connections[i->fd]);
+			}
+		}
+
+		dispatch();
+	}
+
+	uint64_t hits, misses;
+	size_t used;
+	cache.stats(hits, misses, used);
+	std::cerr << "Shutting down, image cache: " << hits << " hits, "
+		<< misses << " misses, " << (used >> 20) << " MiB used.\n";
+}
+
+void DeltaServer::read_connection(int fd, struct connection& c)
+{
+	char data[4096];
+	// poll() said it would not block
+	ssize_t ret = read(fd, data, sizeof(data));
+
+	if (ret == -1 && errno == EINTR)
+		return;
+	if (ret <= 0)
+	{
+		// the requests received still get their replies
+		c.eof = true;
+		return;
+	}
+
+	c.buf.append(data, ret);
+	if (c.buf.find('\n') == std::string::npos && c.buf.size() > max_line)
+	{
+		try
+		{
+			send_all(fd, "ERROR 1\tRequest too long\n", 25);
+		}
+		catch (...)
+		{
+		}
+		c.eof = true;
+		c.broken = true;
+	}
+}
+
+void DeltaServer::dispatch()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	std::map<int, struct connection>::iterator i = connections.begin();
+
+	while (i != connections.end())
+	{
+		struct connection& c = i->second;
+		size_t eol = c.buf.find('\n');
+
+		if (c.busy)
+			++i;
+		else if (eol != std::string::npos && !c.broken)
+		{
+			// the requests of a connection are handled in order
+			int fd = i->first;
+			std::string line = c.buf.substr(0, eol);
+
+			c.buf.erase(0, eol + 1);
+			c.busy = true;
+			pool.submit([this, fd, line]() { run_request(fd, line); });
+			++i;
+		}
+		else if (c.eof)
+		{
+			close(i->first);
+			connections.erase(i++);
+		}
+		else
+			++i;
+	}
+}
+
+void DeltaServer::run_request(int fd, const std::string& line)
+{
+	bool failed = false;
+
+	try
+	{
+		handle_request(fd, line);
+	}
+	catch (std::exception& e)
+	{
+		// most likely the client went away
+		std::cerr << "Connection error: " << e.what() << "\n";
+		failed = true;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		struct connection& c = connections[fd];
+
+		c.busy = false;
+		if (failed)
+		{
+			c.eof = true;
+			c.broken = true;
+		}
+	}
+
+	// a full pipe has a wake-up pending already
+	char byte = 0;
+	if (write(wake_fds[1], &byte, 1) == -1 && errno != EAGAIN)
+		std::cerr << "Unable to wake the server up: " << strerror(errno)
+			<< "\n";
+}
+
+static std::vector<std::string> split_fields(const std::string& line)
+{
+	std::vector<std::string> ret;
+	size_t start = 0;
+
+	while (true)
+	{
+		size_t tab = line.find('\t', start);
+
+		ret.push_back(line.substr(start, tab - start));
+		if (tab == std::string::npos)
+			break;
+		start = tab + 1;
+	}
+
+	return ret;
+}
+
+// relays the patch written into a pipe to the connection, in chunks
+// of "<size>\n<data>" ending with an empty one, as its size is not known
+// until it is done
+class PatchStream
+{
+	int conn_fd;
+	int pipe_fds[2];
+	int send_errno;
+	std::thread relay;
+
+	void run()
+	{
+		char buf[65536];
+
+		while (true)
+		{
+			ssize_t ret = read(pipe_fds[0], buf, sizeof(buf));
+
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+
+			std::ostringstream header;
+			header << ret << "\n";
+
+			try
+			{
+				send_all(conn_fd, header.str().data(), header.str().size());
+				send_all(conn_fd, buf, ret);
+			}
+			catch (IOError& e)
+			{
+				// the writer gets EPIPE and stops
+				send_errno = e.errno_val;
+				close(pipe_fds[0]);
+				pipe_fds[0] = -1;
+				return;
+			}
+		}
+
+		try
+		{
+			send_all(conn_fd, "0\n", 2);
+		}
+		catch (IOError& e)
+		{
+			send_errno = e.errno_val;
+		}
+	}
+
+public:
+	PatchStream(int fd)
+		: conn_fd(fd), send_errno(0)
+	{
+		if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+			throw DeltaError(SQDELTA_ERR_IO, "Unable to create a pipe",
+					"", errno);
+
+		relay = std::thread(&PatchStream::run, this);
+	}
+
+	~PatchStream()
+	{
+		// the relay ends the chunks when the patch is closed
+		if (pipe_fds[1] != -1)
+			close(pipe_fds[1]);
+		if (relay.joinable())
+			relay.join();
+		if (pipe_fds[0] != -1)
+			close(pipe_fds[0]);
+	}
+
+	int input() const
+	{
+		return pipe_fds[1];
+	}
+
+	void finish()
+	{
+		close(pipe_fds[1]);
+		pipe_fds[1] = -1;
+		relay.join();
+
+		if (send_errno)
+			throw IOError("send() failed", send_errno);
+	}
+};
+
+void DeltaServer::handle_request(int fd, const std::string& line)
+{
+	std::vector<std::string> fields = split_fields(line);
+	std::chrono::steady_clock::time_point start
+		= std::chrono::steady_clock::now();
+	std::ostringstream reply;
+
+	try
+	{
+		if (fields.size() != 4 || fields[0] != "DELTA")
+			throw DeltaError(SQDELTA_ERR_INVALID, "Invalid request");
+
+		std::shared_ptr<DeltaImage> source = cache.get(fields[1]);
+		std::shared_ptr<DeltaImage> target = cache.get(fields[2]);
+
+		if (fields[3] == "-")
+		{
+			send_all(fd, "STREAM\n", 7);
+
+			PatchStream stream(fd);
+			session.make_patch(*source, *target, stream.input());
+			stream.finish();
+
+			reply << "OK\n";
+			send_all(fd, reply.str().data(), reply.str().size());
+		}
+		else
+		{
+			session.make_patch(*source, *target, fields[3].c_str());
+
+			reply << "OK\n";
+			send_all(fd, reply.str().data(), reply.str().size());
+		}
+	}
+	catch (DeltaError& e)
+	{
+		reply << "ERROR " << e.code << "\t" << e.what();
+		if (!e.context.empty())
+			reply << " (at " << e.context << ")";
+		reply << "\n";
+		send_all(fd, reply.str().data(), reply.str().size());
+	}
+
+	std::chrono::duration<double> elapsed
+		= std::chrono::steady_clock::now() - start;
+	std::ostringstream log;
+	log << (fields.size() > 2 ? fields[1] + " -> " + fields[2] : line)
+		<< ": " << reply.str().substr(0, reply.str().find('\n'))
+		<< " (" << elapsed.count() << " s)\n";
+	std::cerr << log.str();
+}
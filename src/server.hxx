@@ -0,0 +1,149 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_SERVER_HXX
+#define SDT_SERVER_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+extern "C"
+{
+#	include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+#include "libsquashdelta.hxx"
+#include "pool.hxx"
+
+/**
+ * Delta server, keeping the analysed images between requests.
+ *
+ * Requests are single lines of tab-separated fields, any number of them
+ * can be sent over one connection:
+ *
+ *   DELTA <source> <target> <output>
+ *
+ * <output> is a path for the patch on the server side, or '-' to get
+ * the patch back over the socket. The replies are:
+ *
+ *   OK                     the patch was written to <output>
+ *   ERROR <code> <message> code being one of enum sqdelta_error
+ *
+ * For '-', the patch is sent while it is generated, so the reply is
+ * preceded by:
+ *
+ *   STREAM                 followed by chunks of "<size>\n" and <size>
+ *                          bytes of the patch, ending with "0\n"
+ *
+ * The patch is only complete if the reply is OK.
+ */
+
+// LRU of the analysed images, within a memory budget
+class ImageCache
+{
+	typedef std::shared_ptr<DeltaImage> image_ptr;
+
+	struct entry
+	{
+		// the file is analysed again if any of those changes
+		dev_t dev;
+		ino_t ino;
+		time_t mtime;
+		off_t size;
+
+		std::shared_future<image_ptr> image;
+		// 0 while the image is being analysed
+		size_t memory;
+		// tells the entry from the ones replacing it while analysed
+		uint64_t generation;
+		std::list<std::string>::iterator lru_pos;
+	};
+
+	const DeltaSession& session;
+	size_t limit;
+	size_t used;
+
+	std::mutex lock;
+	std::map<std::string, struct entry> entries;
+	// most recently used first
+	std::list<std::string> lru;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t next_generation;
+
+	void drop(std::map<std::string, struct entry>::iterator it);
+	void evict();
+
+public:
+	ImageCache(const DeltaSession& new_session, size_t new_limit);
+
+	// concurrent requests for the same image share the analysis
+	image_ptr get(const std::string& path);
+
+	void stats(uint64_t& new_hits, uint64_t& new_misses,
+			size_t& new_used);
+};
+
+class DeltaServer
+{
+	const DeltaSession& session;
+	ImageCache cache;
+	// SIGINT and SIGTERM, blocked in all the threads (so before
+	// the pool is started) and read from there
+	int signal_fd;
+	ThreadPool pool;
+
+	int listen_fd;
+	std::string socket_path;
+
+	struct connection
+	{
+		// received, not handled yet
+		std::string buf;
+		// a request is being handled on the pool
+		bool busy;
+		// nothing more is to be read
+		bool eof;
+		// nor sent, the rest of the requests are dropped
+		bool broken;
+	};
+
+	// the connections are polled by run() while idle, and each request
+	// is handled on the pool
+	std::mutex lock;
+	std::map<int, struct connection> connections;
+	// written to when a request is done, to wake run() up
+	int wake_fds[2];
+
+	void read_connection(int fd, struct connection& c);
+	// start the next requests, close the connections done with
+	void dispatch();
+	void run_request(int fd, const std::string& line);
+	void handle_request(int fd, const std::string& line);
+
+public:
+	DeltaServer(const DeltaSession& new_session, size_t cache_size,
+			unsigned jobs);
+	~DeltaServer();
+
+	void listen(const char* path);
+	// serve until SIGINT or SIGTERM
+	void run();
+};
+
+#endif /*!SDT_SERVER_HXX*/
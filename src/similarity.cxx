@@ -0,0 +1,162 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <cstring>
+
+#include "hash.hxx"
+#include "similarity.hxx"
+
+// the chunk boundaries are where the top bits of the gear hash are zero,
+// giving about 64-byte chunks
+static const int chunk_bits = 6;
+static const size_t min_chunk = 16;
+static const size_t max_chunk = 512;
+
+// lookups in a crowded bucket are cut short
+static const size_t max_candidates = 64;
+
+static const uint32_t empty_min = 0xffffffffUL;
+
+static uint32_t mix32(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x85ebca6bUL;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35UL;
+	x ^= x >> 16;
+	return x;
+}
+
+// random values for the bytes, and the seeds of the hash functions
+struct sketch_tables
+{
+	uint32_t gear[256];
+	uint32_t seeds[sketch_size];
+
+	sketch_tables()
+	{
+		uint32_t state = 0x9e3779b9UL;
+
+		for (int i = 0; i < 256; ++i)
+			gear[i] = mix32(state += 0x9e3779b9UL);
+		for (size_t i = 0; i < sketch_size; ++i)
+			seeds[i] = mix32(state += 0x9e3779b9UL);
+	}
+};
+
+static const struct sketch_tables tables;
+
+void sketch_block(const void* data, size_t length, struct block_sketch& out)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	size_t chunk_start = 0;
+	uint32_t h = 0;
+
+	for (size_t i = 0; i < sketch_size; ++i)
+		out.min[i] = empty_min;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		h = (h << 1) + tables.gear[p[i]];
+
+		size_t chunk_len = i + 1 - chunk_start;
+		if (i + 1 < length && chunk_len < max_chunk
+				&& (chunk_len < min_chunk || (h >> (32 - chunk_bits)) != 0))
+			continue;
+
+		uint32_t feature = murmurhash3(p + chunk_start, chunk_len, 0);
+		for (size_t j = 0; j < sketch_size; ++j)
+		{
+			uint32_t v = mix32(feature ^ tables.seeds[j]);
+
+			if (v < out.min[j])
+				out.min[j] = v;
+		}
+
+		chunk_start = i + 1;
+	}
+}
+
+static bool sketch_empty(const struct block_sketch& s)
+{
+	return s.min[0] == empty_min;
+}
+
+double sketch_similarity(const struct block_sketch& lhs,
+		const struct block_sketch& rhs)
+{
+	size_t equal = 0;
+
+	if (sketch_empty(lhs) || sketch_empty(rhs))
+		return 0;
+
+	for (size_t i = 0; i < sketch_size; ++i)
+		equal += lhs.min[i] == rhs.min[i];
+
+	return static_cast<double>(equal) / sketch_size;
+}
+
+uint64_t SimilarityIndex::band_key(const struct block_sketch& s,
+		size_t band)
+{
+	return (static_cast<uint64_t>(band) << 32)
+		| murmurhash3(s.min + band * band_rows,
+				band_rows * sizeof(*s.min), 0);
+}
+
+SimilarityIndex::SimilarityIndex(
+		const std::vector<struct block_sketch>& new_sketches)
+	: sketches(new_sketches)
+{
+	for (size_t i = 0; i < sketches.size(); ++i)
+	{
+		if (sketch_empty(sketches[i]))
+			continue;
+
+		for (size_t b = 0; b < bands; ++b)
+			buckets.insert(std::make_pair(band_key(sketches[i], b), i));
+	}
+}
+
+long SimilarityIndex::find(const struct block_sketch& s,
+		double min_similarity) const
+{
+	long best = -1;
+	double best_similarity = 0;
+
+	if (sketch_empty(s))
+		return -1;
+
+	for (size_t b = 0; b < bands; ++b)
+	{
+		std::pair<std::unordered_multimap<uint64_t, size_t>::const_iterator,
+			std::unordered_multimap<uint64_t, size_t>::const_iterator>
+			range = buckets.equal_range(band_key(s, b));
+		size_t n = 0;
+
+		for (std::unordered_multimap<uint64_t, size_t>::const_iterator
+				i = range.first; i != range.second && n < max_candidates;
+				++i, ++n)
+		{
+			double similarity = sketch_similarity(s, sketches[i->second]);
+
+			// the earlier block wins ties, whatever the bucket order
+			if (similarity > best_similarity || (similarity == best_similarity
+						&& best != -1
+						&& i->second < static_cast<size_t>(best)))
+			{
+				best = i->second;
+				best_similarity = similarity;
+			}
+		}
+	}
+
+	return best_similarity >= min_similarity ? best : -1;
+}
@@ -0,0 +1,66 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_SIMILARITY_HXX
+#define SDT_SIMILARITY_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <unordered_map>
+#include <vector>
+
+#include <cstdlib> // size_t
+
+extern "C"
+{
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+/**
+ * Near-duplicate detection of the decompressed blocks: MinHash sketches
+ * over content-defined chunks, and an LSH index to pair the blocks.
+ */
+
+const size_t sketch_size = 32;
+
+struct block_sketch
+{
+	uint32_t min[sketch_size];
+};
+
+// sketch the content-defined chunks of the data
+void sketch_block(const void* data, size_t length, struct block_sketch& out);
+
+// estimated Jaccard similarity of the chunk sets, 0 to 1
+double sketch_similarity(const struct block_sketch& lhs,
+		const struct block_sketch& rhs);
+
+class SimilarityIndex
+{
+	// the sketch is split into bands, blocks sharing a whole band
+	// are candidates
+	static const size_t bands = 8;
+	static const size_t band_rows = sketch_size / bands;
+
+	const std::vector<struct block_sketch>& sketches;
+	std::unordered_multimap<uint64_t, size_t> buckets;
+
+	static uint64_t band_key(const struct block_sketch& s, size_t band);
+
+public:
+	// the sketches need to outlive the index
+	SimilarityIndex(const std::vector<struct block_sketch>& new_sketches);
+
+	// return the index of the most similar block, if at least
+	// min_similarity similar, or -1
+	long find(const struct block_sketch& s, double min_similarity) const;
+};
+
+#endif /*!SDT_SIMILARITY_HXX*/
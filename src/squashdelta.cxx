@@ -9,10 +9,9 @@
 #endif
 
 #include <iostream>
-#include <list>
-#include <typeinfo>
+#include <mutex>
+#include <string>
 
-#include <cassert>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -21,601 +20,554 @@
 extern "C"
 {
 #	include <sys/types.h>
-#	include <sys/wait.h>
+#	include <sys/stat.h>
+#	include <getopt.h>
 #	include <unistd.h>
-#	include <arpa/inet.h>
 }
 
-#include "compressor.hxx"
-#include "hash.hxx"
-#include "squashfs.hxx"
+#include "libsquashdelta.hxx"
+#include "pool.hxx"
+#include "profile.hxx"
+#include "server.hxx"
+#include "trace.hxx"
 #include "util.hxx"
 
-struct compressed_block
-{
-	size_t offset;
-	size_t length;
-	size_t uncompressed_length;
-	uint32_t hash;
-};
-
-#pragma pack(push, 1)
-struct serialized_compressed_block
-{
-	uint32_t offset;
-	uint32_t length;
-	uint32_t uncompressed_length;
+static const struct option long_opts[] = {
+	{ "trace", required_argument, 0, 't' },
+	{ "populate", no_argument, 0, 'P' },
+	{ "huge-pages", no_argument, 0, 'H' },
+	{ "readahead", required_argument, 0, 'r' },
+	{ "memory-limit", required_argument, 0, 'm' },
+	{ "window", required_argument, 0, 'w' },
+	{ "preallocate", no_argument, 0, 'a' },
+	{ "stats", no_argument, 0, 's' },
+	{ "io-engine", required_argument, 0, 'e' },
+	{ "external-sort", required_argument, 0, 'x' },
+	{ "serve", required_argument, 0, 'S' },
+	{ "jobs", required_argument, 0, 'j' },
+	{ "cache-size", required_argument, 0, 'C' },
+	{ "estimate", required_argument, 0, 'E' },
+	{ "report", required_argument, 0, 'R' },
+	{ "top", required_argument, 0, 'T' },
+	{ "pair-similar", no_argument, 0, 'p' },
+	{ "encoder", required_argument, 0, 'X' },
+	{ "time-budget", required_argument, 0, 'b' },
+	{ "deadline", required_argument, 0, 'L' },
+	{ "work-dir", required_argument, 0, 'W' },
+	{ "digest", no_argument, 0, 'D' },
+	{ "dedupe", no_argument, 0, 'd' },
+	{ "normalise", no_argument, 0, 'n' },
+	{ "per-file", no_argument, 0, 'F' },
+	{ "help", no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
 };
 
-struct sqdelta_header
-{
-	uint32_t magic;
-	uint32_t flags;
-	uint32_t compression;
-	uint32_t block_count;
-};
-#pragma pack(pop)
-
-const uint32_t sqdelta_magic = 0x5371ceb4;
-
-bool sort_by_offset(const struct compressed_block& lhs,
-		const struct compressed_block& rhs)
-{
-	return lhs.offset < rhs.offset;
-}
-
-bool sort_by_len_hash(const struct compressed_block& lhs,
-		const struct compressed_block& rhs)
+static void print_usage(const char* prog)
 {
-	if (lhs.length == rhs.length)
-		return lhs.hash < rhs.hash;
-	return lhs.length < rhs.length;
+	std::cerr << "Usage: " << prog << " [options] <source> <target> <patch-output>\n"
+		"       " << prog << " [options] --estimate <fraction> <source> <target>\n"
+		"       " << prog << " [options] --report <json> <source> <target>\n"
+		"       " << prog << " [options] --serve <socket>\n"
+		"\n"
+		"Options:\n"
+		"  -t, --trace <file>      write a Chrome trace-event timeline to <file>\n"
+		"  -P, --populate          prefault the input images when mapping them\n"
+		"  -H, --huge-pages        hint transparent huge pages for the images\n"
+		"  -r, --readahead <bytes> read-ahead window for sequential passes\n"
+		"                          (default: 8 MiB, 0 disables)\n"
+		"  -m, --memory-limit <bytes>\n"
+		"                          cap the memory used by the run: half\n"
+		"                          for the image mappings, in windows if\n"
+		"                          necessary, which are counted; the rest\n"
+		"                          sizes the external sort, not counted\n"
+		"  -w, --window <bytes>    map the images in windows of given size\n"
+		"  -a, --preallocate       preallocate the temporary file (faster\n"
+		"                          on some filesystems, but not sparse)\n"
+		"  -s, --stats             print I/O statistics when done\n"
+		"  -e, --io-engine <name>  I/O engine for block reads and output\n"
+		"                          writes: mmap (default) or uring"
+#ifndef ENABLE_IO_URING
+		" (not compiled in)"
+#endif
+		"\n"
+		"  -x, --external-sort <bytes>\n"
+		"                          keep the block tables on disk, sorting\n"
+		"                          them within given memory per image\n"
+		"                          (enabled by -m for large images)\n"
+		"  -S, --serve <socket>    serve delta requests on a UNIX socket,\n"
+		"                          keeping the analysed images in memory\n"
+		"  -j, --jobs <n>          worker threads, or requests served\n"
+		"                          in parallel (default: number of CPUs)\n"
+		"  -C, --cache-size <bytes>\n"
+		"                          memory for the analysed images\n"
+		"                          (default: 1 GiB)\n"
+		"  -E, --estimate <fraction>\n"
+		"                          estimate the patch size instead, encoding\n"
+		"                          only a fraction of the unique blocks\n"
+		"  -R, --report <json>     attribute the unique blocks to files and\n"
+		"                          block kinds instead, writing JSON to <json>\n"
+		"                          and a table of the top files to stdout\n"
+		"  -T, --top <n>           files in the report table (default: 20)\n"
+		"  -p, --pair-similar      expand the source blocks in the order\n"
+		"                          of the most similar target blocks\n"
+		"                          (needs an applier supporting it)\n"
+		"  -d, --dedupe            expand the blocks repeated within an image\n"
+		"                          once (needs an applier supporting it)\n"
+		"  -n, --normalise         store the file and fragment positions\n"
+		"                          in the metadata relative to the previous\n"
+		"                          ones (needs an applier supporting it)\n"
+		"  -F, --per-file          delta-encode each changed file against\n"
+		"                          its previous version in parallel, and\n"
+		"                          the rest of the image separately\n"
+		"                          (needs an applier supporting it)\n"
+		"  -X, --encoder <settings>\n"
+		"                          xdelta3 settings instead of the picked\n"
+		"                          ones, e.g. level=6,secondary=fgk,\n"
+		"                          source-window=256M,input-window=8M\n"
+		"  -b, --time-budget <seconds>\n"
+		"                          pick a faster encoder level if the target\n"
+		"                          would take longer to encode\n"
+		"  -L, --deadline <seconds>\n"
+		"                          write the patch within given time, using\n"
+		"                          a faster encoder level, skipping -p or\n"
+		"                          not expanding the blocks if projected\n"
+		"                          to take longer\n"
+		"  -W, --work-dir <dir>    keep the block tables, unique blocks and\n"
+		"                          expanded source in <dir>, to resume\n"
+		"                          an interrupted run from them\n"
+		"  -D, --digest            store a BLAKE3 digest of the target in\n"
+		"                          the patch, to verify the applied image\n"
+		"                          (needs an applier supporting it)\n"
+		"  -h, --help              print this help\n"
+		"\n"
+		"Sizes accept K, M and G suffixes. The patch is written to stdout\n"
+		"if <patch-output> is -, e.g. to upload it while it is generated.\n"
+		"An image is read from stdin if given as -; images from pipes\n"
+		"are read once, into a sparse temporary file.\n";
 }
 
-
-std::list<struct compressed_block> get_blocks(MMAPFile& f, Compressor*& c,
-		size_t& block_size)
+// the readers mapping a window at once, two per image; each may also
+// hold a read larger than the window, mapped whole
+static const size_t windows_in_use = 8;
+static const size_t min_window = 1024 * 1024;
+
+// split the memory limit between the mappings and the heap, leaving
+// the former in limit, and pick the window size and the external sort
+// if the images do not fit; false if the limit is too small for them
+static bool apply_memory_limit(size_t& limit, size_t& window,
+		size_t& sort_memory, const char* source_file,
+		const char* target_file)
 {
-	const squashfs::super_block& sb = f.read<squashfs::super_block>();
-
-	if (sb.s_magic != squashfs::magic)
-		throw std::runtime_error(
-				"File is not a valid SquashFS image (no magic).");
-	if (sb.s_major != 4 || sb.s_minor != 0)
-		throw std::runtime_error("File is not SquashFS 4.0");
+	size_t map_limit = limit / 2;
+	struct stat st;
+	size_t total = 0;
 
-	if (!block_size)
-		block_size = sb.block_size;
-	else if (block_size != sb.block_size)
-		throw std::runtime_error("Input files have different block sizes");
+	if (stat(source_file, &st) == 0)
+		total += st.st_size;
+	if (stat(target_file, &st) == 0)
+		total += st.st_size;
 
-	switch (sb.compression)
+	if (!window && total > map_limit)
 	{
-		case squashfs::compression::lzo:
-#ifdef ENABLE_LZO
-			if (!c)
-				c = new LZOCompressor();
-			else if (typeid(*c) != typeid(LZOCompressor))
-				throw std::runtime_error("The two files use different compressors");
-#else
-			throw std::runtime_error("LZO compression support disabled at build time");
-#endif
-			break;
-		case squashfs::compression::lz4:
-#ifdef ENABLE_LZ4
-			if (!c)
-				c = new LZ4Compressor();
-			else if (typeid(*c) != typeid(LZ4Compressor))
-				throw std::runtime_error("The two files use different compressors");
-#else
-			throw std::runtime_error("LZ4 compression support disabled at build time");
-#endif
-			break;
-		default:
-			throw std::runtime_error("Unsupported compression algorithm.");
-	}
-
-	MetadataReader coptsr(f, sizeof(sb), *c);
-	c->setup(sb.flags & squashfs::flags::compression_options
-			? &coptsr : 0);
-	coptsr.block_num();
-
-	std::list<struct compressed_block>
-		compressed_metadata_blocks,
-		compressed_data_blocks;
-
-	std::cerr << "Reading inodes..." << std::endl;
-
-	InodeReader ir(f, sb, *c);
-
-	for (uint32_t i = 0; i < sb.inodes; ++i)
-	{
-		union squashfs::inode::inode& in = ir.read();
-
-		if (in.as_base.inode_type == squashfs::inode::type::reg
-				|| in.as_base.inode_type == squashfs::inode::type::lreg)
+		window = map_limit / windows_in_use;
+		if (window < min_window)
 		{
-			uint32_t pos;
-			uint32_t block_count;
-			le32* block_list;
-
-			if (in.as_base.inode_type == squashfs::inode::type::reg)
-			{
-				pos = in.as_reg.start_block;
-				block_count = in.as_reg.block_count(sb.block_size, sb.block_log);
-				block_list = in.as_reg.block_list();
-			}
-			else
-			{
-				pos = in.as_lreg.start_block;
-				block_count = in.as_lreg.block_count(sb.block_size, sb.block_log);
-				block_list = in.as_lreg.block_list();
-			}
-
-			for (uint32_t j = 0; j < block_count; ++j)
-			{
-				if (block_list[j] & squashfs::block_size::uncompressed)
-				{
-					// seek over the uncompressed block
-					uint32_t len = (block_list[j]
-							& ~squashfs::block_size::uncompressed);
-					assert(len != 0);
-					pos += len;
-				}
-				// if length == 0, it indicates a sparse block
-				else if (block_list[j] != 0)
-				{
-					// record the compressed block
-					struct compressed_block block;
-					block.offset = pos;
-					block.length = block_list[j];
-
-					compressed_data_blocks.push_back(block);
-					pos += block.length;
-				}
-			}
+			std::cerr << "Memory limit too small for the images, "
+				"at least " << ((2 * windows_in_use * min_window) >> 20)
+				<< " MiB needed.\n";
+			return false;
 		}
-	}
-
-	size_t block_num = ir.block_num();
-	std::cerr << "Read " << sb.inodes << " inodes in "
-		<< block_num << " blocks.\n";
-
-	// record inode blocks
+		if (window > 256 * 1024 * 1024)
+			window = 256 * 1024 * 1024;
 
-	std::cerr << "Hashing " << block_num
-		<< " inode blocks..." << std::endl;
-
-	MetadataBlockReader mir(f, sb.inode_table_start, *c);
-	for (size_t i = 0; i < block_num; ++i)
-	{
-		const void* data;
-		size_t pos;
-		size_t length;
-		bool compressed;
-
-		mir.read_input_block(&data, &pos, &length, &compressed);
-		assert(length != 0);
-
-		if (compressed)
-		{
-			struct compressed_block block;
-			block.offset = pos;
-			block.length = length;
-			block.hash = murmurhash3(data, length, 0);
-
-			compressed_metadata_blocks.push_back(block);
-		}
+		std::cerr << "Images exceed the memory limit, mapping them in "
+			<< (window >> 20) << " MiB windows.\n";
 	}
 
-	// fragments
-	std::cerr << "Reading fragment table..." << std::endl;
-
-	FragmentTableReader fr(f, sb, *c);
-
-	for (uint32_t i = 0; i < sb.fragments; ++i)
+	if (!sort_memory && total > map_limit)
 	{
-		const struct squashfs::fragment_entry& fe = fr.read();
-		assert(fe.size != 0);
-
-		if (!(fe.size & squashfs::block_size::uncompressed))
-		{
-			struct compressed_block block;
-			block.offset = fe.start_block;
-			block.length = fe.size;
-
-			compressed_data_blocks.push_back(block);
-		}
+		// the block tables of both images, sorted concurrently,
+		// next to the I/O buffers
+		sort_memory = (limit - map_limit) / 8;
+		if (sort_memory < 1024 * 1024)
+			sort_memory = 1024 * 1024;
+
+		std::cerr << "Keeping the block tables on disk, sorting them in "
+			<< (sort_memory >> 20) << " MiB.\n";
 	}
 
-	block_num = fr.block_num();
-	std::cerr << "Read " << sb.fragments << " fragments in "
-		<< block_num << " blocks.\n";
-
-	// record fragment table
+	// only the mappings are counted by the session; the heap is kept
+	// to the rest by the window and the sort memory
+	limit = map_limit;
+	return true;
+}
 
-	std::cerr << "Hashing " << block_num
-		<< " fragment table blocks..." << std::endl;
+// parse comma-separated key=value settings; secondary keeps the name
+static void parse_encoder(const char* spec, struct sqdelta_encoder& enc,
+		std::string& secondary)
+{
+	std::string s(spec);
+	size_t pos = 0;
 
-	MetadataBlockReader mfr(f, fr.start_offset, *c);
-	for (size_t i = 0; i < block_num; ++i)
+	while (pos <= s.size())
 	{
-		const void* data;
-		size_t pos;
-		size_t length;
-		bool compressed;
+		size_t end = s.find(',', pos);
+		if (end == std::string::npos)
+			end = s.size();
 
-		mir.read_input_block(&data, &pos, &length, &compressed);
+		std::string item = s.substr(pos, end - pos);
+		size_t eq = item.find('=');
+		if (eq == std::string::npos)
+			throw std::invalid_argument("Invalid encoder setting");
 
-		if (compressed)
+		std::string key = item.substr(0, eq);
+		std::string value = item.substr(eq + 1);
+
+		if (key == "level")
 		{
-			struct compressed_block block;
-			block.offset = pos;
-			block.length = length;
-			block.hash = murmurhash3(data, length, 0);
+			char* vend;
+			long level = strtol(value.c_str(), &vend, 10);
 
-			compressed_metadata_blocks.push_back(block);
+			if (value.empty() || *vend || level < 0 || level > 9)
+				throw std::invalid_argument("Invalid encoder level");
+			enc.level = level;
 		}
-	}
-
-	// sort by offset to use sequential reads
-	compressed_data_blocks.sort(sort_by_offset);
-
-	std::cerr << "Hashing " << compressed_data_blocks.size()
-		<< " data blocks..." << std::endl;
-	MMAPFile hf(f);
-
-	// record the checksums and perform initial deduplication
-	for (std::list<struct compressed_block>::iterator
-			i = compressed_data_blocks.begin(),
-			j = compressed_data_blocks.end();
-			i != compressed_data_blocks.end();)
-	{
-		// duplicates will be adjacent after sorting
-		if ((*i).offset == ((*j).offset))
+		else if (key == "secondary")
 		{
-			assert((*i).length == (*j).length);
-			i = compressed_data_blocks.erase(i);
-			continue;
+			parse_secondary_compressor(value.c_str());
+			secondary = value;
+			enc.secondary = secondary.c_str();
 		}
+		else if (key == "source-window")
+			enc.source_window = parse_size(value.c_str());
+		else if (key == "input-window")
+			enc.input_window = parse_size(value.c_str());
+		else
+			throw std::invalid_argument("Invalid encoder setting");
 
-		hf.seek((*i).offset, std::ios::beg);
-		(*i).hash = murmurhash3(hf.read_array<uint8_t>((*i).length),
-				(*i).length, 0);
-		j = i++;
+		pos = end + 1;
 	}
-
-	compressed_data_blocks.splice(compressed_data_blocks.end(),
-			compressed_metadata_blocks);
-
-	std::cerr << "Total: " << compressed_data_blocks.size()
-		<< " compressed blocks." << std::endl;
-
-	return compressed_data_blocks;
 }
 
-void write_unpacked_file(SparseFileWriter& outf, MMAPFile& inf,
-		std::list<struct compressed_block>& cb, Compressor& c,
-		size_t block_size)
+static void print_estimate(std::ostream& out,
+		const struct sqdelta_estimate& est)
 {
-	size_t prev_offset = 0;
-	inf.seek(0, std::ios::beg);
-
-	for (std::list<struct compressed_block>::iterator i = cb.begin();
-			i != cb.end(); ++i)
-	{
-		assert((*i).offset >= prev_offset);
-
-		size_t pre_length = (*i).offset - prev_offset;
-		prev_offset = (*i).offset + (*i).length;
+	out << "Unique blocks: " << est.source_unique << " in source, "
+		<< est.target_unique << " in target, " << est.sampled
+		<< " sampled.\n"
+		<< "Estimated patch size: " << est.patch_size << " bytes"
+		<< " (95% interval: " << est.patch_size_low << " to "
+		<< est.patch_size_high << ")\n"
+		<< "Target image size: " << est.target_size << " bytes ("
+		<< (est.target_size
+				? est.patch_size * 100 / est.target_size : 0)
+		<< "% for the patch)\n";
+}
 
-		// first, copy the data preceeding compressed block
-		outf.write(inf.read_array<char>(pre_length), pre_length);
+static void print_message(void*, const char* text)
+{
+	// the images are analysed in parallel
+	static std::mutex lock;
+	std::lock_guard<std::mutex> guard(lock);
 
-		// then, seek through the block
-		inf.seek((*i).length);
-		outf.write_sparse((*i).length);
-	}
+	std::cerr << text << std::endl;
+}
 
-	// write the last block
-	outf.write(inf.read_array<char>(inf.getlen() - prev_offset),
-			inf.getlen() - prev_offset);
+int main(int argc, char* argv[])
+{
+	const char* trace_file = 0;
+	int map_flags = 0;
+	size_t readahead = MMAPFile::default_readahead;
+	size_t memory_limit = 0;
+	size_t window = 0;
+	size_t sort_memory = 0;
+	bool preallocate = false;
+	bool print_stats = false;
+	enum sqdelta_io_engine io_engine = SQDELTA_IO_DEFAULT;
+	const char* socket_path = 0;
+	unsigned jobs = 0;
+	size_t cache_size = 1024 * 1024 * 1024;
+	double estimate_fraction = 0;
+	const char* report_file = 0;
+	size_t report_top = 20;
+	bool pair_similar = false;
+	bool target_digest = false;
+	bool dedupe = false;
+	bool normalise = false;
+	bool per_file = false;
+	double deadline = 0;
+	const char* work_dir = 0;
+	struct sqdelta_encoder encoder = { -1, 0, 0, 0, 0 };
+	std::string secondary;
+	int opt;
 
-	char* buf = new char[block_size];
 	try
 	{
-		for (std::list<struct compressed_block>::iterator i = cb.begin();
-				i != cb.end(); ++i)
+		while ((opt = getopt_long(argc, argv, "t:PHr:m:w:ase:x:S:j:C:E:R:T:pdnFX:b:L:W:Dh", long_opts, 0)) != -1)
 		{
-			size_t unc_length;
+			switch (opt)
+			{
+				case 't':
+					trace_file = optarg;
+					break;
+				case 'P':
+					map_flags |= mmap_flags::populate;
+					break;
+				case 'H':
+					map_flags |= mmap_flags::huge_pages;
+					break;
+				case 'r':
+					readahead = parse_size(optarg);
+					break;
+				case 'm':
+					memory_limit = parse_size(optarg);
+					break;
+				case 'w':
+					window = parse_size(optarg);
+					break;
+				case 'a':
+					preallocate = true;
+					break;
+				case 's':
+					print_stats = true;
+					break;
+				case 'e':
+					if (!strcmp(optarg, "mmap"))
+						io_engine = SQDELTA_IO_MMAP;
+					else if (!strcmp(optarg, "uring"))
+						io_engine = SQDELTA_IO_URING;
+					else
+						throw std::invalid_argument("Invalid I/O engine");
+					break;
+				case 'x':
+					sort_memory = parse_size(optarg);
+					break;
+				case 'S':
+					socket_path = optarg;
+					break;
+				case 'j':
+					jobs = parse_size(optarg);
+					break;
+				case 'C':
+					cache_size = parse_size(optarg);
+					break;
+				case 'E':
+				{
+					char* end;
+
+					estimate_fraction = strtod(optarg, &end);
+					if (*end || !(estimate_fraction > 0
+								&& estimate_fraction <= 1))
+						throw std::invalid_argument("Invalid fraction");
+					break;
+				}
+				case 'R':
+					report_file = optarg;
+					break;
+				case 'T':
+					report_top = parse_size(optarg);
+					break;
+				case 'p':
+					pair_similar = true;
+					break;
+				case 'd':
+					dedupe = true;
+					break;
+				case 'n':
+					normalise = true;
+					break;
+				case 'F':
+					per_file = true;
+					break;
+				case 'D':
+					target_digest = true;
+					break;
+				case 'X':
+					parse_encoder(optarg, encoder, secondary);
+					break;
+				case 'b':
+				{
+					char* end;
 
-			inf.seek((*i).offset, std::ios::beg);
-			unc_length = c.decompress(buf, inf.read_array<char>((*i).length),
-					(*i).length, block_size);
+					encoder.time_budget = strtod(optarg, &end);
+					if (*end || !(encoder.time_budget > 0))
+						throw std::invalid_argument("Invalid time budget");
+					break;
+				}
+				case 'W':
+					work_dir = optarg;
+					break;
+				case 'L':
+				{
+					char* end;
 
-			(*i).uncompressed_length = unc_length;
-			outf.write(buf, unc_length);
+					deadline = strtod(optarg, &end);
+					if (*end || !(deadline > 0))
+						throw std::invalid_argument("Invalid deadline");
+					break;
+				}
+				case 'h':
+					print_usage(argv[0]);
+					return 0;
+				default:
+					print_usage(argv[0]);
+					return 1;
+			}
 		}
 	}
-	catch (std::exception& e)
+	catch (std::invalid_argument& e)
 	{
-		delete[] buf;
-		throw;
+		std::cerr << e.what() << ": " << optarg << "\n";
+		return 1;
 	}
-	delete[] buf;
-}
-
-void write_block_list(SparseFileWriter& outf, sqdelta_header h,
-		std::list<struct compressed_block>& cb, bool at_end = true)
-{
-	// store the block count in header
-	h.block_count = htonl(cb.size());
-
-	if (!at_end)
-		outf.write<struct sqdelta_header>(h);
 
-	for (std::list<struct compressed_block>::iterator i = cb.begin();
-			i != cb.end(); ++i)
+	// the images and the patch, as far as the mode takes them
+	int positional = socket_path ? 0
+		: estimate_fraction || report_file ? 2 : 3;
+	if (argc - optind != positional)
 	{
-		struct serialized_compressed_block b;
+		print_usage(argv[0]);
+		return 1;
+	}
 
-		b.offset = htonl((*i).offset);
-		b.length = htonl((*i).length);
-		b.uncompressed_length = htonl((*i).uncompressed_length);
+	const char* source_file = positional > 0 ? argv[optind] : 0;
+	const char* target_file = positional > 1 ? argv[optind + 1] : 0;
+	const char* patch_file = positional > 2 ? argv[optind + 2] : 0;
 
-		outf.write<struct serialized_compressed_block>(b);
+	// counted from the start, the served requests have none
+	if (deadline && socket_path)
+	{
+		std::cerr << "The deadline does not apply to --serve.\n";
+		return 1;
+	}
+	// the served images stay analysed in memory instead
+	if (work_dir && socket_path)
+	{
+		std::cerr << "The work directory does not apply to --serve.\n";
+		return 1;
 	}
 
-	if (at_end)
-		outf.write<struct sqdelta_header>(h);
-}
+	// a single image can come from stdin, e.g. decompressed on the fly
+	if (source_file && target_file && !strcmp(source_file, "-")
+			&& !strcmp(target_file, "-"))
+	{
+		std::cerr << "Only one of the images can be read from stdin.\n";
+		return 1;
+	}
+	if (source_file && !strcmp(source_file, "-"))
+		source_file = "/dev/stdin";
+	if (target_file && !strcmp(target_file, "-"))
+		target_file = "/dev/stdin";
 
-int main(int argc, char* argv[])
-{
-	if (argc < 4)
+	if (patch_file && !strcmp(patch_file, "-") && isatty(STDOUT_FILENO)
+			&& !estimate_fraction && !report_file && !socket_path)
 	{
-		std::cerr << "Usage: " << argv[0] << " <source> <target> <patch-output>\n";
+		std::cerr << "Refusing to write the patch to a terminal.\n";
 		return 1;
 	}
 
-	const char* source_file = argv[1];
-	const char* target_file = argv[2];
-	const char* patch_file = argv[3];
+	// the served images are not known upfront
+	if (memory_limit && !socket_path && !apply_memory_limit(memory_limit,
+				window, sort_memory, source_file, target_file))
+		return 1;
 
 	try
 	{
-		MMAPFile source_f, target_f;
-
-		std::list<struct compressed_block> source_blocks;
-		std::list<struct compressed_block> target_blocks;
-
-		Compressor* c = 0;
-		size_t block_size = 0;
-
-		try
-		{
-			source_f.open(source_file);
-			std::cerr << "Source: " << source_file << "\n";
-			source_blocks = get_blocks(source_f, c, block_size);
-		}
-		catch (IOError& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat file: " << source_file
-				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			if (c)
-				delete c;
-			return 1;
-		}
-		catch (std::exception& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat file: " << source_file << "\n";
-			if (c)
-				delete c;
-			return 1;
-		}
-
-		std::cerr << "\n";
-
-		try
-		{
-			target_f.open(target_file);
-			std::cerr << "Target: " << target_file << "\n";
-			target_blocks = get_blocks(target_f, c, block_size);
-		}
-		catch (IOError& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat file: " << source_file
-				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			delete c;
-			return 1;
-		}
-		catch (std::exception& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat file: " << source_file << "\n";
-			delete c;
-			return 1;
-		}
-
-		std::cerr << "\n";
-
-		source_blocks.sort(sort_by_len_hash);
-		target_blocks.sort(sort_by_len_hash);
-
-		for (std::list<struct compressed_block>::iterator
-				i = source_blocks.begin(),
-				j = target_blocks.begin();
-				i != source_blocks.end() && j != target_blocks.end();)
+		if (trace_file)
+			tracer.open(trace_file);
+
+		struct sqdelta_options opts;
+		sqdelta_options_init(&opts);
+		opts.populate = map_flags & mmap_flags::populate;
+		opts.huge_pages = map_flags & mmap_flags::huge_pages;
+		opts.readahead = readahead;
+		opts.window = window;
+		opts.preallocate = preallocate;
+		opts.io_engine = io_engine;
+		opts.memory_limit = memory_limit;
+		opts.sort_memory = sort_memory;
+		opts.pair_similar = pair_similar;
+		opts.target_digest = target_digest;
+		opts.dedupe = dedupe;
+		opts.normalise_metadata = normalise;
+		opts.per_file = per_file;
+		opts.deadline = deadline;
+		opts.work_dir = work_dir;
+		opts.encoder = encoder;
+
+		struct sqdelta_callbacks callbacks;
+		callbacks.user = 0;
+		callbacks.message = print_message;
+		callbacks.progress = 0;
+
+		DeltaSession session(&opts);
+
+		if (socket_path)
 		{
-			// seek until we find duplicates
-			if ((*i).length < (*j).length)
-				++i;
-			else if ((*j).length < (*i).length)
-				++j;
-			else if ((*i).hash < (*j).hash)
-				++i;
-			else if ((*j).hash < (*i).hash)
-				++j;
-			else
-			{
-				// found a match, remove the blocks then
-				std::list<struct compressed_block>::iterator
-					i_st = i, j_st = j;
-
-				// remove consecutive duplicates as well
-				while (i != source_blocks.end()
-						&& (*i).length == (*i_st).length
-						&& (*i).hash == (*i_st).hash)
-					++i;
-				while (j != target_blocks.end()
-						&& (*j).length == (*j_st).length
-						&& (*j).hash == (*j_st).hash)
-					++j;
-
-				source_blocks.erase(i_st, i);
-				target_blocks.erase(j_st, j);
-			}
-		}
-
-		std::cerr << "Unique blocks found: "
-			<< source_blocks.size() << " in source and "
-			<< target_blocks.size() << " in target.\n";
+			// the server logs one line per request instead
+			DeltaServer server(session, cache_size, jobs);
 
-		// now we need to write the expanded files
+			server.listen(socket_path);
+			server.run();
 
-		source_blocks.sort(sort_by_offset);
-		target_blocks.sort(sort_by_offset);
-
-		// open output before changing cwd
-		SparseFileWriter patch_out;
-		patch_out.open(patch_file);
-
-		const char* tmpdir = getenv("TMPDIR");
-#ifdef _P_tmpdir
-		if (!tmpdir)
-			tmpdir = P_tmpdir;
-#endif
-		if (!tmpdir)
-			tmpdir = "/tmp";
-
-		if (chdir(tmpdir) == -1)
-		{
-			std::cerr << "Unable to chdir() into temporary directory\n"
-				"\tDirectory: " << tmpdir << "\n";
-			delete c;
-			return 1;
+			if (print_stats)
+				print_io_stats(std::cerr);
+			tracer.close();
+			return 0;
 		}
 
-		struct sqdelta_header dh;
-		dh.flags = htonl(0);
-		dh.magic = htonl(sqdelta_magic);
-		dh.compression = htonl(c->get_compression_value());
+		ThreadPool workers(jobs);
+		struct sqdelta_thread_pool c_pool = workers.c_pool();
 
-		TemporarySparseFileWriter source_temp, target_temp;
-		try
-		{
-			std::cerr << "Writing expanded source file..." << std::endl;
+		session.set_callbacks(&callbacks);
+		session.set_thread_pool(&c_pool);
 
-			c->reset();
-			source_temp.open(source_f.getlen());
-			write_unpacked_file(source_temp, source_f, source_blocks, *c,
-					block_size);
-			write_block_list(source_temp, dh, source_blocks);
-		}
-		catch (IOError& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat temporary file for source"
-				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			delete c;
-			return 1;
-		}
-		catch (std::exception& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat temporary file for source\n";
-			delete c;
-			return 1;
-		}
+		DeltaImage* source;
+		DeltaImage* target;
 
+		session.open_images(source_file, target_file, source, target);
 		try
 		{
-			std::cerr << "Writing expanded target file..." << std::endl;
-
-			c->reset();
-			target_temp.open(target_f.getlen());
-			write_unpacked_file(target_temp, target_f, target_blocks, *c,
-					block_size);
-			write_block_list(target_temp, dh, target_blocks);
-		}
-		catch (IOError& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat temporary file for target"
-				<< "\n\terrno: " << strerror(e.errno_val) << "\n";
-			delete c;
-			return 1;
-		}
-		catch (std::exception& e)
-		{
-			std::cerr << "Program terminated abnormally:\n\t"
-				<< e.what() << "\n\tat temporary file for target\n";
-			delete c;
-			return 1;
-		}
-
-		delete c;
-
-		write_block_list(patch_out, dh, source_blocks, false);
-
-		std::cerr << "Calling xdelta to generate the diff..." << std::endl;
-
-		pid_t child = fork();
-		if (child == -1)
-			throw IOError("fork() failed", errno);
-		if (child == 0)
-		{
-			try
+			if (report_file)
+				session.make_report(*source, *target, report_file,
+						&std::cout, report_top);
+			else if (estimate_fraction)
 			{
-				// in child
-				if (close(1) == -1)
-					throw IOError("Unable to close stdout", errno);
-				if (dup2(patch_out.fd, 1) == -1)
-					throw IOError("Unable to override stdout via dup2()", errno);
-
-				if (execlp("xdelta3",
-						"xdelta3", "-v", "-9", "-S", "djw",
-						"-s", source_temp.name(), target_temp.name(),
-						static_cast<const char*>(0)) == -1)
-					throw IOError("execlp() failed", errno);
-			}
-			catch (IOError& e)
-			{
-				std::cerr << "Error occured in child process:\n\t"
-					<< e.what() << "\n\terrno: " << strerror(e.errno_val) << "\n";
-				return 1;
+				struct sqdelta_estimate est;
+
+				session.make_estimate(*source, *target, estimate_fraction,
+						est);
+				print_estimate(std::cout, est);
 			}
+			else if (!strcmp(patch_file, "-"))
+				session.make_patch(*source, *target, STDOUT_FILENO);
+			else
+				session.make_patch(*source, *target, patch_file);
 		}
-		else
+		catch (DeltaError& e)
 		{
-			int status;
+			delete source;
+			delete target;
+			throw;
+		}
 
-			waitpid(child, &status, 0);
+		delete source;
+		delete target;
 
-			if (WEXITSTATUS(status) != 0)
-			{
-				std::cerr << "Child process terminate with error status\n"
-					"\treturn code: " << WEXITSTATUS(status) << "\n";
-				return 1;
-			}
-		}
+		if (print_stats)
+			print_io_stats(std::cerr);
 
-		target_temp.close();
-		source_temp.close();
-		patch_out.close();
+		tracer.close();
+	}
+	catch (DeltaError& e)
+	{
+		std::cerr << "Program terminated abnormally:\n\t" << e.what();
+		if (!e.context.empty())
+			std::cerr << "\n\tat " << e.context;
+		if (e.errno_val)
+			std::cerr << "\n\terrno: " << strerror(e.errno_val);
+		std::cerr << "\n";
+		return 1;
 	}
 	catch (IOError& e)
 	{
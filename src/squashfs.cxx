@@ -19,6 +19,7 @@ extern "C"
 
 #include "compressor.hxx"
 #include "squashfs.hxx"
+#include "trace.hxx"
 
 unsigned char* squashfs::dir_index::name()
 {
@@ -26,6 +27,12 @@ unsigned char* squashfs::dir_index::name()
 	return static_cast<unsigned char*>(voidp);
 }
 
+char* squashfs::dir_entry::name()
+{
+	void* voidp = static_cast<void*>(this + 1);
+	return static_cast<char*>(voidp);
+}
+
 char* squashfs::inode::symlink::symlink_name()
 {
 	void* voidp = static_cast<void*>(this + 1);
@@ -147,12 +154,15 @@ void MetadataBlockReader::read_input_block(const void** data,
 MetadataReader::MetadataReader(const MMAPFile& new_file,
 		size_t offset, Compressor& c)
 	: f(new_file, offset, c),
-	bufp(buf), buf_filled(0), _block_num(0)
+	bufp(buf), buf_filled(0), _block_num(0),
+	consumed(0), short_block(false), _irregular(false)
 {
 }
 
 void MetadataReader::poll_data()
 {
+	TraceSpan span("MetadataReader::poll_data");
+
 	char* writep = bufp + buf_filled;
 
 	// if we're past half buffer, shift it
@@ -167,31 +177,32 @@ void MetadataReader::poll_data()
 
 	// passing size of metadata_size since we don't expect a bigger
 	// output and we can guarantee that we have at least that much free
-	buf_filled += f.read(writep, squashfs::metadata_size);
+	size_t length = f.read(writep, squashfs::metadata_size);
+	buf_filled += length;
+
+	if (short_block)
+		_irregular = true;
+	short_block = length < squashfs::metadata_size;
 
 	++_block_num;
 }
 
-void* MetadataReader::peek(size_t length)
+size_t MetadataReader::block_num()
 {
-	while (buf_filled < length)
-		poll_data();
+	if (buf_filled > 0)
+		throw std::runtime_error("Expected metadata ended mid-block. File likely corrupted.");
 
-	return static_cast<void*>(bufp);
+	return _block_num;
 }
 
-void MetadataReader::seek(size_t length)
+uint64_t MetadataReader::tell() const
 {
-	bufp += length;
-	buf_filled -= length;
+	return consumed;
 }
 
-size_t MetadataReader::block_num()
+bool MetadataReader::irregular() const
 {
-	if (buf_filled > 0)
-		throw std::runtime_error("Expected metadata ended mid-block. File likely corrupted.");
-
-	return _block_num;
+	return _irregular;
 }
 
 InodeReader::InodeReader(const MMAPFile& new_file,
@@ -203,84 +214,106 @@ InodeReader::InodeReader(const MMAPFile& new_file,
 {
 }
 
-union squashfs::inode::inode& InodeReader::read()
+InodeReader::InodeReader(const MMAPFile& new_file,
+		const struct squashfs::super_block& sb,
+		Compressor& c, uint64_t block_offset)
+	: f(new_file, block_offset, c),
+	inode_num(0), no_inodes(sb.inodes),
+	block_size(sb.block_size), block_log(sb.block_log)
 {
-	if (inode_num >= no_inodes+1)
-		throw std::runtime_error("Trying to read past last inode");
+}
 
-	// start with inode 'header' size
-	void* ret = f.peek(sizeof(squashfs::inode::base));
-	struct squashfs::inode::base* in = static_cast<squashfs::inode::base*>(ret);
+void InodeReader::skip(size_t length)
+{
+	f.peek(length);
+	f.seek(length);
+}
 
-	// get the actual type-specific inode size
-	size_t inode_len;
-	switch (in->inode_type)
+uint64_t InodeReader::tell() const
+{
+	return f.tell();
+}
+
+bool InodeReader::irregular() const
+{
+	return f.irregular();
+}
+
+// how the size of an inode is found
+namespace inode_layout
+{
+	enum inode_layout
 	{
-		case squashfs::inode::type::dir:
-			inode_len = sizeof(struct squashfs::inode::dir);
-			break;
-		case squashfs::inode::type::reg:
-			inode_len = sizeof(struct squashfs::inode::reg);
-			break;
-		case squashfs::inode::type::symlink:
-		case squashfs::inode::type::lsymlink:
-			inode_len = sizeof(struct squashfs::inode::symlink);
-			break;
-		case squashfs::inode::type::blkdev:
-		case squashfs::inode::type::chrdev:
-			inode_len = sizeof(struct squashfs::inode::dev);
-			break;
-		case squashfs::inode::type::fifo:
-		case squashfs::inode::type::socket:
-			inode_len = sizeof(struct squashfs::inode::ipc);
-			break;
-		case squashfs::inode::type::ldir:
-			inode_len = sizeof(struct squashfs::inode::ldir);
-			break;
-		case squashfs::inode::type::lreg:
-			inode_len = sizeof(struct squashfs::inode::lreg);
-			break;
-		case squashfs::inode::type::lblkdev:
-		case squashfs::inode::type::lchrdev:
-			inode_len = sizeof(struct squashfs::inode::ldev);
-			break;
-		case squashfs::inode::type::lfifo:
-		case squashfs::inode::type::lsocket:
-			inode_len = sizeof(struct squashfs::inode::lipc);
-			break;
-	}
-	if (!in->inode_type || in->inode_type > squashfs::inode::type::lsocket)
-		throw std::runtime_error("Invalid inode type");
+		invalid,
+		fixed,
+		reg,
+		lreg,
+		symlink,
+		ldir
+	};
+}
+
+struct inode_info
+{
+	uint8_t size;
+	uint8_t layout;
+};
+
+// indexed by the inode type
+static const struct inode_info inode_table[] = {
+	{ 0, inode_layout::invalid },
+	{ sizeof(struct squashfs::inode::dir), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::reg), inode_layout::reg },
+	{ sizeof(struct squashfs::inode::symlink), inode_layout::symlink },
+	{ sizeof(struct squashfs::inode::dev), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::dev), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::ipc), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::ipc), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::ldir), inode_layout::ldir },
+	{ sizeof(struct squashfs::inode::lreg), inode_layout::lreg },
+	{ sizeof(struct squashfs::inode::symlink), inode_layout::symlink },
+	{ sizeof(struct squashfs::inode::ldev), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::ldev), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::lipc), inode_layout::fixed },
+	{ sizeof(struct squashfs::inode::lipc), inode_layout::fixed }
+};
+
+// find the size of the inode at the current position; peek(length)
+// returns the inode once length bytes are available, or NULL if they
+// are not; return 0 on an invalid type or missing data
+template <class P>
+static size_t size_inode(P peek, uint32_t block_size, uint16_t block_log,
+		uint16_t& type)
+{
+	// start with inode 'header' size
+	void* ret = peek(sizeof(squashfs::inode::base));
+	type = 0;
+	if (!ret)
+		return 0;
+	type = static_cast<squashfs::inode::base*>(ret)->inode_type;
 
-	ret = f.peek(inode_len);
-	in = static_cast<squashfs::inode::base*>(ret);
+	if (!type || type >= sizeof(inode_table) / sizeof(*inode_table))
+		return 0;
+
+	// get the actual type-specific inode size
+	const struct inode_info& info = inode_table[type];
+	size_t inode_len = info.size;
+	if (!(ret = peek(inode_len)))
+		return 0;
 
 	// now consider the inodes with dynamic sizes
-	switch (in->inode_type)
+	switch (info.layout)
 	{
-		case squashfs::inode::type::reg:
-			{
-				struct squashfs::inode::reg* in2 =
-					static_cast<struct squashfs::inode::reg*>(ret);
-				inode_len = in2->inode_size(block_size, block_log);
-				break;
-			}
-		case squashfs::inode::type::symlink:
-		case squashfs::inode::type::lsymlink:
-			{
-				struct squashfs::inode::symlink* in2 =
-					static_cast<struct squashfs::inode::symlink*>(ret);
-				inode_len = in2->inode_size();
-				break;
-			}
-		case squashfs::inode::type::lreg:
-			{
-				struct squashfs::inode::lreg* in2 =
-					static_cast<struct squashfs::inode::lreg*>(ret);
-				inode_len = in2->inode_size(block_size, block_log);
-				break;
-			}
-		case squashfs::inode::type::ldir:
+		case inode_layout::reg:
+			return static_cast<struct squashfs::inode::reg*>(ret)
+				->inode_size(block_size, block_log);
+		case inode_layout::lreg:
+			return static_cast<struct squashfs::inode::lreg*>(ret)
+				->inode_size(block_size, block_log);
+		case inode_layout::symlink:
+			return static_cast<struct squashfs::inode::symlink*>(ret)
+				->inode_size();
+		case inode_layout::ldir:
 			{
 				struct squashfs::inode::ldir* in2 =
 					static_cast<struct squashfs::inode::ldir*>(ret);
@@ -290,41 +323,186 @@ union squashfs::inode::inode& InodeReader::read()
 				// but they will be at least sizeof(dir_index) long,
 				// so we can at least start by reading that much.
 				inode_len += in2->i_count * sizeof(struct squashfs::dir_index);
-				break;
+				if (!(ret = peek(inode_len)))
+					return 0;
+				in2 = static_cast<struct squashfs::inode::ldir*>(ret);
+
+				// continue scanning dir indexes
+				size_t offset = sizeof(struct squashfs::inode::ldir);
+				for (int i = 0; i < in2->i_count; ++i)
+				{
+					char* charp = static_cast<char*>(ret) + offset;
+					void* voidp = static_cast<void*>(charp);
+					struct squashfs::dir_index* idx
+						= static_cast<struct squashfs::dir_index*>(voidp);
+
+					// size is length-1... for some smart reason
+					inode_len += idx->size + 1;
+					offset += idx->size + 1 + sizeof(struct squashfs::dir_index);
+
+					if (!(ret = peek(inode_len)))
+						return 0;
+					in2 = static_cast<struct squashfs::inode::ldir*>(ret);
+				}
 			}
 	}
 
-	ret = f.peek(inode_len);
-	in = static_cast<squashfs::inode::base*>(ret);
+	return inode_len;
+}
+
+void* InodeReader::read_inode(uint16_t& type)
+{
+	if (inode_num >= no_inodes+1)
+		throw std::runtime_error("Trying to read past last inode");
+
+	size_t inode_len = size_inode(
+			[this](size_t length) { return f.peek(length); },
+			block_size, block_log, type);
+	if (!inode_len)
+		throw std::runtime_error("Invalid inode type");
+
+	void* ret = f.peek(inode_len);
+
+	// seek towards the next inode
+	f.seek(inode_len);
+	++inode_num;
+
+	return ret;
+}
+
+// whether a valid image could have this inode, used to resync
+// on the inode boundaries
+static bool plausible_inode(const void* data, uint16_t type,
+		const struct squashfs::super_block& sb)
+{
+	const struct squashfs::inode::base* in
+		= static_cast<const struct squashfs::inode::base*>(data);
+
+	// only the permission bits are stored
+	if (in->mode & ~07777)
+		return false;
+	if (in->inode_number == 0 || in->inode_number > sb.inodes)
+		return false;
+
+	if (type == squashfs::inode::type::reg)
+	{
+		const struct squashfs::inode::reg* reg
+			= static_cast<const struct squashfs::inode::reg*>(data);
+
+		return reg->start_block < sb.bytes_used
+			&& (reg->fragment == squashfs::invalid_frag
+					|| reg->fragment < sb.fragments);
+	}
+	else if (type == squashfs::inode::type::lreg)
+	{
+		const struct squashfs::inode::lreg* lreg
+			= static_cast<const struct squashfs::inode::lreg*>(data);
+
+		return lreg->start_block < sb.bytes_used
+			&& (lreg->fragment == squashfs::invalid_frag
+					|| lreg->fragment < sb.fragments);
+	}
+
+	return true;
+}
 
-	if (in->inode_type == squashfs::inode::type::ldir)
+size_t InodeReader::find_inode(const void* data, size_t length,
+		size_t search, const struct squashfs::super_block& sb)
+{
+	// a chain this long is trusted, a shorter one only if it reaches
+	// the end of the data
+	const int min_chain = 4;
+	const char* buf = static_cast<const char*>(data);
+	size_t fallback = search;
+
+	for (size_t start = 0; start < search && start < length; ++start)
 	{
-		// continue scanning dir indexes
-		struct squashfs::inode::ldir* in2 =
-			static_cast<struct squashfs::inode::ldir*>(ret);
+		size_t pos = start;
+		uint32_t prev_number = 0;
+		bool monotonic = true;
+		int chain;
 
-		size_t offset = sizeof(struct squashfs::inode::ldir);
-		for (int i = 0; i < in2->i_count; ++i)
+		for (chain = 0; chain < min_chain; ++chain)
 		{
-			char* charp = static_cast<char*>(ret) + offset;
-			void* voidp = static_cast<void*>(charp);
-			struct squashfs::dir_index* idx
-				= static_cast<struct squashfs::dir_index*>(voidp);
+			uint16_t type;
+			size_t inode_len = size_inode(
+					[&](size_t n) -> void* {
+						if (pos + n > length)
+							return 0;
+						return const_cast<char*>(buf + pos);
+					}, sb.block_size, sb.block_log, type);
+
+			if (!inode_len)
+			{
+				// an invalid type, or the data ends within the inode
+				if (pos + sizeof(squashfs::inode::base) <= length
+						&& (!type || type >= sizeof(inode_table)
+							/ sizeof(*inode_table)))
+					chain = -1;
+				break;
+			}
+			if (!plausible_inode(buf + pos, type, sb))
+			{
+				chain = -1;
+				break;
+			}
 
-			// size is length-1... for some smart reason
-			inode_len += idx->size + 1;
-			offset += idx->size + 1 + sizeof(struct squashfs::dir_index);
+			// mksquashfs numbers the inodes in the table order
+			uint32_t number = reinterpret_cast<const squashfs::inode::base*>(
+					buf + pos)->inode_number;
+			if (number <= prev_number)
+				monotonic = false;
+			prev_number = number;
 
-			ret = f.peek(inode_len);
-			in2 = static_cast<struct squashfs::inode::ldir*>(ret);
+			pos += inode_len;
 		}
+
+		if (chain <= 0)
+			continue;
+		if (monotonic)
+			return start;
+		// keep looking for a better chain
+		if (fallback == search)
+			fallback = start;
 	}
 
-	// seek towards the next inode
-	f.seek(inode_len);
-	++inode_num;
+	return fallback;
+}
 
-	return *static_cast<union squashfs::inode::inode*>(ret);
+union squashfs::inode::inode& InodeReader::read()
+{
+	uint16_t type;
+
+	return *static_cast<union squashfs::inode::inode*>(read_inode(type));
+}
+
+bool InodeReader::read_file(struct squashfs::file_blocks& fb)
+{
+	uint16_t type;
+	void* in = read_inode(type);
+
+	if (type == squashfs::inode::type::reg)
+	{
+		struct squashfs::inode::reg* reg
+			= static_cast<struct squashfs::inode::reg*>(in);
+
+		fb.start_block = reg->start_block;
+		fb.block_count = reg->block_count(block_size, block_log);
+		fb.block_list = reg->block_list();
+		return true;
+	}
+	else if (type == squashfs::inode::type::lreg)
+	{
+		struct squashfs::inode::lreg* lreg
+			= static_cast<struct squashfs::inode::lreg*>(in);
+
+		fb.start_block = lreg->start_block;
+		fb.block_count = lreg->block_count(block_size, block_log);
+		fb.block_list = lreg->block_list();
+		return true;
+	}
+
+	return false;
 }
 
 size_t InodeReader::block_num()
@@ -332,6 +510,90 @@ size_t InodeReader::block_num()
 	return f.block_num();
 }
 
+DirectoryReader::DirectoryReader(const MMAPFile& new_file,
+		const struct squashfs::super_block& sb, Compressor& c,
+		uint32_t start_block, uint16_t offset, uint32_t file_size)
+	: f(new_file, sb.directory_table_start + start_block, c),
+	// the size includes the . and .. entries, which are not stored
+	left(file_size > 3 ? file_size - 3 : 0),
+	entries_left(0), base_inode(0)
+{
+	f.peek(offset);
+	f.seek(offset);
+}
+
+bool DirectoryReader::next(uint32_t& inode_number, std::string& name)
+{
+	if (entries_left == 0)
+	{
+		if (left < sizeof(squashfs::dir_header))
+			return false;
+
+		const struct squashfs::dir_header& h
+			= f.read<squashfs::dir_header>();
+		left -= sizeof(h);
+		entries_left = h.count + 1;
+		base_inode = h.inode_number;
+	}
+
+	if (left < sizeof(squashfs::dir_entry))
+		throw std::runtime_error("Directory listing truncated");
+
+	struct squashfs::dir_entry* e = static_cast<struct squashfs::dir_entry*>(
+			f.peek(sizeof(squashfs::dir_entry)));
+	size_t entry_len = sizeof(*e) + e->size + 1;
+
+	if (left < entry_len)
+		throw std::runtime_error("Directory listing truncated");
+
+	e = static_cast<struct squashfs::dir_entry*>(f.peek(entry_len));
+	inode_number = base_inode + static_cast<int16_t>(
+			static_cast<uint16_t>(e->inode_offset));
+	name.assign(e->name(), e->size + 1);
+
+	f.seek(entry_len);
+	left -= entry_len;
+	--entries_left;
+	return true;
+}
+
+// a file may be at most this deep
+static const int max_path_depth = 4096;
+
+void InodePaths::add_directory(const MMAPFile& f,
+		const struct squashfs::super_block& sb, Compressor& c,
+		uint32_t inode_number, uint32_t start_block, uint16_t offset,
+		uint32_t file_size)
+{
+	DirectoryReader dr(f, sb, c, start_block, offset, file_size);
+	uint32_t entry_inode;
+	std::string name;
+
+	while (dr.next(entry_inode, name))
+		names.insert(std::make_pair(entry_inode,
+					std::make_pair(inode_number, name)));
+}
+
+std::string InodePaths::path(uint32_t inode_number) const
+{
+	std::string ret;
+
+	for (int depth = 0; depth < max_path_depth; ++depth)
+	{
+		std::unordered_map<uint32_t, std::pair<uint32_t,
+			std::string> >::const_iterator n = names.find(inode_number);
+
+		if (n == names.end())
+			break;
+		ret = '/' + n->second.second + ret;
+		inode_number = n->second.first;
+	}
+
+	if (ret.empty())
+		ret = "/";
+	return ret;
+}
+
 static uint64_t get_fragment_table_offset(const MMAPFile& new_file,
 		const struct squashfs::super_block& sb)
 {
@@ -26,6 +26,10 @@ extern "C"
 #endif
 }
 
+#include <string>
+#include <unordered_map>
+#include <utility>
+
 #include "util.hxx"
 
 class Compressor;
@@ -239,6 +243,29 @@ namespace squashfs
 		};
 	}
 
+	// directory listings are runs of entries, each run with a header
+	struct dir_header
+	{
+		// entries - 1
+		le32 count;
+		// of the inode block, relative to the inode table
+		le32 start_block;
+		le32 inode_number;
+	};
+
+	struct dir_entry
+	{
+		le16 offset;
+		// signed, relative to the header inode_number
+		le16 inode_offset;
+		le16 type;
+		// name length - 1
+		le16 size;
+
+		//char name[0];
+		char* name();
+	};
+
 	struct fragment_entry {
 		le64 start_block;
 		le32 size;
@@ -246,6 +273,14 @@ namespace squashfs
 	};
 
 #	pragma pack(pop)
+
+	// data blocks of a regular file, as found in its inode
+	struct file_blocks
+	{
+		uint64_t start_block;
+		uint32_t block_count;
+		const le32* block_list;
+	};
 }
 
 class MetadataBlockReader
@@ -272,6 +307,11 @@ class MetadataReader
 	size_t buf_filled;
 	size_t _block_num;
 
+	uint64_t consumed;
+	// only the last block of a table may be shorter
+	bool short_block;
+	bool _irregular;
+
 	void poll_data();
 
 public:
@@ -281,10 +321,28 @@ public:
 	template <class T>
 	const T& read();
 
-	void* peek(size_t length);
-	void seek(size_t length);
+	// inline, the inode reader peeks a few times per inode
+	void* peek(size_t length)
+	{
+		while (buf_filled < length)
+			poll_data();
+
+		return static_cast<void*>(bufp);
+	}
+
+	void seek(size_t length)
+	{
+		bufp += length;
+		buf_filled -= length;
+		consumed += length;
+	}
 
 	size_t block_num();
+	// uncompressed bytes consumed so far
+	uint64_t tell() const;
+	// whether a short block was followed by another one, i.e. the
+	// positions are not block number * metadata_size + offset
+	bool irregular() const;
 };
 
 template <class T>
@@ -305,16 +363,73 @@ class InodeReader
 	uint32_t block_size;
 	uint16_t block_log;
 
+	void* read_inode(uint16_t& type);
+
 public:
 	InodeReader(const MMAPFile& new_file,
 		const struct squashfs::super_block& sb,
 		Compressor& c);
+	// start at the metadata block at given file offset
+	InodeReader(const MMAPFile& new_file,
+		const struct squashfs::super_block& sb,
+		Compressor& c, uint64_t block_offset);
+
+	// skip uncompressed bytes, to get to an inode within the block
+	void skip(size_t length);
+	// uncompressed bytes read since the starting block
+	uint64_t tell() const;
+	bool irregular() const;
+
+	// guess where the first inode starting within the first search
+	// bytes of an uncompressed inode table fragment is, by looking for
+	// a chain of plausible inodes; return search if none found
+	static size_t find_inode(const void* data, size_t length,
+			size_t search, const struct squashfs::super_block& sb);
 
 	union squashfs::inode::inode& read();
+	// read the next inode, return true and its blocks if it is
+	// a regular file; the block list is valid until the next read
+	bool read_file(struct squashfs::file_blocks& fb);
 
 	size_t block_num();
 };
 
+// reads the listing of a directory, given the fields of its inode
+class DirectoryReader
+{
+	MetadataReader f;
+
+	size_t left;
+	uint32_t entries_left;
+	uint32_t base_inode;
+
+public:
+	DirectoryReader(const MMAPFile& new_file,
+			const struct squashfs::super_block& sb, Compressor& c,
+			uint32_t start_block, uint16_t offset, uint32_t file_size);
+
+	// return false at the end of the listing
+	bool next(uint32_t& inode_number, std::string& name);
+};
+
+// the paths of the inodes, from the directory listings
+class InodePaths
+{
+	// inode number -> (parent inode number, name)
+	std::unordered_map<uint32_t, std::pair<uint32_t, std::string> > names;
+
+public:
+	// read the listing of a directory, given the fields of its inode;
+	// hard links keep the first name
+	void add_directory(const MMAPFile& f,
+			const struct squashfs::super_block& sb, Compressor& c,
+			uint32_t inode_number, uint32_t start_block, uint16_t offset,
+			uint32_t file_size);
+
+	// "/" for the root and the inodes not found in any directory
+	std::string path(uint32_t inode_number) const;
+};
+
 class FragmentTableReader
 {
 	MetadataReader f;
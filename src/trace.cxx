@@ -0,0 +1,169 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <cerrno>
+#include <ctime>
+
+extern "C"
+{
+#	include <sys/syscall.h>
+#	include <unistd.h>
+}
+
+#include "trace.hxx"
+#include "util.hxx"
+
+Tracer tracer;
+
+static thread_local struct trace_buffer* thread_buffer = 0;
+static thread_local unsigned thread_generation = 0;
+
+Tracer::Tracer()
+	: f(0), owner_pid(0), first_event(true), epoch(0), enabled(false),
+	generation(0)
+{
+}
+
+Tracer::~Tracer()
+{
+	try
+	{
+		close();
+	}
+	catch (std::exception& e)
+	{
+	}
+
+	for (std::list<struct trace_buffer*>::iterator i = retired.begin();
+			i != retired.end(); ++i)
+		delete *i;
+}
+
+void Tracer::open(const char* path)
+{
+	f = fopen(path, "w");
+	if (!f)
+		throw IOError("Unable to create the trace file", errno);
+
+	// JSON array format, the closing bracket is optional
+	// so the trace stays usable if we terminate abnormally
+	fputs("[\n", f);
+
+	owner_pid = getpid();
+	epoch = now();
+	++generation;
+	enabled = true;
+}
+
+void Tracer::close()
+{
+	std::list<struct trace_buffer*> closing;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		enabled = false;
+		closing.swap(buffers);
+	}
+
+	// the threads may be recording still, the buffer lock goes first
+	for (std::list<struct trace_buffer*>::iterator i = closing.begin();
+			i != closing.end(); ++i)
+	{
+		std::lock_guard<std::mutex> buf_guard((*i)->lock);
+		std::lock_guard<std::mutex> guard(lock);
+
+		// forked children inherit unflushed buffers, do not duplicate them
+		if (f && owner_pid == getpid())
+			flush_buffer(*i);
+		(*i)->filled = 0;
+		(*i)->retired = true;
+		retired.push_back(*i);
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!f)
+		return;
+
+	if (owner_pid == getpid())
+	{
+		fputs("\n]\n", f);
+		if (fclose(f) == EOF)
+		{
+			f = 0;
+			throw IOError("Unable to write the trace file", errno);
+		}
+	}
+	f = 0;
+}
+
+uint64_t Tracer::now() const
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void Tracer::flush_buffer(struct trace_buffer* buf)
+{
+	for (size_t i = 0; i < buf->filled; ++i)
+	{
+		struct trace_event& ev = buf->events[i];
+
+		// Chrome uses microseconds, keep sub-us precision
+		fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%ld,"
+				"\"ts\":%.3f,\"dur\":%.3f}",
+				first_event ? "" : ",\n", ev.name,
+				static_cast<long>(owner_pid), static_cast<long>(buf->tid),
+				(ev.start - epoch) / 1000.0, ev.duration / 1000.0);
+		first_event = false;
+	}
+
+	buf->filled = 0;
+}
+
+void Tracer::record(const char* name, uint64_t start, uint64_t end)
+{
+	struct trace_buffer* buf = thread_buffer;
+	unsigned current = generation;
+
+	if (!buf || thread_generation != current)
+	{
+		buf = new trace_buffer;
+		buf->tid = syscall(SYS_gettid);
+		buf->filled = 0;
+		buf->retired = false;
+
+		std::lock_guard<std::mutex> guard(lock);
+		buffers.push_back(buf);
+		thread_buffer = buf;
+		thread_generation = current;
+	}
+
+	std::lock_guard<std::mutex> buf_guard(buf->lock);
+	if (buf->retired)
+		return;
+
+	struct trace_event& ev = buf->events[buf->filled++];
+	ev.name = name;
+	ev.start = start;
+	ev.duration = end - start;
+
+	if (buf->filled == trace_buffer::size)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (f && enabled)
+			flush_buffer(buf);
+		else
+			buf->filled = 0;
+	}
+}
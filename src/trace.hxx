@@ -0,0 +1,108 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_TRACE_HXX
+#define SDT_TRACE_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <atomic>
+#include <cstdio>
+#include <list>
+#include <mutex>
+
+extern "C"
+{
+#	include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+/**
+ * Timeline tracing in the Chrome trace-event format.
+ *
+ * Spans are recorded into per-thread buffers and flushed to the trace
+ * file in batches. When tracing is disabled, a span costs a single
+ * branch on a global flag.
+ */
+
+struct trace_event
+{
+	const char* name;
+	uint64_t start;
+	uint64_t duration;
+};
+
+struct trace_buffer
+{
+	static const size_t size = 4096;
+
+	// the owning thread appends under it, close() flushes under it
+	std::mutex lock;
+	pid_t tid;
+	size_t filled;
+	// belongs to a closed trace, the events are dropped
+	bool retired;
+	struct trace_event events[size];
+};
+
+class Tracer
+{
+	FILE* f;
+	pid_t owner_pid;
+	bool first_event;
+	uint64_t epoch;
+
+	std::mutex lock;
+	std::list<struct trace_buffer*> buffers;
+	// the buffers of the closed traces, which the threads may still
+	// hold, freed at exit
+	std::list<struct trace_buffer*> retired;
+
+	void flush_buffer(struct trace_buffer* buf);
+
+public:
+	std::atomic<bool> enabled;
+	// bumped by open(), so that the threads register new buffers
+	std::atomic<unsigned> generation;
+
+	Tracer();
+	~Tracer();
+
+	void open(const char* path);
+	void close();
+
+	uint64_t now() const;
+	void record(const char* name, uint64_t start, uint64_t end);
+};
+
+extern Tracer tracer;
+
+// scoped span, covering the lifetime of the object
+class TraceSpan
+{
+	const char* name;
+	uint64_t start;
+
+public:
+	inline TraceSpan(const char* new_name)
+		: name(new_name), start(0)
+	{
+		if (tracer.enabled)
+			start = tracer.now();
+	}
+
+	inline ~TraceSpan()
+	{
+		if (tracer.enabled && start)
+			tracer.record(name, start, tracer.now());
+	}
+};
+
+#endif /*!SDT_TRACE_HXX*/
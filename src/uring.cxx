@@ -0,0 +1,393 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+
+extern "C"
+{
+#	include <sys/mman.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#ifdef ENABLE_IO_URING
+#	include <linux/io_uring.h>
+#endif
+}
+
+#include "trace.hxx"
+#include "uring.hxx"
+#include "util.hxx"
+
+#ifdef ENABLE_IO_URING
+static bool probe_io_uring()
+{
+	IOUring probe;
+
+	return probe.setup(1);
+}
+#endif
+
+bool use_io_uring(const struct io_settings* io)
+{
+#ifdef ENABLE_IO_URING
+	if (!io || io->engine != io_engine::uring)
+		return false;
+
+	// probed once, the result does not change during the run
+	static const bool available = probe_io_uring();
+	return available;
+#else
+	return false;
+#endif
+}
+
+size_t uring_buffer_limit(const struct io_settings* io)
+{
+	const size_t default_limit = 4 * 1024 * 1024;
+	size_t limit = io ? io->budget.get_limit() / 8 : 0;
+
+	// the buffers come from the heap, take a small share of the limit
+	if (!limit || limit > default_limit)
+		limit = default_limit;
+	return limit;
+}
+
+#ifdef ENABLE_IO_URING
+
+IOUring::IOUring()
+	: ring_fd(-1), entries(0), to_submit(0), fixed_buffers(false),
+	sq_ptr(MAP_FAILED), sq_map_len(0), cq_ptr(MAP_FAILED), cq_map_len(0),
+	sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)), sqes_len(0)
+{
+}
+
+IOUring::~IOUring()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_len);
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_map_len);
+	if (sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_map_len);
+	if (ring_fd != -1)
+		close(ring_fd);
+}
+
+bool IOUring::setup(unsigned new_entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ring_fd = syscall(__NR_io_uring_setup, new_entries, &p);
+	if (ring_fd == -1)
+		return false;
+
+	// IORING_OP_READ and IORING_OP_WRITE came together with this one
+	if (!(p.features & IORING_FEAT_RW_CUR_POS))
+		return false;
+
+	sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (cq_map_len > sq_map_len)
+			sq_map_len = cq_map_len;
+		cq_map_len = sq_map_len;
+	}
+
+	sq_ptr = mmap(0, sq_map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		return false;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ptr = sq_ptr;
+	else
+	{
+		cq_ptr = mmap(0, cq_map_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			return false;
+	}
+
+	sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = static_cast<struct io_uring_sqe*>(mmap(0, sqes_len,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, IORING_OFF_SQES));
+	if (sqes == MAP_FAILED)
+		return false;
+
+	char* sq = static_cast<char*>(sq_ptr);
+	char* cq = static_cast<char*>(cq_ptr);
+
+	sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+	entries = p.sq_entries;
+	return true;
+}
+
+bool IOUring::register_buffers(const struct iovec* iov, unsigned count)
+{
+	fixed_buffers = syscall(__NR_io_uring_register, ring_fd,
+			IORING_REGISTER_BUFFERS, iov, count) == 0;
+	return fixed_buffers;
+}
+
+struct io_uring_sqe* IOUring::get_sqe()
+{
+	unsigned tail = *sq_tail;
+
+	// the queue is full, let the kernel consume it
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries)
+		submit();
+
+	struct io_uring_sqe* sqe = &sqes[tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void prep_rw(struct io_uring_sqe* sqe, int fd, const void* buf,
+		size_t length, off_t offset, uint64_t user_data)
+{
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uintptr_t>(buf);
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+}
+
+void IOUring::prep_read(int fd, void* buf, size_t length, off_t offset,
+		uint64_t user_data, int buf_index)
+{
+	struct io_uring_sqe* sqe = get_sqe();
+	unsigned tail = *sq_tail;
+
+	prep_rw(sqe, fd, buf, length, offset, user_data);
+	if (fixed_buffers && buf_index != -1)
+	{
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = buf_index;
+	}
+	else
+		sqe->opcode = IORING_OP_READ;
+
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++to_submit;
+}
+
+void IOUring::prep_write(int fd, const void* buf, size_t length, off_t offset,
+		uint64_t user_data, int buf_index)
+{
+	struct io_uring_sqe* sqe = get_sqe();
+	unsigned tail = *sq_tail;
+
+	prep_rw(sqe, fd, buf, length, offset, user_data);
+	if (fixed_buffers && buf_index != -1)
+	{
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = buf_index;
+	}
+	else
+		sqe->opcode = IORING_OP_WRITE;
+
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++to_submit;
+}
+
+void IOUring::submit()
+{
+	while (to_submit > 0)
+	{
+		++io_stats.io_uring_enter;
+		int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, 0, 0);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			throw IOError("io_uring_enter() failed", errno);
+		to_submit -= ret;
+	}
+}
+
+int IOUring::wait(uint64_t& user_data)
+{
+	while (true)
+	{
+		unsigned head = *cq_head;
+
+		if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+			int res = cqe->res;
+
+			user_data = cqe->user_data;
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+			return res;
+		}
+
+		// submit the pending entries and wait in a single call
+		++io_stats.io_uring_enter;
+		int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1,
+				IORING_ENTER_GETEVENTS, 0, 0);
+		if (ret == -1 && errno != EINTR)
+			throw IOError("io_uring_enter() failed", errno);
+		if (ret > 0)
+			to_submit -= ret;
+	}
+}
+
+UringBlockReader::UringBlockReader()
+	: fd(-1), slot_size(0), depth(0), slots(0),
+	submitted(0), consumed(0), in_flight(0)
+{
+}
+
+UringBlockReader::~UringBlockReader()
+{
+	// the kernel must not write into the slots after they are freed
+	try
+	{
+		while (in_flight > 0)
+			reap();
+	}
+	catch (std::exception& e)
+	{
+	}
+
+	free_buffer(slots, slot_size * depth);
+}
+
+bool UringBlockReader::open(int new_fd, size_t max_length,
+		const struct io_settings* io, unsigned new_depth)
+{
+	// keep the slots within a few MiB for large block sizes
+	while (new_depth > 4 && max_length * new_depth > uring_buffer_limit(io))
+		new_depth /= 2;
+
+	if (!use_io_uring(io) || !ring.setup(new_depth))
+		return false;
+
+	// fall back to mmap rather than fail with a memory limit
+	void* buf = alloc_buffer(max_length * new_depth, 4096);
+	if (!buf)
+		return false;
+
+	fd = new_fd;
+	depth = new_depth;
+	slot_size = max_length;
+	slots = static_cast<char*>(buf);
+
+	std::vector<struct iovec> iov(depth);
+	for (unsigned i = 0; i < depth; ++i)
+	{
+		iov[i].iov_base = slots + i * slot_size;
+		iov[i].iov_len = slot_size;
+	}
+	ring.register_buffers(&iov[0], depth);
+
+	slot_req.resize(depth);
+	slot_done.resize(depth);
+	return true;
+}
+
+void UringBlockReader::add(off_t offset, size_t length)
+{
+	struct request r;
+
+	if (length > slot_size)
+		throw std::runtime_error("Block larger than the io_uring slot");
+
+	r.offset = offset;
+	r.length = length;
+	requests.push_back(r);
+}
+
+void UringBlockReader::submit_slot(unsigned slot)
+{
+	struct request& r = slot_req[slot];
+	size_t skip = slot_done[slot];
+
+	ring.prep_read(fd, slots + slot * slot_size + skip, r.length - skip,
+			r.offset + skip, slot, slot);
+	++in_flight;
+}
+
+void UringBlockReader::fill()
+{
+	while (submitted < consumed + depth && !requests.empty())
+	{
+		unsigned slot = submitted % depth;
+
+		slot_req[slot] = requests.front();
+		slot_done[slot] = 0;
+		requests.pop_front();
+
+		submit_slot(slot);
+		++submitted;
+	}
+
+	ring.submit();
+}
+
+void UringBlockReader::reap()
+{
+	uint64_t slot;
+	int res = ring.wait(slot);
+
+	--in_flight;
+	if (res < 0)
+		throw IOError("io_uring read failed", -res);
+	if (res == 0)
+		throw std::runtime_error("Premature EOF while reading a block");
+
+	// short reads are resumed from where they stopped
+	slot_done[slot] += res;
+	if (slot_done[slot] < slot_req[slot].length)
+	{
+		submit_slot(slot);
+		ring.submit();
+	}
+}
+
+const void* UringBlockReader::next()
+{
+	// the previously returned slot is free to reuse now, but refill
+	// in batches to submit more reads per syscall
+	if (submitted - consumed <= depth / 2)
+		fill();
+
+	if (consumed == submitted)
+		throw std::runtime_error("No more blocks queued for reading");
+
+	unsigned slot = consumed % depth;
+	if (slot_done[slot] < slot_req[slot].length)
+	{
+		TraceSpan span("UringBlockReader::wait");
+
+		while (slot_done[slot] < slot_req[slot].length)
+			reap();
+	}
+
+	++consumed;
+	return slots + slot * slot_size;
+}
+
+#endif /*ENABLE_IO_URING*/
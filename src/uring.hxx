@@ -0,0 +1,132 @@
+/**
+ * SquashFS delta tools
+ * (c) 2014 Michał Górny
+ * Released under the terms of the 2-clause BSD license
+ */
+
+#ifndef SDT_URING_HXX
+#define SDT_URING_HXX 1
+
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+
+#include <deque>
+#include <vector>
+
+#include <cstdlib> // size_t
+
+extern "C"
+{
+#	include <sys/types.h>
+#	include <sys/uio.h>
+#ifdef HAVE_STDINT_H
+#	include <stdint.h>
+#endif
+}
+
+struct io_settings;
+
+// whether io_uring was requested in the settings, compiled in and
+// works; the library reports falling back to mmap through the session
+bool use_io_uring(const struct io_settings* io);
+// memory the engine may use for its buffers, per reader or writer
+size_t uring_buffer_limit(const struct io_settings* io);
+
+#ifdef ENABLE_IO_URING
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// minimal io_uring wrapper, using the raw syscalls
+class IOUring
+{
+	int ring_fd;
+	unsigned entries;
+	unsigned to_submit;
+	bool fixed_buffers;
+
+	void* sq_ptr;
+	size_t sq_map_len;
+	void* cq_ptr;
+	size_t cq_map_len;
+	struct io_uring_sqe* sqes;
+	size_t sqes_len;
+
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	struct io_uring_sqe* get_sqe();
+
+public:
+	IOUring();
+	~IOUring();
+
+	// returns false if io_uring is not available
+	bool setup(unsigned new_entries);
+	// returns false if the buffers could not be registered
+	// (e.g. due to RLIMIT_MEMLOCK), plain reads are used then
+	bool register_buffers(const struct iovec* iov, unsigned count);
+
+	// buf_index refers to registered buffers, -1 for plain I/O
+	void prep_read(int fd, void* buf, size_t length, off_t offset,
+			uint64_t user_data, int buf_index = -1);
+	void prep_write(int fd, const void* buf, size_t length, off_t offset,
+			uint64_t user_data, int buf_index = -1);
+
+	void submit();
+	// wait for a completion, return its result (-errno on failure)
+	int wait(uint64_t& user_data);
+};
+
+// Reads a sequence of blocks ahead of the consumer, keeping up to
+// 'depth' reads in flight in registered slot buffers.
+class UringBlockReader
+{
+	struct request
+	{
+		off_t offset;
+		size_t length;
+	};
+
+	IOUring ring;
+	int fd;
+	size_t slot_size;
+	unsigned depth;
+	char* slots;
+
+	std::deque<struct request> requests;
+	// request k is read into slot k % depth
+	std::vector<struct request> slot_req;
+	std::vector<size_t> slot_done;
+	size_t submitted;
+	size_t consumed;
+	unsigned in_flight;
+
+	void submit_slot(unsigned slot);
+	void fill();
+	void reap();
+
+public:
+	UringBlockReader();
+	~UringBlockReader();
+
+	// returns false if io_uring is not available or not selected
+	bool open(int new_fd, size_t max_length,
+			const struct io_settings* io, unsigned new_depth = 32);
+
+	// queue all the blocks before calling next()
+	void add(off_t offset, size_t length);
+	// data of the next block, valid until the following call
+	const void* next();
+};
+
+#endif /*ENABLE_IO_URING*/
+
+#endif /*!SDT_URING_HXX*/
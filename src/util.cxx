@@ -8,18 +8,27 @@
 #	include "config.h"
 #endif
 
+#include <algorithm>
+#include <vector>
+
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 
 extern "C"
 {
 #	include <sys/types.h>
+#	include <sys/ioctl.h>
+#	include <sys/uio.h>
 #	include <sys/stat.h>
 #	include <sys/mman.h>
 #	include <fcntl.h>
 #	include <unistd.h>
+#	include <linux/fs.h>
 }
 
+#include "trace.hxx"
+#include "uring.hxx"
 #include "util.hxx"
 
 IOError::IOError(const char* text, int new_errno)
@@ -28,8 +37,107 @@ IOError::IOError(const char* text, int new_errno)
 {
 }
 
+size_t parse_size(const char* str)
+{
+	char* end;
+	unsigned long long ret = strtoull(str, &end, 0);
+
+	if (end == str)
+		throw std::invalid_argument("Invalid size specified");
+
+	switch (*end)
+	{
+		case 'G':
+		case 'g':
+			ret <<= 10;
+			// fallthrough
+		case 'M':
+		case 'm':
+			ret <<= 10;
+			// fallthrough
+		case 'K':
+		case 'k':
+			ret <<= 10;
+			++end;
+			break;
+	}
+
+	if (*end != '\0')
+		throw std::invalid_argument("Invalid size specified");
+
+	return ret;
+}
+
+thread_local const struct sqdelta_allocator* buffer_allocator = 0;
+
+void* alloc_buffer(size_t size, size_t alignment)
+{
+	void* ret;
+
+	if (buffer_allocator)
+		return buffer_allocator->alloc(buffer_allocator->user, size, alignment);
+
+	if (posix_memalign(&ret, alignment, size) != 0)
+		return 0;
+	return ret;
+}
+
+void free_buffer(void* ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	if (buffer_allocator)
+		buffer_allocator->free(buffer_allocator->user, ptr, size);
+	else
+		free(ptr);
+}
+
+MemoryBudget::MemoryBudget()
+	: limit(0), used(0)
+{
+}
+
+void MemoryBudget::set_limit(size_t new_limit)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	limit = new_limit;
+}
+
+size_t MemoryBudget::get_limit() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return limit;
+}
+
+void MemoryBudget::reserve(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (limit && used + bytes > limit)
+		throw std::runtime_error("Memory limit exceeded by the image mappings");
+	used += bytes;
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	used -= bytes;
+}
+
+// io_uring is opt-in, it is slower than mmap with the images in the cache
+io_settings::io_settings()
+	: engine(io_engine::mmap)
+{
+}
+
+static const size_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+
 MMAPFile::MMAPFile()
-	: fd(-1), data(0), length(0), pos(0)
+	: fd(-1), owner(false), flags(0), io(0),
+	map(0), map_offset(0), map_length(0), own_map(false),
+	length(0), window(0), pos(0),
+	readahead(0), drop_behind(false), ra_end(0), drop_start(0)
 {
 }
 
@@ -37,8 +145,18 @@ MMAPFile::MMAPFile()
 MMAPFile::MMAPFile(const MMAPFile& ref)
 	// just copy the data necessary for read/seek
 	// but not the one needed to close/unmap
-	: fd(-1), data(ref.data), length(0), pos(ref.pos), end(ref.end)
+	: fd(ref.fd), owner(false), flags(ref.flags), io(ref.io),
+	map(0), map_offset(0), map_length(0), own_map(false),
+	length(ref.length), window(ref.window), pos(ref.pos),
+	// access hints are per-pass, so the copy starts with none
+	readahead(ref.readahead), drop_behind(false), ra_end(0), drop_start(0)
 {
+	// in windowed mode, each copy maps its own window on demand
+	if (!window)
+	{
+		map = ref.map;
+		map_length = ref.map_length;
+	}
 }
 
 MMAPFile::~MMAPFile()
@@ -46,12 +164,23 @@ MMAPFile::~MMAPFile()
 	close();
 }
 
-void MMAPFile::open(const char* path)
+void MMAPFile::open(const char* path, int new_flags, size_t new_readahead,
+		size_t new_window, struct io_settings* new_io)
 {
-	fd = ::open(path, O_RDONLY);
-	if (fd == -1)
+	int new_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (new_fd == -1)
 		throw IOError("Unable to open file", errno);
 
+	open(new_fd, new_flags, new_readahead, new_window, new_io);
+}
+
+void MMAPFile::open(int new_fd, int new_flags, size_t new_readahead,
+		size_t new_window, struct io_settings* new_io)
+{
+	fd = new_fd;
+	owner = true;
+	io = new_io;
+
 	// this also checks whether the file is seekable
 	off_t size = lseek(fd, 0, SEEK_END);
 	if (size == -1)
@@ -62,53 +191,224 @@ void MMAPFile::open(const char* path)
 
 	// size_t <- off_t
 	length = size;
+	flags = new_flags;
+	readahead = new_readahead;
+	pos = 0;
 
-	data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED)
+	// round the window to whole pages
+	window = (new_window + page_mask) & ~page_mask;
+	if (window >= length)
+		window = 0;
+
+	try
+	{
+		if (!window)
+			map_range(0, length);
+	}
+	catch (...)
 	{
 		close();
+		throw;
+	}
+}
+
+void MMAPFile::map_range(size_t offset, size_t min_length)
+{
+	size_t start = 0;
+	size_t size = length;
+
+	if (window)
+	{
+		start = offset & ~page_mask;
+		size = offset + min_length - start;
+		if (size < window)
+			size = window;
+		if (start + size > length)
+			size = length - start;
+	}
+
+	unmap();
+	if (io)
+		io->budget.reserve(size);
+
+	int mflags = MAP_SHARED;
+	if (flags & mmap_flags::populate)
+		mflags |= MAP_POPULATE;
+
+	void* data = mmap(0, size, PROT_READ, mflags, fd, start);
+	if (data == MAP_FAILED)
+	{
+		if (io)
+			io->budget.release(size);
 		throw IOError("Unable to mmap() file", errno);
 	}
 
-	pos = static_cast<char*>(data);
-	end = pos + length;
+	map = static_cast<char*>(data);
+	map_offset = start;
+	map_length = size;
+	own_map = true;
+
+#ifdef MADV_HUGEPAGE
+	// only a hint, file-backed THP may be unsupported
+	if (flags & mmap_flags::huge_pages)
+		madvise(data, size, MADV_HUGEPAGE);
+#endif
+}
+
+void MMAPFile::unmap()
+{
+	if (own_map && map)
+	{
+		int ret = ::munmap(map, map_length);
+		if (io)
+			io->budget.release(map_length);
+		if (ret == -1)
+			throw IOError("Unable to unmap file", errno);
+	}
+
+	map = 0;
+	map_offset = 0;
+	map_length = 0;
+	own_map = false;
+}
+
+void MMAPFile::hint_range(size_t start, size_t stop, int advice)
+{
+	if (stop > length)
+		stop = length;
+	if (start >= stop)
+		return;
+
+	// the hints are advisory, ignore failures
+	if (window)
+	{
+		// nothing mapped outside the window, so hint the page cache
+		if (advice == MADV_WILLNEED)
+			posix_fadvise(fd, start, stop - start, POSIX_FADV_WILLNEED);
+		return;
+	}
+
+	// madvise() needs a page-aligned start
+	start &= ~page_mask;
+	::madvise(map + start, stop - start, advice);
+}
+
+void MMAPFile::advise(access_pattern::access_pattern pattern,
+		bool new_drop_behind)
+{
+	if (fd == -1)
+		throw std::logic_error("advise() for closed file");
+
+	int advice, fadvice;
+	switch (pattern)
+	{
+		case access_pattern::sequential:
+			advice = MADV_SEQUENTIAL;
+			fadvice = POSIX_FADV_SEQUENTIAL;
+			break;
+		case access_pattern::random:
+			advice = MADV_RANDOM;
+			fadvice = POSIX_FADV_RANDOM;
+			break;
+		default:
+			advice = MADV_NORMAL;
+			fadvice = POSIX_FADV_NORMAL;
+	}
+
+	if (window)
+		posix_fadvise(fd, 0, 0, fadvice);
+	else
+		hint_range(0, length, advice);
+
+	ra_end = 0;
+	drop_start = 0;
+	drop_behind = false;
+
+	if (pattern == access_pattern::sequential && readahead > 0)
+	{
+		// unmapping the old windows already drops the pages
+		drop_behind = new_drop_behind && !window;
+		ra_end = pos;
+		drop_start = pos;
+		slide_window();
+	}
+}
+
+void MMAPFile::will_need(size_t offset, size_t length)
+{
+	hint_range(offset, offset + length, MADV_WILLNEED);
+}
+
+void MMAPFile::slide_window()
+{
+	// request the next window once we're past half of the current one
+	if (pos + readahead / 2 >= ra_end)
+	{
+		size_t start = pos > ra_end ? pos : ra_end;
+
+		hint_range(start, pos + readahead, MADV_WILLNEED);
+		ra_end = pos + readahead;
+	}
+
+	// keep one window behind the cursor, the caller may still be
+	// using the data returned by the last read
+	if (drop_behind && pos > drop_start + 2 * readahead)
+	{
+		hint_range(drop_start, pos - readahead, MADV_DONTNEED);
+		drop_start = pos - readahead;
+	}
 }
 
 void MMAPFile::close()
 {
 	bool munmap_failed = false;
 	bool close_failed = false;
+	int munmap_errno = 0;
 
-	if (data && length > 0)
+	try
 	{
-		if (::munmap(data, length) == -1)
-			munmap_failed = true;
-		data = 0;
-		length = 0;
-		pos = 0;
+		unmap();
+	}
+	catch (IOError& e)
+	{
+		munmap_failed = true;
+		munmap_errno = e.errno_val;
 	}
 
-	if (fd != -1)
+	if (owner && fd != -1)
 	{
 		if (::close(fd) == -1)
 			close_failed = true;
-		fd = -1;
 	}
+	fd = -1;
+	owner = false;
+	length = 0;
+	pos = 0;
 
 	if (munmap_failed && close_failed)
 		throw IOError("Unable to unmap and close file", errno);
 	else if (munmap_failed)
-		throw IOError("Unable to unmap file (yet it was closed)", errno);
+		throw IOError("Unable to unmap file (yet it was closed)", munmap_errno);
 	else if (close_failed)
 		throw IOError("Unable to close file", errno);
 }
 
+int MMAPFile::getfd() const
+{
+	return fd;
+}
+
+struct io_settings* MMAPFile::settings() const
+{
+	return io;
+}
+
 size_t MMAPFile::getpos() const
 {
-	if (!data)
+	if (fd == -1)
 		throw std::logic_error("getpos() for closed file");
 
-	return (pos - static_cast<char*>(data));
+	return pos;
 }
 
 size_t MMAPFile::getlen() const
@@ -116,54 +416,187 @@ size_t MMAPFile::getlen() const
 	return length;
 }
 
+size_t MMAPFile::window_size() const
+{
+	return window ? window : length;
+}
+
+size_t MMAPFile::mapped_size() const
+{
+	return own_map ? map_length : 0;
+}
+
 void MMAPFile::seek(ssize_t offset, std::ios_base::seekdir whence)
 {
-	char* newpos;
+	size_t newpos;
 
-	if (!data)
+	if (fd == -1)
 		throw std::logic_error("Seeking closed file");
 
 	switch (whence)
 	{
 		case std::ios::beg:
-			newpos = static_cast<char*>(data);
+			newpos = 0;
 			break;
 		case std::ios::cur:
 			newpos = pos;
 			break;
 		case std::ios::end:
-			newpos = end;
+			newpos = length;
 			break;
 		default:
 			throw std::logic_error("Invalid value for whence");
 	}
 
 	newpos += offset;
-	if (newpos > end)
+	if (newpos > length)
 		throw std::runtime_error("EOF while seeking");
 
 	pos = newpos;
+
+	if (ra_end)
+	{
+		// backwards jump starts a new pass
+		if (pos < drop_start)
+		{
+			ra_end = pos;
+			drop_start = pos;
+		}
+		slide_window();
+	}
 }
 
-SparseFileWriter::SparseFileWriter()
-	: offset(0), fd(-1)
+struct io_stats io_stats;
+
+void print_io_stats(std::ostream& out)
+{
+	out << "I/O syscalls: "
+		<< io_stats.write << " write, "
+		<< io_stats.writev << " writev, "
+		<< io_stats.lseek << " lseek, "
+		<< io_stats.ftruncate << " ftruncate, "
+		<< io_stats.fallocate << " fallocate,\n\t"
+		<< io_stats.reflink << " reflink, "
+		<< io_stats.copy_file_range << " copy_file_range, "
+		<< io_stats.splice << " splice, "
+		<< io_stats.vmsplice << " vmsplice, "
+		<< io_stats.io_uring_enter << " io_uring_enter\n";
+}
+
+SparseFileWriter::SparseFileWriter(const struct io_settings* new_io)
+	: offset(0), pending_hole(0),
+	out_buf(0), buf_filled(0),
+	ring(0), ring_cur(0), ring_in_flight(0), ring_moved(false),
+	written_back(0), writeback(0),
+	can_clone(true), can_copy_range(true), fs_block_size(0),
+	stream(false), is_pipe(false), io(new_io), fd(-1)
 {
 }
 
 SparseFileWriter::~SparseFileWriter()
 {
+	// unflushed data is discarded, the destructor runs on errors
+	// and in forked children as well
+#ifdef ENABLE_IO_URING
+	if (ring)
+	{
+		// but the kernel must not read the buffers after they are freed
+		try
+		{
+			while (ring_in_flight > 0)
+				reap_buffer();
+		}
+		catch (std::exception& e)
+		{
+		}
+
+		delete ring;
+		for (unsigned i = 0; i < ring_depth; ++i)
+			free_buffer(ring_bufs[i], buffer_size);
+		out_buf = 0;
+	}
+#endif
+
 	if (fd != -1)
 		::close(fd);
+	free_buffer(out_buf, buffer_size);
 }
 
 void SparseFileWriter::open(const char* path, off_t expected_size)
 {
-	fd = creat(path, 0666);
+	// keep it out of the xdelta3 children of other requests
+	fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
 	if (fd == -1)
 		throw IOError("Unable to create file", errno);
 
+	preallocate(expected_size);
+	setup_engine();
+}
+
+void SparseFileWriter::setup_engine()
+{
+#ifdef ENABLE_IO_URING
+	if (stream || !use_io_uring(io)
+			|| ring_depth * buffer_size > uring_buffer_limit(io))
+		return;
+
+	ring = new IOUring();
+	if (!ring->setup(ring_depth))
+	{
+		delete ring;
+		ring = 0;
+		return;
+	}
+
+	struct iovec iov[ring_depth];
+	for (unsigned i = 0; i < ring_depth; ++i)
+	{
+		ring_busy[i] = false;
+		ring_bufs[i] = alloc_buffer(buffer_size, buffer_alignment);
+		if (!ring_bufs[i])
+		{
+			// use the synchronous writes with a single buffer instead
+			while (i > 0)
+				free_buffer(ring_bufs[--i], buffer_size);
+			delete ring;
+			ring = 0;
+			return;
+		}
+		iov[i].iov_base = ring_bufs[i];
+		iov[i].iov_len = buffer_size;
+	}
+	ring->register_buffers(iov, ring_depth);
+
+	out_buf = ring_bufs[0];
+#endif
+}
+
+void SparseFileWriter::preallocate(off_t expected_size)
+{
 	if (expected_size > 0)
+	{
+		++io_stats.fallocate;
 		posix_fallocate(fd, 0, expected_size);
+	}
+}
+
+void SparseFileWriter::attach(int new_fd)
+{
+	struct stat st;
+
+	fd = new_fd;
+	if (fstat(fd, &st) == -1)
+		throw IOError("fstat() failed on output file", errno);
+
+	stream = !S_ISREG(st.st_mode);
+	is_pipe = S_ISFIFO(st.st_mode);
+	if (stream)
+	{
+		can_clone = false;
+		can_copy_range = false;
+	}
+
+	setup_engine();
 }
 
 void SparseFileWriter::close()
@@ -171,46 +604,461 @@ void SparseFileWriter::close()
 	if (fd == -1)
 		throw std::runtime_error("File is already closed!");
 
+	flush();
+
 	if (::close(fd) == -1)
 		throw IOError("close() failed", errno);
 	fd = -1;
 }
 
+off_t SparseFileWriter::tell() const
+{
+	return offset;
+}
+
+void SparseFileWriter::write_all(struct iovec* iov, int iovcnt)
+{
+	while (iovcnt > 0)
+	{
+		ssize_t ret;
+
+		if (iovcnt == 1)
+		{
+			++io_stats.write;
+			ret = ::write(fd, iov->iov_base, iov->iov_len);
+		}
+		else
+		{
+			++io_stats.writev;
+			ret = ::writev(fd, iov, iovcnt);
+		}
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			throw IOError("write() failed", errno);
+
+		// skip the vectors written in full, and adjust the partial one
+		while (iovcnt > 0 && static_cast<size_t>(ret) >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0)
+		{
+			iov->iov_base = static_cast<char*>(iov->iov_base) + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+#ifdef ENABLE_IO_URING
+void SparseFileWriter::submit_buffer()
+{
+	// holes are flushed out of the buffer, so the data ends at offset
+	ring_offset[ring_cur] = offset - pending_hole - buf_filled;
+	ring_length[ring_cur] = buf_filled;
+	ring->prep_write(fd, out_buf, buf_filled, ring_offset[ring_cur],
+			ring_cur, ring_cur);
+	ring->submit();
+
+	ring_busy[ring_cur] = true;
+	++ring_in_flight;
+	ring_moved = true;
+
+	// continue in the next buffer, once its previous write completes
+	ring_cur = (ring_cur + 1) % ring_depth;
+	while (ring_busy[ring_cur])
+		reap_buffer();
+
+	out_buf = ring_bufs[ring_cur];
+	buf_filled = 0;
+}
+
+void SparseFileWriter::reap_buffer()
+{
+	uint64_t i;
+	int res = ring->wait(i);
+
+	ring_busy[i] = false;
+	--ring_in_flight;
+	if (res < 0)
+		throw IOError("io_uring write failed", -res);
+
+	// finish short writes synchronously, they should be rare
+	for (size_t done = res; done < ring_length[i];)
+	{
+		++io_stats.write;
+		ssize_t ret = pwrite(fd, static_cast<char*>(ring_bufs[i]) + done,
+				ring_length[i] - done, ring_offset[i] + done);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			throw IOError("pwrite() failed", errno);
+		done += ret;
+	}
+}
+#endif
+
+void SparseFileWriter::drain()
+{
+#ifdef ENABLE_IO_URING
+	if (!ring)
+		return;
+
+	while (ring_in_flight > 0)
+		reap_buffer();
+
+	// synchronous writes continue at the file position
+	if (ring_moved)
+	{
+		++io_stats.lseek;
+		if (lseek(fd, offset - pending_hole, SEEK_SET) == -1)
+			throw IOError("lseek() failed to update the file position", errno);
+		ring_moved = false;
+	}
+#endif
+}
+
+void SparseFileWriter::flush_buffer()
+{
+#ifdef ENABLE_IO_URING
+	if (ring)
+	{
+		if (buf_filled > 0)
+			submit_buffer();
+		return;
+	}
+#endif
+
+	if (buf_filled > 0)
+	{
+		struct iovec iov;
+		iov.iov_base = out_buf;
+		iov.iov_len = buf_filled;
+
+		write_all(&iov, 1);
+		buf_filled = 0;
+	}
+}
+
+void SparseFileWriter::seek_hole()
+{
+	if (pending_hole > 0 && ring)
+	{
+		// io_uring writes use explicit offsets, drain() seeks
+		pending_hole = 0;
+		ring_moved = true;
+	}
+	else if (pending_hole > 0)
+	{
+		// adjacent holes were merged, so this is one seek per run
+		++io_stats.lseek;
+		if (lseek(fd, pending_hole, SEEK_CUR) == -1)
+			throw IOError("lseek() failed to seek past sparse block", errno);
+		pending_hole = 0;
+	}
+}
+
+void SparseFileWriter::flush()
+{
+	flush_buffer();
+
+	if (pending_hole > 0)
+	{
+		// the file may end with the hole, so extend it explicitly
+		++io_stats.ftruncate;
+		if (ftruncate(fd, offset) == -1)
+			throw IOError("ftruncate() failed to extend the sparse file", errno);
+		seek_hole();
+	}
+
+	drain();
+}
+
 void SparseFileWriter::write(const void* data, size_t length)
+{
+	TraceSpan span("SparseFileWriter::write");
+
+	if (!out_buf)
+	{
+		out_buf = alloc_buffer(buffer_size, buffer_alignment);
+		if (!out_buf)
+			throw std::bad_alloc();
+	}
+
+	// data written past a hole must land after it
+	if (pending_hole > 0)
+		seek_hole();
+
+	if (buf_filled + length < buffer_size)
+	{
+		memcpy(static_cast<char*>(out_buf) + buf_filled, data, length);
+		buf_filled += length;
+	}
+#ifdef ENABLE_IO_URING
+	else if (ring)
+	{
+		const char* p = static_cast<const char*>(data);
+
+		// the buffers are submitted as they fill up
+		for (size_t left = length; left > 0;)
+		{
+			size_t step = buffer_size - buf_filled;
+			if (step > left)
+				step = left;
+
+			memcpy(static_cast<char*>(out_buf) + buf_filled, p, step);
+			buf_filled += step;
+			offset += step;
+			p += step;
+			left -= step;
+
+			if (buf_filled == buffer_size)
+				flush_buffer();
+		}
+		length = 0;
+	}
+#endif
+	else
+	{
+		// does not fit, write both in a single call
+		struct iovec iov[2];
+		iov[0].iov_base = out_buf;
+		iov[0].iov_len = buf_filled;
+		iov[1].iov_base = const_cast<void*>(data);
+		iov[1].iov_len = length;
+
+		if (buf_filled > 0)
+			write_all(iov, 2);
+		else
+			write_all(&iov[1], 1);
+		buf_filled = 0;
+	}
+
+	offset += length;
+	if (writeback && offset - written_back >= static_cast<off_t>(writeback))
+		write_back();
+}
+
+void SparseFileWriter::write_detect_sparse(const void* data, size_t length)
 {
 	const char* buf = static_cast<const char*>(data);
 
-	while (length > 0)
+	// all-zero if the first byte is zero and each byte equals the next
+	if (!stream && length > 0 && buf[0] == 0
+			&& !memcmp(buf, buf + 1, length - 1))
+		write_sparse(length);
+	else
+		write(data, length);
+}
+
+bool SparseFileWriter::clone_from(int in_fd, off_t in_offset, size_t length)
+{
+	if (!fs_block_size)
+	{
+		struct stat st;
+
+		if (fstat(fd, &st) == -1)
+			throw IOError("fstat() failed on output file", errno);
+		fs_block_size = st.st_blksize;
+	}
+
+	// reflinks work on whole filesystem blocks only
+	if (in_offset % fs_block_size || offset % fs_block_size
+			|| length % fs_block_size)
+		return false;
+
+	struct file_clone_range range;
+	range.src_fd = in_fd;
+	range.src_offset = in_offset;
+	range.src_length = length;
+	range.dest_offset = offset;
+
+	++io_stats.reflink;
+	if (ioctl(fd, FICLONERANGE, &range) == -1)
 	{
-		ssize_t ret = ::write(fd, buf, length);
+		// EINVAL may come from alignment requirements of this range
+		if (errno != EINVAL)
+			can_clone = false;
+		return false;
+	}
+
+	// the ioctl does not move the file position
+	++io_stats.lseek;
+	if (lseek(fd, length, SEEK_CUR) == -1)
+		throw IOError("lseek() failed to seek past cloned range", errno);
+	return true;
+}
+
+size_t SparseFileWriter::splice_from(int in_fd, off_t in_offset, size_t length)
+{
+	size_t copied = 0;
 
+	while (copied < length)
+	{
+		loff_t in_pos = in_offset + copied;
+
+		++io_stats.splice;
+		ssize_t ret = splice(in_fd, &in_pos, fd, 0, length - copied,
+				SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && (errno == EINVAL || errno == ENOSYS))
+		{
+			is_pipe = false;
+			break;
+		}
 		if (ret == -1)
-			throw IOError("write() failed", errno);
+			throw IOError("splice() failed", errno);
+		if (ret == 0)
+			break;
+
+		copied += ret;
+	}
+
+	offset += copied;
+	return copied;
+}
+
+size_t SparseFileWriter::copy_from(int in_fd, off_t in_offset, size_t length)
+{
+	TraceSpan span("SparseFileWriter::copy_from");
+
+	if (!is_pipe && !can_clone && !can_copy_range)
+		return 0;
+
+	// the kernel writes at the file position
+	flush_buffer();
+	seek_hole();
+	drain();
+
+	if (is_pipe)
+		return splice_from(in_fd, in_offset, length);
+
+	size_t copied = 0;
+
+	if (can_clone && length > 0 && clone_from(in_fd, in_offset, length))
+		copied = length;
+
+	while (can_copy_range && copied < length)
+	{
+		loff_t in_pos = in_offset + copied;
+
+		++io_stats.copy_file_range;
+		ssize_t ret = copy_file_range(in_fd, &in_pos, fd, 0,
+				length - copied, 0);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+		{
+			// unsupported for this pair of files, do not retry
+			if (ret == -1 && errno != EIO && errno != ENOSPC)
+				can_copy_range = false;
+			else if (ret == -1)
+				throw IOError("copy_file_range() failed", errno);
+			break;
+		}
+
+		copied += ret;
+	}
+
+	offset += copied;
+	if (writeback && offset - written_back >= static_cast<off_t>(writeback))
+		write_back();
+
+	return copied;
+}
+
+void SparseFileWriter::set_writeback(size_t bytes)
+{
+	writeback = bytes;
+	written_back = offset;
+}
+
+void SparseFileWriter::write_back()
+{
+	flush_buffer();
+	drain();
+
+	off_t length = offset - written_back;
+
+	// both are only hints, so ignore failures
+	sync_file_range(fd, written_back, length, SYNC_FILE_RANGE_WAIT_BEFORE
+			| SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, written_back, length, POSIX_FADV_DONTNEED);
+
+	written_back = offset;
+}
+
+// never modified, so it can be safely spliced into pipes
+static const char zero_buf[65536] = { 0 };
+
+void SparseFileWriter::write_zeros(size_t length)
+{
+	if (is_pipe && length > 0)
+		flush_buffer();
+
+	while (is_pipe && length > 0)
+	{
+		struct iovec iov;
+		iov.iov_base = const_cast<char*>(zero_buf);
+		iov.iov_len = length < sizeof(zero_buf) ? length : sizeof(zero_buf);
+
+		++io_stats.vmsplice;
+		ssize_t ret = vmsplice(fd, &iov, 1, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1 && (errno == EINVAL || errno == ENOSYS))
+		{
+			is_pipe = false;
+			break;
+		}
+		if (ret == -1)
+			throw IOError("vmsplice() failed", errno);
+
 		length -= ret;
-		buf += ret;
 		offset += ret;
 	}
+
+	while (length > 0)
+	{
+		size_t step = length < sizeof(zero_buf) ? length : sizeof(zero_buf);
+
+		write(zero_buf, step);
+		length -= step;
+	}
 }
 
 void SparseFileWriter::write_sparse(size_t length)
 {
-	off_t past = offset + length;
+	TraceSpan span("SparseFileWriter::write_sparse");
 
-	if (ftruncate(fd, past) == -1)
-		throw IOError("ftruncate() failed to extend the sparse file", errno);
-	if (lseek(fd, length, SEEK_CUR) == -1)
-		throw IOError("lseek() failed to seek past sparse block", errno);
+	if (stream)
+	{
+		write_zeros(length);
+		return;
+	}
 
-	offset = past;
+	// the seek is deferred until the next write, merging adjacent holes
+	flush_buffer();
+	pending_hole += length;
+	offset += length;
 }
 
-TemporarySparseFileWriter::TemporarySparseFileWriter()
+TemporarySparseFileWriter::TemporarySparseFileWriter(
+		const struct io_settings* new_io)
+	: SparseFileWriter(new_io), parent_pid(0)
 {
 }
 
 TemporarySparseFileWriter::~TemporarySparseFileWriter()
 {
-	if (buf[0] == '\0')
+	if (path.empty())
 		return;
 
 	// unlink the file only in parent process
@@ -218,22 +1066,94 @@ TemporarySparseFileWriter::~TemporarySparseFileWriter()
 		unlink(name());
 }
 
-void TemporarySparseFileWriter::open(off_t expected_size)
+void TemporarySparseFileWriter::open(const char* dir, off_t expected_size)
 {
 	parent_pid = getpid();
 
-	strcpy(buf, tmpfile_template);
-	fd = mkstemp(buf);
+	std::string buf = std::string(dir) + '/' + tmpfile_template;
+	fd = mkostemp(&buf[0], O_CLOEXEC);
 	if (fd == -1)
 		throw IOError("Unable to create a temporary file", errno);
+	path = buf;
 
-	if (expected_size > 0)
-		posix_fallocate(fd, 0, expected_size);
+	preallocate(expected_size);
+	setup_engine();
+}
+
+const char* temporary_directory(const char* tmpdir)
+{
+	if (!tmpdir)
+		tmpdir = getenv("TMPDIR");
+#ifdef _P_tmpdir
+	if (!tmpdir)
+		tmpdir = P_tmpdir;
+#endif
+	if (!tmpdir)
+		tmpdir = "/tmp";
+
+	return tmpdir;
+}
+
+int spool_stream(int in_fd, const char* dir)
+{
+	TraceSpan span("spool_stream");
+
+	static const size_t spool_buffer = 1024 * 1024;
+	static const size_t page_size = 4096;
+
+	TemporarySparseFileWriter spool;
+	std::vector<char> buf(spool_buffer);
+	bool eof = false;
+
+	spool.open(dir);
+	while (!eof)
+	{
+		size_t filled = 0;
+
+		// fill the whole buffer, so that the pages are file-aligned
+		while (filled < buf.size())
+		{
+			ssize_t ret = ::read(in_fd, &buf[filled], buf.size() - filled);
+
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret == -1)
+				throw IOError("read() failed on input stream", errno);
+			if (ret == 0)
+			{
+				eof = true;
+				break;
+			}
+			filled += ret;
+		}
+
+		for (size_t i = 0; i < filled; i += page_size)
+			spool.write_detect_sparse(&buf[i],
+					std::min(page_size, filled - i));
+	}
+	spool.flush();
+
+	// the file disappears with the last descriptor
+	int fd = fcntl(spool.fd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
+		throw IOError("Unable to duplicate the spool descriptor", errno);
+
+	try
+	{
+		spool.close();
+	}
+	catch (...)
+	{
+		::close(fd);
+		throw;
+	}
+
+	return fd;
 }
 
 const char* TemporarySparseFileWriter::name()
 {
-	return buf;
+	return path.c_str();
 }
 
 void TemporarySparseFileWriter::close()
@@ -243,5 +1163,5 @@ void TemporarySparseFileWriter::close()
 	// unlink the file only in parent process
 	if (parent_pid == getpid() && unlink(name()) == -1)
 		throw IOError("Unable to unlink the temporary file", errno);
-	buf[0] = '\0';
+	path.clear();
 }
@@ -7,8 +7,11 @@
 #ifndef SDT_UTIL_HXX
 #define SDT_UTIL_HXX 1
 
+#include <atomic>
 #include <cstdlib> // size_t (maybe take it from somewhere else?)
 #include <ios>
+#include <mutex>
+#include <ostream>
 #include <stdexcept>
 #include <string>
 
@@ -19,6 +22,7 @@
 extern "C"
 {
 #include <sys/types.h>
+#include <sys/uio.h>
 #ifdef HAVE_STDINT_H
 #	include <stdint.h>
 #endif
@@ -27,6 +31,8 @@ extern "C"
 #endif
 }
 
+#include "libsquashdelta.h"
+
 /**
  * Utility classes.
  */
@@ -58,6 +64,9 @@ typedef LittleEndian<uint16_t> le16;
 typedef LittleEndian<uint32_t> le32;
 typedef LittleEndian<uint64_t> le64;
 
+// parse a size with an optional K, M or G (binary) suffix
+size_t parse_size(const char* str);
+
 // few common exception types
 class IOError : public std::runtime_error
 {
@@ -67,24 +76,130 @@ public:
 	IOError(const char* text, int new_errno);
 };
 
+namespace mmap_flags
+{
+	enum mmap_flags
+	{
+		// prefault the whole mapping on open()
+		populate = 1 << 0,
+		// hint transparent huge pages for the mapping
+		huge_pages = 1 << 1
+	};
+}
+
+namespace access_pattern
+{
+	enum access_pattern
+	{
+		normal,
+		// read ahead of the cursor, optionally dropping pages behind it
+		sequential,
+		random
+	};
+}
+
+namespace io_engine
+{
+	enum io_engine
+	{
+		mmap,
+		uring
+	};
+}
+
+// accounting of mapped memory against the limit of a session
+class MemoryBudget
+{
+	mutable std::mutex lock;
+	size_t limit;
+	size_t used;
+
+public:
+	MemoryBudget();
+
+	void set_limit(size_t new_limit);
+	size_t get_limit() const;
+
+	void reserve(size_t bytes);
+	void release(size_t bytes);
+};
+
+// I/O settings of a session, given to the readers and writers it opens
+struct io_settings
+{
+	// uring falls back to mmap at runtime if the kernel does not
+	// support it
+	io_engine::io_engine engine;
+	MemoryBudget budget;
+
+	io_settings();
+};
+
+// allocator for the large buffers, set by the library for the duration
+// of its calls; buffers must be freed on the thread allocating them
+extern thread_local const struct sqdelta_allocator* buffer_allocator;
+
+// returns 0 on failure
+void* alloc_buffer(size_t size, size_t alignment);
+void free_buffer(void* ptr, size_t size);
+
 // MMAP-based file reader
+//
+// In windowed mode, only a region of the file is mapped at a time
+// and it is moved transparently by peek/read. The pointers returned
+// are valid only until the next peek/read on the same object then.
 class MMAPFile
 {
 	int fd;
-	void* data;
+	bool owner;
+	int flags;
+	// the mappings are accounted against its budget, if any
+	struct io_settings* io;
+
+	// current mapping: the whole file, or a window of it
+	char* map;
+	size_t map_offset;
+	size_t map_length;
+	bool own_map;
+
 	size_t length;
+	size_t window;
+	size_t pos;
 
-	char* pos;
-	char* end;
+	// access hints, per copy
+	size_t readahead;
+	bool drop_behind;
+	size_t ra_end;
+	size_t drop_start;
 
 	void close();
+	void map_range(size_t offset, size_t min_length);
+	void unmap();
+
+	void hint_range(size_t start, size_t stop, int advice);
+	void slide_window();
 
 public:
+	static const size_t default_readahead = 8 * 1024 * 1024;
+
 	MMAPFile();
 	MMAPFile(const MMAPFile& ref);
 	~MMAPFile();
 
-	void open(const char* path);
+	// window == 0 maps the whole file
+	void open(const char* path, int new_flags = 0,
+			size_t new_readahead = default_readahead,
+			size_t new_window = 0, struct io_settings* new_io = 0);
+	// take over an open descriptor of a seekable file
+	void open(int new_fd, int new_flags = 0,
+			size_t new_readahead = default_readahead,
+			size_t new_window = 0, struct io_settings* new_io = 0);
+
+	// set the hint for the following pass over the file
+	void advise(access_pattern::access_pattern pattern,
+			bool new_drop_behind = false);
+	// prefetch a region that will be read soon
+	void will_need(size_t offset, size_t length);
 
 	template <class T>
 	const T& peek();
@@ -96,8 +211,14 @@ public:
 	template <class T>
 	const T* read_array(size_t n);
 
+	int getfd() const;
+	struct io_settings* settings() const;
 	size_t getpos() const;
 	size_t getlen() const;
+	// the largest read that does not need remapping
+	size_t window_size() const;
+	// size of the mapping held by this object
+	size_t mapped_size() const;
 	void seek(ssize_t offset,
 			std::ios_base::seekdir whence = std::ios_base::cur);
 };
@@ -117,11 +238,17 @@ const T& MMAPFile::read()
 template <class T>
 const T* MMAPFile::peek_array(size_t n)
 {
+	size_t bytes = sizeof(T) * n;
+
 	// ensure we don't run out of data :)
-	if (!pos || pos + sizeof(T) * n > end)
+	if (fd == -1 || pos + bytes > length)
 		throw std::runtime_error("EOF while reading");
 
-	return static_cast<T*>(static_cast<void*>(pos));
+	if (pos < map_offset || pos + bytes > map_offset + map_length)
+		map_range(pos, bytes);
+
+	void* ret = static_cast<void*>(map + (pos - map_offset));
+	return static_cast<T*>(ret);
 }
 
 template <class T>
@@ -132,21 +259,112 @@ const T* MMAPFile::read_array(size_t n)
 	return ret;
 }
 
+// syscall counters of all the writers, for the statistics
+struct io_stats
+{
+	std::atomic<uint64_t> write;
+	std::atomic<uint64_t> writev;
+	std::atomic<uint64_t> lseek;
+	std::atomic<uint64_t> ftruncate;
+	std::atomic<uint64_t> fallocate;
+	std::atomic<uint64_t> reflink;
+	std::atomic<uint64_t> copy_file_range;
+	std::atomic<uint64_t> splice;
+	std::atomic<uint64_t> vmsplice;
+	std::atomic<uint64_t> io_uring_enter;
+};
+
+extern struct io_stats io_stats;
+
+void print_io_stats(std::ostream& out);
+
+class IOUring;
+
+// Buffered writer for the expanded files. Writes are batched in a large
+// aligned buffer, holes are deferred and merged into a single seek.
+// Nothing reaches the file before flush() or close().
 class SparseFileWriter
 {
+	static const size_t buffer_size = 1024 * 1024;
+	static const size_t buffer_alignment = 4096;
+	// buffers in flight with the io_uring engine
+	static const unsigned ring_depth = 4;
+
 	off_t offset;
+	off_t pending_hole;
+
+	void* out_buf;
+	size_t buf_filled;
+
+	// io_uring engine: full buffers are written asynchronously
+	// at explicit offsets, the file position is updated in drain()
+	IOUring* ring;
+	void* ring_bufs[ring_depth];
+	off_t ring_offset[ring_depth];
+	size_t ring_length[ring_depth];
+	bool ring_busy[ring_depth];
+	unsigned ring_cur;
+	unsigned ring_in_flight;
+	bool ring_moved;
+
+	off_t written_back;
+	size_t writeback;
+
+	// kernel-side copies, disabled after the first failure
+	bool can_clone;
+	bool can_copy_range;
+	blksize_t fs_block_size;
+
+	// non-seekable output (pipe, socket...)
+	bool stream;
+	bool is_pipe;
+
+	const struct io_settings* io;
+
+	void write_all(struct iovec* iov, int iovcnt);
+	void submit_buffer();
+	void reap_buffer();
+	void drain();
+	void flush_buffer();
+	void seek_hole();
+	void write_back();
+	bool clone_from(int in_fd, off_t in_offset, size_t length);
+	size_t splice_from(int in_fd, off_t in_offset, size_t length);
+	void write_zeros(size_t length);
+
+protected:
+	void preallocate(off_t expected_size);
+	void setup_engine();
 
 public:
 	int fd;
 
-	SparseFileWriter();
+	SparseFileWriter(const struct io_settings* new_io = 0);
 	virtual ~SparseFileWriter();
 
+	// expected_size > 0 preallocates the file, which loses sparseness
 	void open(const char* path, off_t expected_size = 0);
+	// take over an open descriptor, possibly a pipe; holes are
+	// written as zeros to non-seekable outputs
+	void attach(int new_fd);
+	void flush();
 	void close();
 
+	off_t tell() const;
+
+	// flush the written data and drop it from the page cache
+	// every 'bytes', to keep the cache from growing unbounded
+	void set_writeback(size_t bytes);
+
 	void write(const void* data, size_t length);
 	void write_sparse(size_t length);
+	// write, or leave a hole if the data is all zeros
+	void write_detect_sparse(const void* data, size_t length);
+
+	// copy data from another file without passing it through userspace
+	// (reflink, copy_file_range() or splice() to a pipe); returns
+	// the number of bytes copied, the caller needs to write() the rest
+	size_t copy_from(int in_fd, off_t in_offset, size_t length);
 
 	template <class T>
 	void write(const T& data);
@@ -160,16 +378,23 @@ void SparseFileWriter::write(const T& data)
 
 static const char tmpfile_template[] = "tmp.XXXXXX";
 
+// tmpdir if given, $TMPDIR or the system default otherwise
+const char* temporary_directory(const char* tmpdir = 0);
+
+// copy a non-seekable input (pipe, socket...) into an unlinked temporary
+// file in dir, leaving holes for the zero pages, and return its descriptor
+int spool_stream(int in_fd, const char* dir);
+
 class TemporarySparseFileWriter : public SparseFileWriter
 {
-	char buf[sizeof(tmpfile_template)];
+	std::string path;
 	pid_t parent_pid;
 
 public:
-	TemporarySparseFileWriter();
+	TemporarySparseFileWriter(const struct io_settings* new_io = 0);
 	virtual ~TemporarySparseFileWriter();
 
-	void open(off_t expected_size = 0);
+	void open(const char* dir, off_t expected_size = 0);
 	void close();
 
 	const char* name();